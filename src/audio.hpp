@@ -1,9 +1,14 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstring>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <optional>
+#include <vector>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -15,35 +20,170 @@ extern "C" {
 
 #include "decoder.hpp"
 #include "encoder.hpp"
+#include "interleave.hpp"
 #include "rational.hpp"
+#include "sample_format.hpp"
+#include "sample_time.hpp"
 
 namespace potamos {
 
-template <typename SampleType>
+// Channel count used for streams whose channel count is only known at run
+// time.
+constexpr int kDynamicChannels = 0;
+
+// Samples of all channels at one point in time. With a fixed channel count
+// the samples are stored inline, so creating a sample never allocates.
+template <typename SampleType, int kChannels = kDynamicChannels>
 class AudioSample {
  public:
-  AudioSample(int channels) : samples_(channels, SampleType()), time_(0, 1) {}
+  AudioSample(int channels = kChannels) : samples_() {
+    assert(channels == kChannels);
+    (void)channels;
+  }
 
   SampleType& sample(int channel) { return samples_[channel]; }
   const SampleType& sample(int channel) const { return samples_[channel]; }
-  Rational<int64_t>& time() { return time_; }
-  const Rational<int64_t>& time() const { return time_; }
+  SampleTime& time() { return time_; }
+  const SampleTime& time() const { return time_; }
+
+ private:
+  std::array<SampleType, kChannels> samples_;
+  SampleTime time_;
+};
+
+template <typename SampleType>
+class AudioSample<SampleType, kDynamicChannels> {
+ public:
+  AudioSample(int channels) : samples_(channels, SampleType()) {}
+
+  SampleType& sample(int channel) { return samples_[channel]; }
+  const SampleType& sample(int channel) const { return samples_[channel]; }
+  SampleTime& time() { return time_; }
+  const SampleTime& time() const { return time_; }
 
  private:
   std::vector<SampleType> samples_;
-  Rational<int64_t> time_;
+  SampleTime time_;
 };
 
+// A run of consecutive samples exposed as one contiguous array per channel.
+// The block does not own the samples, it stays valid until the next read from
+// the decoder that produced it.
 template <typename SampleType>
+class AudioBlock {
+ public:
+  AudioBlock(const SampleType* const* channels, int channel_count,
+             int64_t size, SampleTime time, int sample_rate)
+      : channels_(channels),
+        channel_count_(channel_count),
+        size_(size),
+        time_(time),
+        sample_rate_(sample_rate) {}
+
+  const SampleType* const* channels() const { return channels_; }
+  const SampleType* channel(int channel) const { return channels_[channel]; }
+  const SampleType& sample(int channel, int64_t index) const {
+    return channels_[channel][index];
+  }
+  // Time of the first sample in the block.
+  const SampleTime& time() const { return time_; }
+
+  int Channels() const { return channel_count_; }
+  int64_t Size() const { return size_; }
+  int SampleRate() const { return sample_rate_; }
+
+ private:
+  const SampleType* const* channels_;
+  int channel_count_;
+  int64_t size_;
+  SampleTime time_;
+  int sample_rate_;
+};
+
+// Reads samples of a decoded audio stream. With a fixed kChannels the stream
+// must have exactly that many channels, otherwise nothing is read.
+template <typename SampleType, int kChannels = kDynamicChannels>
 class AudioDecoder {
  public:
-  AudioDecoder(Decoder& decoder)
+  // Frames in any sample format are converted to SampleType, dither applies
+  // to conversions that lose precision.
+  AudioDecoder(Decoder& decoder, DitherMode dither = DitherMode::kNone)
       : decoder_(decoder),
-        planar_(av_sample_fmt_is_planar(decoder_.data()->sample_fmt)) {}
-  std::optional<AudioSample<SampleType>> Read() {
-    while (!frame_) {
+        dither_mode_(dither),
+        // A seek before construction still has its target to land on.
+        seek_epoch_(0) {
+    // Until the first frame arrives the stream parameters stand in for it.
+    const AVCodecParameters* params = decoder_.CodecParameters();
+    SetFormat((AVSampleFormat)params->format, params->ch_layout.nb_channels);
+  }
+
+  std::optional<AudioSample<SampleType, kChannels>> Read() {
+    if (!NextFrame()) return std::nullopt;
+    const int channels = kChannels != kDynamicChannels ? kChannels : Channels();
+    AudioSample<SampleType, kChannels> sample(channels);
+    for (int i = 0; i < channels; ++i) {
+      sample.sample(i) = channels_[i][index_];
+    }
+    sample.time() = time_;
+    ++time_;
+    ++index_;
+    return sample;
+  }
+
+  // Reads up to max_samples consecutive samples, or the rest of the current
+  // frame when max_samples is 0. Blocks never span frame boundaries.
+  std::optional<AudioBlock<SampleType>> ReadBlock(int64_t max_samples = 0) {
+    if (!NextFrame()) return std::nullopt;
+    int64_t size = size_ - index_;
+    if (max_samples > 0) size = std::min(size, max_samples);
+    for (int i = 0; i < Channels(); ++i) {
+      block_channels_[i] = channels_[i] + index_;
+    }
+    AudioBlock<SampleType> block(block_channels_.data(), Channels(), size,
+                                 time_, frame_->data()->sample_rate);
+    time_ += size;
+    index_ += size;
+    return block;
+  }
+
+  int Channels() const { return channel_count_; }
+
+ protected:
+  // Takes the layout of the samples from a frame. Returns false if a fixed
+  // kChannels does not match.
+  bool SetFormat(AVSampleFormat format, int channels) {
+    planar_ = av_sample_fmt_is_planar(format);
+    convert_ = !IsSampleFormatOf<SampleType>(format);
+    if (channels != channel_count_) {
+      channel_count_ = channels;
+      channels_.resize(channels);
+      block_channels_.resize(channels);
+      planes_.resize(channels);
+    }
+    if (kChannels != kDynamicChannels && channels > 0 &&
+        channels != kChannels) {
+      std::cerr << "AudioDecoder expects " << kChannels
+                << " channels, the stream has " << channels << std::endl;
+      channel_mismatch_ = true;
+      return false;
+    }
+    return true;
+  }
+
+  // Makes sure there is a frame with samples left to read, fetching the next
+  // one from the decoder when the current one is used up.
+  bool NextFrame() {
+    if (channel_mismatch_) return false;
+    if (decoder_.SeekEpoch() != seek_epoch_) {
+      seek_epoch_ = decoder_.SeekEpoch();
+      seek_target_ = decoder_.SeekTarget();
+      frame_ = std::nullopt;
+    }
+    if (frame_ && index_ < size_) return true;
+    frame_ = std::nullopt;
+    while (!frame_ || index_ >= size_) {
       frame_ = decoder_.Read();
-      if (!frame_) return std::nullopt;
+      if (!frame_) return false;
       if (frame_->data()->flags & AV_FRAME_FLAG_DISCARD) {
         frame_ = std::nullopt;
         continue;
@@ -60,66 +200,138 @@ class AudioDecoder {
       while (skip_ > frame_->data()->nb_samples) {
         skip_ -= frame_->data()->nb_samples;
         frame_ = decoder_.Read();
-        if (!frame_) return std::nullopt;
+        if (!frame_) return false;
         size_ = frame_->data()->nb_samples;
       }
       index_ = skip_;
+      if (seek_target_ && !SkipToSeekTarget()) frame_ = std::nullopt;
     }
-    AudioSample<SampleType> sample(Channels());
-    if (planar_) {
+    seek_target_ = std::nullopt;
+    const AVFrame* frame = frame_->data();
+    if (!SetFormat((AVSampleFormat)frame->format,
+                   frame->ch_layout.nb_channels)) {
+      frame_ = std::nullopt;
+      return false;
+    }
+    time_ = SampleTime(frame->pts, decoder_.TimeBase(), index_,
+                       frame->sample_rate);
+    LoadChannels();
+    return true;
+  }
+
+  // Moves index_ to the first sample at or after the seek target. Returns
+  // false if the whole frame lies before it.
+  bool SkipToSeekTarget() {
+    const AVFrame* frame = frame_->data();
+    const Rational<int64_t> start =
+        Rational<int64_t>(frame->pts, 1) * decoder_.TimeBase();
+    const Rational<int64_t> ahead =
+        (*seek_target_ - start) * Rational<int64_t>(frame->sample_rate, 1);
+    if (ahead.Num() <= 0) return true;
+    const int64_t offset = (ahead.Num() + ahead.Den() - 1) / ahead.Den();
+    if (offset >= size_) return false;
+    index_ = std::max(index_, offset);
+    return true;
+  }
+
+  // Points channels_ at the samples of the current frame. Packed frames are
+  // split and frames in other sample formats converted into buffer_ once per
+  // frame so reads never stride.
+  void LoadChannels() {
+    const AVFrame* frame = frame_->data();
+    if (planar_ && !convert_) {
       for (int i = 0; i < Channels(); ++i) {
-        sample.sample(i) = ((SampleType*)frame_->data()->data[i])[index_];
-        sample.time() =
-            Rational<int64_t>(frame_->data()->pts, 1) * decoder_.TimeBase() +
-            Rational<int64_t>(index_, frame_->data()->sample_rate);
+        channels_[i] = (const SampleType*)frame->extended_data[i];
       }
-    } else {
+      return;
+    }
+    const int64_t nb_samples = frame->nb_samples;
+    const size_t buffer_size = nb_samples * Channels();
+    if (buffer_.size() < buffer_size) buffer_.resize(buffer_size);
+    for (int i = 0; i < Channels(); ++i) {
+      planes_[i] = buffer_.data() + i * nb_samples;
+      channels_[i] = planes_[i];
+    }
+    const AVSampleFormat format = (AVSampleFormat)frame->format;
+    if (planar_) {
       for (int i = 0; i < Channels(); ++i) {
-        sample.sample(i) =
-            ((SampleType*)frame_->data()->data[0])[index_ * Channels() + i];
-        sample.time() =
-            Rational<int64_t>(frame_->data()->pts, 1) * decoder_.TimeBase() +
-            Rational<int64_t>(index_, frame_->data()->sample_rate);
+        ConvertToSamples(frame->extended_data[i], format, nb_samples,
+                         planes_[i], Dither());
       }
+    } else if (!convert_) {
+      Deinterleave((const SampleType*)frame->data[0], Channels(), nb_samples,
+                   planes_.data());
+    } else {
+      if (packed_.size() < buffer_size) packed_.resize(buffer_size);
+      ConvertToSamples(frame->data[0], format, buffer_size, packed_.data(),
+                       Dither());
+      Deinterleave(packed_.data(), Channels(), nb_samples, planes_.data());
     }
-    ++index_;
-    if (index_ >= size_) {
-      frame_ = std::nullopt;
-    }
-    return sample;
   }
 
-  int Channels() const { return decoder_.data()->ch_layout.nb_channels; }
+  TpdfDither* Dither() {
+    return dither_mode_ == DitherMode::kTpdf ? &dither_ : nullptr;
+  }
 
- protected:
   Decoder& decoder_;
-  bool planar_;
-  int64_t index_;
-  int64_t size_;
+  bool planar_ = false;
+  bool convert_ = false;
+  int channel_count_ = 0;
+  bool channel_mismatch_ = false;
+  DitherMode dither_mode_;
+  TpdfDither dither_;
+  int64_t index_ = 0;
+  int64_t size_ = 0;
+  SampleTime time_;
+  int64_t seek_epoch_;
+  std::optional<Rational<int64_t>> seek_target_;
   std::optional<Frame> frame_;
+  std::vector<const SampleType*> channels_;
+  std::vector<const SampleType*> block_channels_;
+  std::vector<SampleType*> planes_;
+  std::vector<SampleType> buffer_;
+  std::vector<SampleType> packed_;
 };
 
-template <typename SampleType>
+// Encodes audio samples. With a fixed kChannels the encoder must have
+// exactly that many channels, otherwise nothing is written. The writes
+// return false once encoding or writing a packet has failed.
+template <typename SampleType, int kChannels = kDynamicChannels>
 class AudioEncoder {
  public:
-  AudioEncoder(Encoder& encoder)
+  // Samples are converted to the sample format of the encoder, dither
+  // applies to conversions that lose precision.
+  AudioEncoder(Encoder& encoder, DitherMode dither = DitherMode::kNone)
       : encoder_(encoder),
-        planar_(av_sample_fmt_is_planar(encoder_.data()->sample_fmt)) {
-    encoder_.data()->time_base = av_make_q(1, encoder_.data()->sample_rate);
+        planar_(av_sample_fmt_is_planar(encoder_.data()->sample_fmt)),
+        format_(encoder_.data()->sample_fmt),
+        convert_(!IsSampleFormatOf<SampleType>(format_)),
+        dither_mode_(dither),
+        sources_(Channels()),
+        planes_(Channels()) {
+    if (kChannels != kDynamicChannels && Channels() != kChannels) {
+      std::cerr << "AudioEncoder expects " << kChannels
+                << " channels, the encoder has " << Channels() << std::endl;
+      channel_mismatch_ = true;
+    }
   }
 
-  void Write(const AudioSample<SampleType>& sample) {
+  bool Write(const AudioSample<SampleType, kChannels>& sample) {
+    if (channel_mismatch_) return false;
+    if (convert_) return WriteInterleaved(&sample.sample(0), 1);
     if (!frame_) {
-      frame_ = encoder_.MakeFrame();
+      frame_ = MakeFrame();
       index_ = 0;
     }
+    const int channels = kChannels != kDynamicChannels ? kChannels : Channels();
     if (planar_) {
-      for (int i = 0; i < Channels(); ++i) {
-        ((SampleType*)frame_->data()->data[i])[index_] = sample.sample(i);
+      for (int i = 0; i < channels; ++i) {
+        ((SampleType*)frame_->data()->extended_data[i])[index_] =
+            sample.sample(i);
       }
     } else {
-      for (int i = 0; i < Channels(); ++i) {
-        ((SampleType*)frame_->data()->data[0])[index_ * Channels() + i] =
+      for (int i = 0; i < channels; ++i) {
+        ((SampleType*)frame_->data()->data[0])[index_ * channels + i] =
             sample.sample(i);
       }
     }
@@ -128,26 +340,169 @@ class AudioEncoder {
     if (index_ >= frame_->data()->nb_samples) {
       WriteCurrentFrame();
     }
+    return !failed_;
   }
 
-  void Flush() {
-    if (!frame_) {
-      int ret = encoder_.Flush();
-      if (ret < 0)
-        std::cerr << "Flushing encoder failed = " << ret << std::endl;
+  // Writes size samples given as one array per channel.
+  bool WriteBlock(const SampleType* const* channels, int64_t size) {
+    if (channel_mismatch_) return false;
+    for (int64_t offset = 0; offset < size;) {
+      const int64_t count = PrepareFrame(size - offset);
+      AVFrame* frame = frame_->data();
+      if (planar_) {
+        for (int i = 0; i < Channels(); ++i) {
+          CopySamples(channels[i] + offset, count,
+                      frame->extended_data[i] + index_ * SampleSize());
+        }
+      } else {
+        for (int i = 0; i < Channels(); ++i) {
+          sources_[i] = channels[i] + offset;
+        }
+        SampleType* packed = (SampleType*)frame->data[0] + index_ * Channels();
+        if (convert_) packed = Scratch(count * Channels());
+        Interleave(sources_.data(), Channels(), count, packed);
+        if (convert_) {
+          CopySamples(packed, count * Channels(),
+                      frame->data[0] + index_ * Channels() * SampleSize());
+        }
+      }
+      offset += count;
+      FinishSamples(count);
+    }
+    return !failed_;
+  }
+
+  bool WriteBlock(const AudioBlock<SampleType>& block) {
+    return WriteBlock(block.channels(), block.Size());
+  }
+
+  // Writes size samples stored channel by channel, ie. with the layout of
+  // packed sample formats.
+  bool WriteInterleaved(const SampleType* samples, int64_t size) {
+    if (channel_mismatch_) return false;
+    for (int64_t offset = 0; offset < size;) {
+      const int64_t count = PrepareFrame(size - offset);
+      AVFrame* frame = frame_->data();
+      const SampleType* packed = samples + offset * Channels();
+      if (planar_) {
+        SampleType* scratch = convert_ ? Scratch(count * Channels()) : nullptr;
+        for (int i = 0; i < Channels(); ++i) {
+          planes_[i] = convert_ ? scratch + i * count
+                                : (SampleType*)frame->extended_data[i] + index_;
+        }
+        Deinterleave(packed, Channels(), count, planes_.data());
+        for (int i = 0; convert_ && i < Channels(); ++i) {
+          CopySamples(planes_[i], count,
+                      frame->extended_data[i] + index_ * SampleSize());
+        }
+      } else {
+        CopySamples(packed, count * Channels(),
+                    frame->data[0] + index_ * Channels() * SampleSize());
+      }
+      offset += count;
+      FinishSamples(count);
+    }
+    return !failed_;
+  }
+
+  // Writes a frame that is already in the encoder's sample format and channel
+  // count, e.g. from an AudioResampler. Returns false otherwise.
+  bool WriteFrame(const Frame& frame) {
+    const AVFrame* in = frame.data();
+    if (channel_mismatch_) return false;
+    if (in->format != format_ || in->ch_layout.nb_channels != Channels()) {
+      std::cerr << "AudioEncoder::WriteFrame expects frames in the encoder's "
+                   "sample format and channel count"
+                << std::endl;
+      return false;
+    }
+    const int64_t bytes = SampleSize();
+    for (int64_t offset = 0; offset < in->nb_samples;) {
+      const int64_t count = PrepareFrame(in->nb_samples - offset);
+      AVFrame* out = frame_->data();
+      if (planar_) {
+        for (int i = 0; i < Channels(); ++i) {
+          std::memcpy(out->extended_data[i] + index_ * bytes,
+                      in->extended_data[i] + offset * bytes, count * bytes);
+        }
+      } else {
+        const int64_t stride = bytes * Channels();
+        std::memcpy(out->data[0] + index_ * stride,
+                    in->data[0] + offset * stride, count * stride);
+      }
+      offset += count;
+      FinishSamples(count);
     }
-    WriteCurrentFrame();
-    int ret = encoder_.Flush();
-    if (ret < 0) std::cerr << "Flushing encoder failed = " << ret << std::endl;
+    return !failed_;
+  }
+
+  bool Flush() {
+    if (frame_) WriteCurrentFrame();
+    if (!encoder_.Flush()) {
+      std::cerr << "Flushing encoder failed" << std::endl;
+      failed_ = true;
+    }
+    return !failed_;
   }
 
   int Channels() const { return encoder_.data()->ch_layout.nb_channels; }
 
  protected:
+  // Makes sure there is a frame to fill and returns how many of the
+  // requested samples fit in it.
+  int64_t PrepareFrame(int64_t requested) {
+    if (!frame_) {
+      frame_ = MakeFrame();
+      index_ = 0;
+    }
+    return std::min<int64_t>(requested, frame_->data()->nb_samples - index_);
+  }
+
+  // Copies count samples to frame data, converting them to the sample format
+  // of the encoder if needed.
+  void CopySamples(const SampleType* src, int64_t count, uint8_t* dst) {
+    if (convert_) {
+      ConvertFromSamples(src, count, format_, dst, Dither());
+    } else {
+      std::copy_n(src, count, (SampleType*)dst);
+    }
+  }
+
+  Frame MakeFrame() const {
+    const AVCodecContext* context = encoder_.data();
+    return Frame(context->sample_fmt, &context->ch_layout,
+                 context->frame_size > 0 ? context->frame_size : 1024);
+  }
+
+  SampleType* Scratch(size_t size) {
+    if (scratch_.size() < size) scratch_.resize(size);
+    return scratch_.data();
+  }
+
+  int SampleSize() const { return av_get_bytes_per_sample(format_); }
+
+  TpdfDither* Dither() {
+    return dither_mode_ == DitherMode::kTpdf ? &dither_ : nullptr;
+  }
+
+  void FinishSamples(int64_t count) {
+    index_ += count;
+    if (index_ >= frame_->data()->nb_samples) {
+      WriteCurrentFrame();
+    }
+  }
+
   void WriteCurrentFrame() {
     frame_->data()->nb_samples = std::min(index_, frame_->data()->nb_samples);
-    frame_->data()->pts = samples_written_;
-    encoder_.Write(*frame_);
+    const AVCodecContext* context = encoder_.data();
+    frame_->data()->pts =
+        av_rescale_q(samples_written_, av_make_q(1, context->sample_rate),
+                     context->time_base);
+    if (!encoder_.Write(*frame_)) {
+      std::cerr << "Encoding frame at sample " << samples_written_ << " failed"
+                << std::endl;
+      failed_ = true;
+    }
     frame_ = std::nullopt;
     samples_written_ += index_;
   }
@@ -156,6 +511,15 @@ class AudioEncoder {
   int index_;
   std::optional<Frame> frame_;
   bool planar_;
+  AVSampleFormat format_;
+  bool convert_;
+  bool channel_mismatch_ = false;
+  bool failed_ = false;
+  DitherMode dither_mode_;
+  TpdfDither dither_;
+  std::vector<const SampleType*> sources_;
+  std::vector<SampleType*> planes_;
+  std::vector<SampleType> scratch_;
   int64_t samples_written_ = 0;
 };
 
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/dict.h>
+}
+
+#include "rational.hpp"
+
+namespace potamos {
+
+enum class ThreadType { kFrame, kSlice, kFrameAndSlice };
+
+struct CodecOptions {
+  // Worker threads for the codec; 0 uses std::thread::hardware_concurrency().
+  int thread_count = 1;
+  // Which kinds of threading the codec may use. Frame threading adds one
+  // frame of delay per thread.
+  ThreadType thread_type = ThreadType::kFrameAndSlice;
+  // Passed to avcodec_open2 as an AVDictionary.
+  std::map<std::string, std::string> dictionary;
+};
+
+struct DecoderOptions : CodecOptions {
+  // When positive, a worker thread decodes up to this many frames ahead of
+  // the reader.
+  int decode_ahead = 0;
+  // When positive, packets are decoded in batches on this many worker
+  // threads, each with a codec context of its own, and the frames are handed
+  // out in packet order. Only for codecs whose packets decode on their own,
+  // e.g. PCM, FLAC and ALAC, or mp3 with parallel_warm_up. Audio only; it
+  // cannot be combined with decode_ahead.
+  int parallel_decode = 0;
+  // Packets per batch.
+  int parallel_batch = 64;
+  // Packets before each batch that are decoded again, and their frames
+  // dropped, to restore the state a codec carries from packet to packet,
+  // e.g. 8 for the bit reservoir of mp3.
+  int parallel_warm_up = 0;
+};
+struct EncoderOptions : CodecOptions {
+  // Time base of the frames given to the encoder. 0 uses 1/sample_rate for
+  // audio; video encoders need it set, usually to 1/frame rate.
+  Rational<int64_t> time_base = Rational<int64_t>(0, 1);
+};
+
+namespace internal {
+
+// Applies the options to a codec context and opens it. Returns
+// avcodec_open2's result.
+inline int OpenCodec(AVCodecContext* context, const AVCodec* codec,
+                     const CodecOptions& options) {
+  int thread_count = options.thread_count;
+  if (thread_count == 0) {
+    thread_count = std::max(1u, std::thread::hardware_concurrency());
+  }
+  context->thread_count = thread_count;
+  switch (options.thread_type) {
+    case ThreadType::kFrame:
+      context->thread_type = FF_THREAD_FRAME;
+      break;
+    case ThreadType::kSlice:
+      context->thread_type = FF_THREAD_SLICE;
+      break;
+    case ThreadType::kFrameAndSlice:
+      context->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+      break;
+  }
+
+  AVDictionary* dictionary = nullptr;
+  for (const auto& [key, value] : options.dictionary) {
+    av_dict_set(&dictionary, key.c_str(), value.c_str(), 0);
+  }
+  int ret = avcodec_open2(context, codec, &dictionary);
+  const AVDictionaryEntry* entry = nullptr;
+  while ((entry = av_dict_get(dictionary, "", entry, AV_DICT_IGNORE_SUFFIX))) {
+    std::cerr << "codec option not found: " << entry->key << std::endl;
+  }
+  av_dict_free(&dictionary);
+  return ret;
+}
+
+}  // namespace internal
+}  // namespace potamos
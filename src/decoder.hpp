@@ -1,10 +1,17 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
 #include <fstream>
 #include <functional>
+#include <future>
 #include <iostream>
+#include <memory>
 #include <optional>
 #include <queue>
+#include <thread>
+#include <vector>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -13,30 +20,52 @@ extern "C" {
 #include <libavutil/file.h>
 }
 
+#include "codec_options.hpp"
 #include "rational.hpp"
+#include "spsc_queue.hpp"
 #include "stream_data.hpp"
+#include "thread_pool.hpp"
 
 namespace potamos {
 
 class PacketSource {
  public:
   virtual std::optional<Packet> ReadNextPacket(const int stream_index) = 0;
+  // True once ReadNextPacket returned std::nullopt because of an error rather
+  // than the end of the input.
+  virtual bool Failed() const { return false; }
+  // Changes whenever the source seeks; decoders flush when they notice. It
+  // is 0 until the first seek.
+  virtual int64_t SeekEpoch() const { return 0; }
+  // Time requested by the latest seek.
+  virtual Rational<int64_t> SeekTarget() const {
+    return Rational<int64_t>(0, 1);
+  }
+  // Called once no more packets of the stream will be read, e.g. by a
+  // decoder being destroyed; wakes up a ReadNextPacket waiting for them.
+  virtual void StopReading(const int /*stream_index*/) {}
 };
 
 class Decoder {
  public:
-  Decoder(const AVStream* stream, PacketSource* packet_source)
+  Decoder(const AVStream* stream, PacketSource* packet_source,
+          const DecoderOptions& options = {})
       : stream_(stream),
         codec_param_(stream->codecpar),
         codec_(avcodec_find_decoder(codec_param_->codec_id)),
         context_(avcodec_alloc_context3(codec_)),
-        packet_source_(packet_source) {
-    int ret0 = avcodec_parameters_to_context(context_, codec_param_);
-    context_->flags2 |= AV_CODEC_FLAG2_SKIP_MANUAL;
-    if (ret0 < 0)
-      std::cerr << "avcodec_parameters_to_context =" << ret0 << std::endl;
-    int ret = avcodec_open2(context_, codec_, nullptr);
-    if (ret < 0) std::cerr << "avcodec_open2 =" << ret << std::endl;
+        packet_source_(packet_source),
+        seek_epoch_(packet_source->SeekEpoch()) {
+    if (options.parallel_decode > 0 && options.decode_ahead > 0) {
+      std::cerr << "parallel decode cannot be combined with decode ahead, "
+                << "decoding ahead only" << std::endl;
+    } else if (options.parallel_decode > 0 && StartParallelDecode(options)) {
+      // Only the workers decode; this context just describes the stream.
+      SetParameters(context_);
+      return;
+    }
+    Configure(context_, options);
+    if (options.decode_ahead > 0) StartDecodeAhead(options.decode_ahead);
   }
 
   Decoder(const Decoder& d) = delete;
@@ -45,12 +74,21 @@ class Decoder {
         codec_param_(d.codec_param_),
         codec_(d.codec_),
         context_(d.context_),
-        packet_source_(d.packet_source_) {
+        packet_source_(d.packet_source_),
+        seek_epoch_(d.seek_epoch_),
+        decode_ahead_(std::move(d.decode_ahead_)),
+        parallel_(std::move(d.parallel_)) {
     d.context_ = nullptr;
   }
 
   ~Decoder() {
     // cleanup
+    if (decode_ahead_) {
+      decode_ahead_->frames.Close();
+      packet_source_->StopReading(stream_->index);
+      decode_ahead_->thread.join();
+    }
+    parallel_.reset();
     if (context_ != nullptr) {
       avcodec_free_context(&context_);
     }
@@ -82,13 +120,136 @@ class Decoder {
   }
 
   std::optional<Frame> Read() {
+    if (SeekEpoch() != seek_epoch_) Flush();
+    if (decode_ahead_) return decode_ahead_->frames.Pop();
+    if (parallel_) return ReadParallel();
+    return Decode();
+  }
+
+  // Drops the codec's buffered state, e.g. after the source seeked.
+  void Flush() {
+    seek_epoch_ = SeekEpoch();
+    if (decode_ahead_) {
+      std::cerr << "cannot flush a decoder that decodes ahead" << std::endl;
+      return;
+    }
+    if (parallel_) {
+      parallel_->Clear();
+      return;
+    }
+    avcodec_flush_buffers(context_);
+    draining_ = false;
+    while (!sub_buffer_.empty()) {
+      avsubtitle_free(&sub_buffer_.front());
+      sub_buffer_.pop();
+    }
+  }
+
+  // True once decoding stopped on an error, of the codec or of the packet
+  // source, rather than at the end of the stream.
+  bool Failed() const {
+    return packet_source_->Failed() ||
+           (decode_ahead_ && decode_ahead_->failed) ||
+           (parallel_ && parallel_->failed);
+  }
+
+  bool DecodesAhead() const { return decode_ahead_ != nullptr; }
+
+  int64_t SeekEpoch() const { return packet_source_->SeekEpoch(); }
+  Rational<int64_t> SeekTarget() const { return packet_source_->SeekTarget(); }
+
+  std::optional<AVSubtitle> ReadSub() {
+    if (sub_buffer_.empty()) return std::nullopt;
+    AVSubtitle sub = sub_buffer_.front();
+    sub_buffer_.pop();
+    return sub;
+  }
+
+  // While decoding ahead the context belongs to the worker thread; take
+  // formats from the decoded frames or from CodecParameters instead. With
+  // parallel decode the context holds the stream parameters but is never
+  // opened, so fields set by the codec on open stay unset.
+  AVCodecContext* data() { return context_; }
+  const AVCodecContext* data() const { return context_; }
+
+  const AVCodecParameters* CodecParameters() const { return codec_param_; }
+
+  AVMediaType Type() const { return stream_->codecpar->codec_type; }
+
+  Rational<int64_t> TimeBase() const { return stream_->time_base; }
+  int64_t StartTime() const { return stream_->start_time; }
+
+ protected:
+  struct DecodeAhead {
+    DecodeAhead(size_t frames) : frames(frames) {}
+
+    SpscQueue<Frame> frames;
+    std::thread thread;
+    std::atomic<bool> failed{false};
+  };
+
+  // Codec contexts of the workers, one per thread, and the batches in
+  // flight. Batch i is decoded with context i % contexts.size(), and at most
+  // that many batches are in flight, so no two share a context.
+  struct ParallelDecode {
+    ParallelDecode(int threads) : pool(threads) {}
+    ~ParallelDecode() {
+      Clear();
+      for (AVCodecContext*& context : contexts) avcodec_free_context(&context);
+    }
+
+    // Drops the batches in flight and the decoded frames, e.g. after a seek.
+    void Clear() {
+      for (auto& batch : batches) batch.wait();
+      batches.clear();
+      frames.clear();
+      warm_up.clear();
+      ended = false;
+      failed = false;
+    }
+
+    std::vector<AVCodecContext*> contexts;
+    ThreadPool pool;
+    // std::nullopt for a batch that failed to decode.
+    std::deque<std::future<std::optional<std::vector<Frame>>>> batches;
+    std::deque<Frame> frames;
+    // The last packets read, decoded again before the next batch.
+    std::vector<Packet> warm_up;
+    size_t next_context = 0;
+    bool ended = false;
+    bool failed = false;
+    int batch_size;
+    int warm_up_size;
+  };
+
+  void SetParameters(AVCodecContext* context) {
+    int ret = avcodec_parameters_to_context(context, codec_param_);
+    context->flags2 |= AV_CODEC_FLAG2_SKIP_MANUAL;
+    if (ret < 0)
+      std::cerr << "avcodec_parameters_to_context =" << ret << std::endl;
+  }
+
+  // Sets a codec context up for the stream and opens it.
+  void Configure(AVCodecContext* context, const DecoderOptions& options) {
+    SetParameters(context);
+    int ret = internal::OpenCodec(context, codec_, options);
+    if (ret < 0) std::cerr << "avcodec_open2 =" << ret << std::endl;
+  }
+
+  std::optional<Frame> Decode() {
     Frame frame;
     int ret = AVERROR(EAGAIN);
     while (ret == AVERROR(EAGAIN)) {
       ret = avcodec_receive_frame(context_, frame.data());
       if (ret == AVERROR(EAGAIN)) {
+        if (draining_) return std::nullopt;
         auto packet = packet_source_->ReadNextPacket(stream_->index);
-        if (!packet) return std::nullopt;
+        if (!packet) {
+          // Frame threads still hold the last frames; drain them.
+          draining_ = true;
+          avcodec_send_packet(context_, nullptr);
+          continue;
+        }
         Write(*packet);  // TODO handle error
       } else if (ret == AVERROR_EOF)
         return std::nullopt;
@@ -98,28 +259,168 @@ class Decoder {
     return frame;
   }
 
-  std::optional<AVSubtitle> ReadSub() {
-    if (sub_buffer_.empty()) return std::nullopt;
-    AVSubtitle sub = sub_buffer_.front();
-    sub_buffer_.pop();
-    return sub;
+  // From here on the codec context belongs to the worker thread, which keeps
+  // the frame queue full until the stream ends or the decoder is destroyed.
+  void StartDecodeAhead(size_t frames) {
+    if (Type() == AVMediaType::AVMEDIA_TYPE_SUBTITLE) {
+      std::cerr << "decode ahead is not supported for subtitles" << std::endl;
+      return;
+    }
+    decode_ahead_ = std::make_unique<DecodeAhead>(frames);
+    DecodeAhead* worker = decode_ahead_.get();
+    AVCodecContext* context = context_;
+    PacketSource* packet_source = packet_source_;
+    const int stream_index = stream_->index;
+    worker->thread = std::thread([worker, context, packet_source,
+                                  stream_index] {
+      Frame frame;
+      bool draining = false;
+      while (!worker->frames.Closed()) {
+        int ret = avcodec_receive_frame(context, frame.data());
+        if (ret == AVERROR(EAGAIN)) {
+          if (draining) break;
+          auto packet = packet_source->ReadNextPacket(stream_index);
+          if (!packet) {
+            draining = true;
+            avcodec_send_packet(context, nullptr);
+            continue;
+          }
+          ret = avcodec_send_packet(context, packet->data());
+          if (ret < 0 && ret != AVERROR(EAGAIN)) {
+            std::cerr << "avcodec_send_packet = " << ret << std::endl;
+            worker->failed = true;
+            break;
+          }
+        } else if (ret < 0) {
+          if (ret != AVERROR_EOF) {
+            std::cerr << "avcodec_receive_frame = " << ret << std::endl;
+            worker->failed = true;
+          }
+          break;
+        } else if (!worker->frames.Push(std::move(frame))) {
+          break;
+        } else {
+          frame = Frame();
+        }
+      }
+      worker->frames.Close();
+    });
   }
 
-  AVCodecContext* data() { return context_; }
-  const AVCodecContext* data() const { return context_; }
+  // Packets are still read on the caller's thread; the workers only decode.
+  bool StartParallelDecode(const DecoderOptions& options) {
+    if (Type() != AVMediaType::AVMEDIA_TYPE_AUDIO) {
+      std::cerr << "parallel decode is only supported for audio" << std::endl;
+      return false;
+    }
+    parallel_ = std::make_unique<ParallelDecode>(options.parallel_decode);
+    parallel_->batch_size = std::max(options.parallel_batch, 1);
+    parallel_->warm_up_size = std::max(options.parallel_warm_up, 0);
+    DecoderOptions worker_options = options;
+    worker_options.thread_count = 1;
+    for (int i = 0; i < parallel_->pool.Threads(); ++i) {
+      parallel_->contexts.push_back(avcodec_alloc_context3(codec_));
+      Configure(parallel_->contexts.back(), worker_options);
+    }
+    return true;
+  }
 
-  AVMediaType Type() const { return stream_->codecpar->codec_type; }
+  std::optional<Frame> ReadParallel() {
+    ParallelDecode& parallel = *parallel_;
+    while (parallel.frames.empty()) {
+      if (parallel.failed) return std::nullopt;
+      while (!parallel.ended &&
+             parallel.batches.size() < parallel.contexts.size()) {
+        SubmitBatch();
+      }
+      if (parallel.batches.empty()) return std::nullopt;
+      auto frames = parallel.batches.front().get();
+      parallel.batches.pop_front();
+      if (!frames) {
+        parallel.failed = true;
+        return std::nullopt;
+      }
+      for (Frame& frame : *frames) parallel.frames.push_back(std::move(frame));
+    }
+    Frame frame = std::move(parallel.frames.front());
+    parallel.frames.pop_front();
+    return frame;
+  }
 
-  Rational<int64_t> TimeBase() const { return stream_->time_base; }
-  int64_t StartTime() const { return stream_->start_time; }
+  void SubmitBatch() {
+    ParallelDecode& parallel = *parallel_;
+    std::vector<Packet> packets;
+    while (int(packets.size()) < parallel.batch_size) {
+      auto packet = packet_source_->ReadNextPacket(stream_->index);
+      if (!packet) {
+        parallel.ended = true;
+        break;
+      }
+      packets.push_back(std::move(*packet));
+    }
+    if (packets.empty()) return;
+
+    std::vector<Packet> warm_up = std::move(parallel.warm_up);
+    parallel.warm_up.clear();
+    const size_t keep = parallel.warm_up_size;
+    if (packets.size() < keep) {
+      const size_t old = std::min(keep - packets.size(), warm_up.size());
+      parallel.warm_up.assign(warm_up.end() - old, warm_up.end());
+    }
+    parallel.warm_up.insert(
+        parallel.warm_up.end(),
+        packets.end() - std::min(keep, packets.size()), packets.end());
+
+    AVCodecContext* context = parallel.contexts[parallel.next_context];
+    parallel.next_context =
+        (parallel.next_context + 1) % parallel.contexts.size();
+    parallel.batches.push_back(parallel.pool.Submit(
+        [context, warm_up = std::move(warm_up), packets = std::move(packets)] {
+          return DecodeBatch(context, warm_up, packets);
+        }));
+  }
+
+  // Decodes `packets` from a clean state, after `warm_up` whose frames are
+  // dropped. Sends and receives like Decode, so the frames are the same.
+  // Returns std::nullopt if one of `packets` fails to decode; errors of the
+  // warm-up packets, which lack their own history, are ignored.
+  static std::optional<std::vector<Frame>> DecodeBatch(
+      AVCodecContext* context, const std::vector<Packet>& warm_up,
+      const std::vector<Packet>& packets) {
+    avcodec_flush_buffers(context);
+    std::vector<Frame> frames;
+    auto decode = [&](const Packet& packet, bool keep) {
+      int ret = avcodec_send_packet(context, packet.data());
+      while (ret >= 0) {
+        Frame frame;
+        ret = avcodec_receive_frame(context, frame.data());
+        if (ret >= 0 && keep) frames.push_back(std::move(frame));
+      }
+      if (keep && ret != AVERROR(EAGAIN)) {
+        std::cerr << "decoding packet at " << packet.data()->pts << " = "
+                  << ret << std::endl;
+        return false;
+      }
+      return true;
+    };
+    for (const Packet& packet : warm_up) decode(packet, false);
+    for (const Packet& packet : packets) {
+      if (!decode(packet, true)) return std::nullopt;
+    }
+    return frames;
+  }
 
- protected:
   const AVCodecParameters* codec_param_;
   const AVCodec* codec_;
   const AVStream* stream_;
   AVCodecContext* context_;
   std::queue<AVSubtitle> sub_buffer_;
   PacketSource* packet_source_;
+  int64_t seek_epoch_;
+  // Set once the end of the stream was sent to the codec.
+  bool draining_ = false;
+  std::unique_ptr<DecodeAhead> decode_ahead_;
+  std::unique_ptr<ParallelDecode> parallel_;
 };
 
 }  // namespace potamos
\ No newline at end of file
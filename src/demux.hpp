@@ -3,7 +3,14 @@
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <string>
+#include <thread>
+#include <vector>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -13,27 +20,95 @@ extern "C" {
 }
 
 #include "decoder.hpp"
+#include "input_source.hpp"
+#include "packet_index.hpp"
+#include "packet_queue.hpp"
+#include "spsc_queue.hpp"
 
 namespace potamos {
 
+struct DemuxOptions {
+  // Size of the AVIO buffer, i.e. the largest read AVIO asks the input source
+  // for in one callback.
+  int buffer_size = 4096;
+  // Bytes the input source fetches per underlying read; 0 keeps the source's
+  // default.
+  int64_t read_ahead = 0;
+  // Limits for the packets buffered for one stream while another is read.
+  QueueLimits queue_limits;
+  // SeekTo lands this far before the requested time so decoders can settle
+  // (e.g. the MP3 bit reservoir) before the first sample that is returned.
+  Rational<int64_t> seek_preroll = Rational<int64_t>(1, 10);
+  // When set, a packet index sidecar is kept at this path: mapped if it
+  // matches the input, otherwise built by scanning the input once on open.
+  // SeekTo then jumps straight to the indexed byte offset and Duration is
+  // exact.
+  std::string index_path;
+
+  // Fast open. Bytes and time of input avformat_find_stream_info may read
+  // to fill in missing codec parameters; 0 keeps FFmpeg's defaults.
+  int64_t probesize = 0;
+  Rational<int64_t> analyze_duration = Rational<int64_t>(0, 1);
+  // Short name of the input format, e.g. "mp3". Skips format probing.
+  std::string format;
+  // Codec parameters of every stream, e.g. saved from CodecParameters() of an
+  // earlier Demux of the same input. When they match the streams the
+  // demuxer finds, avformat_find_stream_info is skipped. Only read by the
+  // constructor.
+  std::vector<const AVCodecParameters*> codec_parameters;
+
+  // Large buffers for batch jobs on high-latency storage, where per-call
+  // overhead dominates.
+  static DemuxOptions Throughput() {
+    DemuxOptions options;
+    options.buffer_size = 1 << 20;
+    options.read_ahead = 4 << 20;
+    return options;
+  }
+};
+
 class Demux : public PacketSource {
  public:
-  Demux(std::istream& stream) : stream_(stream) {
+  Demux(std::istream& stream, const DemuxOptions& options = {})
+      : Demux(std::make_unique<IStreamSource>(stream), options) {}
+
+  Demux(std::unique_ptr<InputSource> source,
+        const DemuxOptions& options = {})
+      : options_(options), source_(std::move(source)) {
     fmt_ctx_ = avformat_alloc_context();
-    // TODO handle an error
+    if (!source_) {
+      std::clog << "Could not open input: no input source" << std::endl;
+      return;
+    }
+    // Read before AVIO takes over the position of the source.
+    if (!options_.index_path.empty()) indexed_source_ = IdentifySource();
+    if (options_.read_ahead > 0) source_->SetReadAhead(options_.read_ahead);
 
-    avio_ctx_buffer = (uint8_t*)av_malloc(avio_ctx_buffer_size);
+    avio_ctx_buffer = (uint8_t*)av_malloc(options_.buffer_size);
     // TODO handle an error
 
-    avio_ctx_ = avio_alloc_context(avio_ctx_buffer, avio_ctx_buffer_size, 0,
+    avio_ctx_ = avio_alloc_context(avio_ctx_buffer, options_.buffer_size, 0,
                                    this, &Demux::Read, nullptr, &Demux::Seek);
     if (!avio_ctx_) {
       std::clog << " ?? " << std::endl;
     }
 
     fmt_ctx_->pb = avio_ctx_;
+    if (options_.probesize > 0) fmt_ctx_->probesize = options_.probesize;
+    if (Rational<int64_t>(0, 1) < options_.analyze_duration) {
+      fmt_ctx_->max_analyze_duration = Floor(
+          options_.analyze_duration * Rational<int64_t>(AV_TIME_BASE, 1));
+    }
+    const AVInputFormat* format = nullptr;
+    if (!options_.format.empty()) {
+      format = av_find_input_format(options_.format.c_str());
+      if (format == nullptr) {
+        std::clog << "Unknown input format " << options_.format
+                  << ", probing instead" << std::endl;
+      }
+    }
 
-    int ret = avformat_open_input(&fmt_ctx_, NULL, NULL, NULL);
+    int ret = avformat_open_input(&fmt_ctx_, NULL, format, NULL);
     if (ret < 0) {
       std::string error(av_make_error_string(
           (char*)__builtin_alloca(AV_ERROR_MAX_STRING_SIZE),
@@ -42,7 +117,9 @@ class Demux : public PacketSource {
       return;
     }
 
-    ret = avformat_find_stream_info(fmt_ctx_, NULL);
+    if (!ApplyCodecParameters()) {
+      ret = avformat_find_stream_info(fmt_ctx_, NULL);
+    }
     if (ret < 0) {
       std::clog << "Could not find stream information" << std::endl;
       return;
@@ -50,11 +127,19 @@ class Demux : public PacketSource {
 
     // av_dump_format(fmt_ctx_, 0, "std::ifstream", 0);
 
-    packets_queue_.resize(StreamsCount());
+    for (int i = 0; i < StreamsCount(); ++i) {
+      packets_queue_.emplace_back(options_.queue_limits);
+      // Streams are read only once selected, see SelectStream.
+      fmt_ctx_->streams[i]->discard = AVDISCARD_ALL;
+    }
     decoders_.resize(StreamsCount());
+    decodes_ahead_.resize(StreamsCount());
+    stopped_.resize(StreamsCount());
+    if (!options_.index_path.empty()) LoadIndex();
   }
 
   ~Demux() {
+    StopPipeline();
     avformat_close_input(&fmt_ctx_);
     if (avio_ctx_) av_freep(&avio_ctx_->buffer);
     avio_context_free(&avio_ctx_);
@@ -93,94 +178,376 @@ class Demux : public PacketSource {
       return std::nullopt;
     else if (ret < 0) {
       std::cerr << "av_read_frame = " << ret << std::endl;
+      failed_ = true;
       return std::nullopt;
-    } else
-      return packet;
+    }
+    if (restamp_) Restamp(packet.data());
+    return packet;
   }
 
-  std::optional<Packet> ReadNextPacket(const int stream_index) override {
-    if (!packets_queue_[stream_index].empty()) {
-      auto packet = packets_queue_[stream_index].front();
-      packets_queue_[stream_index].pop();
-      return packet;
+  // Exact when an index is loaded, otherwise as reported by the container.
+  Rational<int64_t> Duration(int index) const {
+    if (index_ && index_->Size(index) > 0) return index_->Duration(index);
+    const AVStream* stream = fmt_ctx_->streams[index];
+    if (stream->duration != AV_NOPTS_VALUE) {
+      return Rational<int64_t>(stream->duration, 1) *
+             Rational<int64_t>(stream->time_base);
     }
-    while (true) {
-      auto packet = read();
-      if (!packet) return std::nullopt;
-      if (packet->StreamIndex() == stream_index) return packet;
-      if (decoders_[packet->StreamIndex()])
-        packets_queue_[packet->StreamIndex()].push(std::move(*packet));
+    if (fmt_ctx_->duration == AV_NOPTS_VALUE) return Rational<int64_t>(0, 1);
+    return Rational<int64_t>(fmt_ctx_->duration, AV_TIME_BASE);
+  }
+
+  Rational<int64_t> TimeBase(int index) const {
+    return fmt_ctx_->streams[index]->time_base;
+  }
+
+  // Owned by the Demux; copy them to reuse as DemuxOptions::codec_parameters.
+  const AVCodecParameters* CodecParameters(int index) const {
+    return fmt_ctx_->streams[index]->codecpar;
+  }
+
+  const PacketIndex* Index() const { return index_ ? &*index_ : nullptr; }
+
+  std::optional<Packet> ReadNextPacket(const int stream_index) override {
+    {
+      // Decoders reading ahead call this from their own threads.
+      std::unique_lock<std::mutex> lock(read_mutex_);
+      if (auto packet = packets_queue_[stream_index].Pop()) {
+        queue_space_.notify_all();
+        return packet;
+      }
+      while (!pipelined_) {
+        if (failed_ || stopped_[stream_index]) return std::nullopt;
+        auto packet = read();
+        if (!packet) return std::nullopt;
+        const int index = packet->StreamIndex();
+        if (index == stream_index) return packet;
+        if (!decoders_[index]) continue;
+        PacketQueue& queue = packets_queue_[index];
+        const int64_t size = packet->data()->size;
+        // Only a decoder on a thread of its own can make room while this
+        // one waits.
+        if (queue.Limits().policy == QueuePolicy::kBlock &&
+            decodes_ahead_[index]) {
+          queue_space_.wait(lock, [&] {
+            return !queue.Full(size) || stopped_[stream_index];
+          });
+          if (stopped_[stream_index] && queue.Full(size)) {
+            queue.CountDropped();
+            return std::nullopt;
+          }
+        }
+        if (!queue.Push(std::move(*packet))) {
+          std::cerr << "packet queue for stream " << index << " is full"
+                    << std::endl;
+          queue.CountDropped();
+          failed_ = true;
+          return std::nullopt;
+        }
+      }
     }
+    if (!pipeline_queues_[stream_index]) return std::nullopt;
+    return pipeline_queues_[stream_index]->Pop();
   }
 
-  Decoder GetDecoder(int index) {
+  Decoder GetDecoder(int index, const DecoderOptions& options = {}) {
+    if (pipeline_thread_.joinable()) {
+      std::cerr << "GetDecoder called after StartPipeline" << std::endl;
+    }
     decoders_[index] = true;
-    return Decoder(fmt_ctx_->streams[index], this);
+    stopped_[index] = false;
+    SelectStream(index);
+    Decoder decoder(fmt_ctx_->streams[index], this, options);
+    {
+      std::lock_guard<std::mutex> lock(read_mutex_);
+      decodes_ahead_[index] = decoder.DecodesAhead();
+    }
+    return decoder;
   }
 
- private:
-  static int Read(void* opaque, uint8_t* buf, int buf_size) {
-    Demux* stream = static_cast<Demux*>(opaque);
-    return stream->Read(buf, buf_size);
-  }
-  int Read(uint8_t* buf, int buf_size) {
-    int count = stream_.readsome((char*)buf, buf_size);
-    if (count == 0) {
-      // stream_.peek();
-      if (stream_.eof()) {
-        return AVERROR_EOF;
-      } else {
-        return AVERROR_EOF;
-        // return AVERROR_EXTERNAL;
+  // Selects whether read() returns packets of a stream. Unselected streams
+  // are discarded by the demuxer without being parsed. GetDecoder selects
+  // its stream; other streams start unselected. Call before StartPipeline.
+  void SelectStream(int index, bool selected = true) {
+    fmt_ctx_->streams[index]->discard =
+        selected ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+  }
+  bool StreamSelected(int index) const {
+    return fmt_ctx_->streams[index]->discard != AVDISCARD_ALL;
+  }
+
+  // Seeks all streams so that the next samples AudioDecoder returns start at
+  // `time` exactly. Open decoders are flushed on their next read and packets
+  // queued for them are dropped. Not supported while pipelined or while a
+  // decoder decodes ahead, whose worker cannot be flushed.
+  bool SeekTo(Rational<int64_t> time) {
+    std::lock_guard<std::mutex> lock(read_mutex_);
+    if (pipelined_) {
+      std::cerr << "SeekTo is not supported with a running pipeline"
+                << std::endl;
+      return false;
+    }
+    for (int i = 0; i < StreamsCount(); ++i) {
+      if (decodes_ahead_[i]) {
+        std::cerr << "SeekTo is not supported while stream " << i
+                  << " decodes ahead" << std::endl;
+        return false;
+      }
+    }
+    Rational<int64_t> start = time - options_.seek_preroll;
+    for (int i = 0; i < StreamsCount(); ++i) {
+      const int64_t preroll = fmt_ctx_->streams[i]->codecpar->seek_preroll;
+      const int sample_rate = fmt_ctx_->streams[i]->codecpar->sample_rate;
+      if (decoders_[i] && preroll > 0 && sample_rate > 0) {
+        Rational<int64_t> codec_start =
+            time - Rational<int64_t>(preroll, sample_rate);
+        if (codec_start < start) start = codec_start;
       }
+    }
+    const PacketIndexEntry* entry = nullptr;
+    if (index_) {
+      int stream = 0;
+      while (stream + 1 < StreamsCount() && !decoders_[stream]) ++stream;
+      entry = index_->FindKeyframe(stream,
+                                   Floor(start / index_->TimeBase(stream)));
+    }
+    int ret;
+    if (entry != nullptr) {
+      ret = av_seek_frame(fmt_ctx_, -1, entry->pos, AVSEEK_FLAG_BYTE);
     } else {
-      return count;
+      ret = av_seek_frame(fmt_ctx_, -1,
+                          Floor(start * Rational<int64_t>(AV_TIME_BASE, 1)),
+                          AVSEEK_FLAG_BACKWARD);
     }
+    restamp_ = entry != nullptr && ret >= 0;
+    if (ret < 0) {
+      std::cerr << "av_seek_frame = " << ret << std::endl;
+      return false;
+    }
+    for (auto& queue : packets_queue_) queue.Clear();
+    failed_ = false;
+    seek_target_ = time;
+    ++seek_epoch_;
+    queue_space_.notify_all();
+    return true;
   }
-  static int64_t Seek(void* opaque, int64_t offset, int whence) {
-    Demux* stream = static_cast<Demux*>(opaque);
-    return stream->Seek(offset, whence);
+
+  // True once a read failed: the input could not be read, or a packet queue
+  // overflowed under QueuePolicy::kFail or kBlock. Reads then return
+  // std::nullopt until the next SeekTo.
+  bool Failed() const override { return failed_; }
+
+  int64_t SeekEpoch() const override { return seek_epoch_; }
+  Rational<int64_t> SeekTarget() const override {
+    std::lock_guard<std::mutex> lock(read_mutex_);
+    return seek_target_;
   }
-  int64_t Seek(int64_t offset, int whence) {
-    switch (whence) {
-      case AVSEEK_SIZE: {
-        return -1;
+
+  void SetQueueLimits(int index, const QueueLimits& limits) {
+    std::lock_guard<std::mutex> lock(read_mutex_);
+    packets_queue_[index].SetLimits(limits);
+  }
+
+  // Packets buffered for a stream that were read while serving another one.
+  // In pipelined mode, packets also counts the pipeline queue.
+  QueueStats GetQueueStats(int index) {
+    std::lock_guard<std::mutex> lock(read_mutex_);
+    QueueStats stats = packets_queue_[index].Stats();
+    if (pipelined_ && pipeline_queues_[index]) {
+      stats.packets += pipeline_queues_[index]->Size();
+    }
+    return stats;
+  }
+
+  // Moves packet reading onto a separate thread that feeds every stream opened
+  // with GetDecoder through a bounded queue of `queue_size` packets. Call it
+  // after the last GetDecoder. Each opened stream has to be consumed or its
+  // decoder destroyed: once a stream's queue is full, reading stops until its
+  // decoder catches up.
+  void StartPipeline(size_t queue_size = 64) {
+    std::lock_guard<std::mutex> lock(read_mutex_);
+    if (pipelined_) return;
+    pipelined_ = true;
+    pipeline_queues_.resize(StreamsCount());
+    for (int i = 0; i < StreamsCount(); ++i) {
+      if (decoders_[i]) {
+        pipeline_queues_[i] = std::make_unique<SpscQueue<Packet>>(queue_size);
       }
-      case 0: {
-        stream_.seekg(offset, std::ios_base::beg);
-        return stream_.tellg();
+    }
+    stop_pipeline_ = false;
+    pipeline_thread_ = std::thread([this] {
+      auto open = [this] {
+        for (auto& queue : pipeline_queues_) {
+          if (queue && !queue->Closed()) return true;
+        }
+        return false;
+      };
+      while (!stop_pipeline_ && open()) {
+        std::optional<Packet> packet;
+        {
+          std::lock_guard<std::mutex> lock(read_mutex_);
+          packet = read();
+        }
+        if (!packet) break;
+        // Queues closed by StopReading drop their packets.
+        auto& queue = pipeline_queues_[packet->StreamIndex()];
+        if (queue) queue->Push(std::move(*packet));
       }
-      case 1: {
-        std::clog << "SEEK whence = 1: " << offset << " " << whence << " ("
-                  << AVSEEK_SIZE << " / " << AVSEEK_FORCE << " ) " << std::endl;
-        stream_.seekg(offset, std::ios_base::cur);
-        return stream_.tellg();
+      for (auto& queue : pipeline_queues_) {
+        if (queue) queue->Close();
       }
-      case 2: {
-        stream_.seekg(offset, std::ios_base::end);
-        return stream_.tellg();
+    });
+  }
+
+  // Wakes up the reads of a stream that wait for another stream's queue or
+  // for the pipeline, and stops queueing the stream's packets.
+  void StopReading(const int stream_index) override {
+    std::lock_guard<std::mutex> lock(read_mutex_);
+    decoders_[stream_index] = false;
+    stopped_[stream_index] = true;
+    queue_space_.notify_all();
+    if (pipelined_ && pipeline_queues_[stream_index]) {
+      pipeline_queues_[stream_index]->Close();
+    }
+  }
+
+ private:
+  static int64_t Floor(Rational<int64_t> value) {
+    int64_t result = value.Num() / value.Den();
+    if (value.Num() < 0 && value.Num() % value.Den() != 0) --result;
+    return result;
+  }
+
+  bool ApplyCodecParameters() {
+    const auto& parameters = options_.codec_parameters;
+    if (parameters.empty()) return false;
+    if (int(parameters.size()) != StreamsCount()) {
+      std::clog << "Cached codec parameters are for " << parameters.size()
+                << " streams, input has " << StreamsCount() << std::endl;
+      return false;
+    }
+    for (int i = 0; i < StreamsCount(); ++i) {
+      AVCodecParameters* codecpar = fmt_ctx_->streams[i]->codecpar;
+      if (parameters[i]->codec_id != codecpar->codec_id) {
+        std::clog << "Cached codec parameters do not match stream " << i
+                  << std::endl;
+        return false;
       }
-      default: {
-        std::clog << "SEEK whence = " << whence << ": " << offset << " "
-                  << whence << " (" << AVSEEK_SIZE << " / " << AVSEEK_FORCE
-                  << " ) " << std::endl;
+    }
+    for (int i = 0; i < StreamsCount(); ++i) {
+      if (avcodec_parameters_copy(fmt_ctx_->streams[i]->codecpar,
+                                  parameters[i]) < 0) {
+        return false;
       }
-      case AVSEEK_FORCE: {
+    }
+    return true;
+  }
+
+  // Size and hash of the input, which tell a stale index sidecar apart.
+  // Returns std::nullopt for inputs that cannot seek. Leaves the source at
+  // its start.
+  std::optional<IndexedSource> IdentifySource() {
+    IndexedSource source;
+    source.size = source_->Seek(0, AVSEEK_SIZE);
+    if (source.size < 0) return std::nullopt;
+    std::vector<uint8_t> block(IndexedSource::kBlock);
+    const int64_t last =
+        std::max<int64_t>(0, source.size - IndexedSource::kBlock);
+    for (int64_t offset : {int64_t(0), last}) {
+      if (source_->Seek(offset, SEEK_SET) != offset) return std::nullopt;
+      int64_t count = 0;
+      while (count < int64_t(block.size())) {
+        const int ret = source_->Read(block.data() + count,
+                                      block.size() - count);
+        if (ret <= 0) break;
+        count += ret;
       }
+      source.Hash(block.data(), count);
+    }
+    if (source_->Seek(0, SEEK_SET) != 0) return std::nullopt;
+    return source;
+  }
+
+  void LoadIndex() {
+    // Without the identity of the input a stale sidecar cannot be told
+    // apart, so none is used.
+    if (!indexed_source_) {
+      std::cerr << "input cannot be identified, not using index "
+                << options_.index_path << std::endl;
+      return;
+    }
+    index_ = PacketIndex::Load(options_.index_path, *indexed_source_);
+    if (index_ && index_->StreamCount() != StreamsCount()) index_.reset();
+    if (index_) return;
+
+    std::vector<Rational<int64_t>> time_bases;
+    for (int i = 0; i < StreamsCount(); ++i) {
+      time_bases.push_back(fmt_ctx_->streams[i]->time_base);
+      fmt_ctx_->streams[i]->discard = AVDISCARD_DEFAULT;
+    }
+    PacketIndex::Builder builder(time_bases);
+    while (auto packet = read()) builder.Add(packet->data());
+    for (int i = 0; i < StreamsCount(); ++i) {
+      fmt_ctx_->streams[i]->discard = AVDISCARD_ALL;
+    }
+    const int64_t start =
+        fmt_ctx_->start_time != AV_NOPTS_VALUE ? fmt_ctx_->start_time : 0;
+    int ret = av_seek_frame(fmt_ctx_, -1, start, AVSEEK_FLAG_BACKWARD);
+    if (ret < 0) std::cerr << "av_seek_frame = " << ret << std::endl;
+    index_ = builder.Save(options_.index_path, *indexed_source_);
+  }
+
+  // Byte seeks leave some demuxers without timestamps; take them from the
+  // index instead.
+  void Restamp(AVPacket* packet) const {
+    const PacketIndexEntry* entry =
+        index_->FindPosition(packet->stream_index, packet->pos);
+    if (entry == nullptr) return;
+    packet->pts = entry->pts;
+    packet->dts = entry->dts;
+    packet->duration = entry->duration;
+  }
+
+  void StopPipeline() {
+    if (!pipeline_thread_.joinable()) return;
+    stop_pipeline_ = true;
+    for (auto& queue : pipeline_queues_) {
+      if (queue) queue->Close();
     }
+    pipeline_thread_.join();
+  }
 
-    stream_.seekg(offset);
-    return stream_.tellg();
+  static int Read(void* opaque, uint8_t* buf, int buf_size) {
+    Demux* stream = static_cast<Demux*>(opaque);
+    return stream->source_->Read(buf, buf_size);
+  }
+  static int64_t Seek(void* opaque, int64_t offset, int whence) {
+    Demux* stream = static_cast<Demux*>(opaque);
+    return stream->source_->Seek(offset, whence);
   }
 
-  size_t avio_ctx_buffer_size = 4096;
+  DemuxOptions options_;
   AVFormatContext* fmt_ctx_ = NULL;
   AVIOContext* avio_ctx_ = NULL;
   uint8_t* avio_ctx_buffer = NULL;
-  std::vector<std::queue<Packet>> packets_queue_;
+  std::vector<PacketQueue> packets_queue_;
   std::vector<bool> decoders_;
+  std::vector<bool> decodes_ahead_;
+  std::vector<bool> stopped_;
+  std::atomic<bool> failed_{false};
+  mutable std::mutex read_mutex_;
+  std::atomic<int64_t> seek_epoch_{0};
+  std::optional<IndexedSource> indexed_source_;
+  std::optional<PacketIndex> index_;
+  bool restamp_ = false;
+  Rational<int64_t> seek_target_ = Rational<int64_t>(0, 1);
+  std::condition_variable queue_space_;
+  bool pipelined_ = false;
+  std::vector<std::unique_ptr<SpscQueue<Packet>>> pipeline_queues_;
+  std::atomic<bool> stop_pipeline_{false};
+  std::thread pipeline_thread_;
 
-  std::istream& stream_;
+  std::unique_ptr<InputSource> source_;
 };
 
-}  // namespace potamos
\ No newline at end of file
+}  // namespace potamos
@@ -1,9 +1,13 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <vector>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -14,6 +18,7 @@ extern "C" {
 
 #include "audio.hpp"
 #include "demux.hpp"
+#include "input_source.hpp"
 #include "ipstream.hpp"
 
 namespace potamos {
@@ -175,4 +180,671 @@ TEST(DemuxTest, ReadStereoMp3File) {
   ASSERT_TRUE(pipe.eof()) << " there are still samples in the reference stream";
 }
 
-}  // namespace potamos
\ No newline at end of file
+TEST(DemuxTest, ReadBlocksStereoMp3File) {
+  const std::string input_file_name = "test_data/kirov.mp3";
+  static const std::string cmd =
+      "ffmpeg -i test_data/kirov.mp3 -v quiet -f f32le -y -";
+
+  iPipeStream pipe(cmd);
+  ASSERT_TRUE(pipe.good())
+      << " failed to initialize the pipeline for the reference stream";
+
+  std::ifstream input_file(input_file_name);
+  Demux demux(input_file);
+
+  auto codec = demux.GetDecoder(0);
+  AudioDecoder<float> audio_codec(codec);
+
+  int index = 0;
+  float raw_float[2] = {1, 2};
+  const float start_time_seconds = 0.025057;
+  while (auto block = audio_codec.ReadBlock(1000)) {
+    ASSERT_EQ(block->Channels(), 2);
+    ASSERT_EQ(block->SampleRate(), 44100);
+    ASSERT_THAT(block->Size(),
+                testing::AllOf(testing::Gt(0), testing::Le(1000)));
+    ASSERT_THAT(double(block->time()),
+                testing::DoubleNear(index / 44100.0 + start_time_seconds, 1e-6))
+        << "time missmatch at " << index;
+    for (int64_t i = 0; i < block->Size(); ++i) {
+      pipe.read((char*)raw_float, 8);
+      ASSERT_EQ(pipe.gcount(), 8) << "end of bytes at " << index;
+      ASSERT_EQ(block->channel(0)[i], raw_float[0])
+          << "samples mismatch at " << index;
+      ASSERT_EQ(block->channel(1)[i], raw_float[1])
+          << "samples mismatch at " << index;
+      ++index;
+    }
+  }
+
+  pipe.peek();
+  ASSERT_TRUE(pipe.eof()) << " there are still samples in the reference stream";
+}
+
+TEST(DemuxTest, ReadMp3FileAsS16) {
+  const std::string input_file_name = "test_data/kirov.mp3";
+  static const std::string cmd =
+      "ffmpeg -i test_data/kirov.mp3 -v quiet -f s16le -y -";
+
+  iPipeStream pipe(cmd);
+  ASSERT_TRUE(pipe.good())
+      << " failed to initialize the pipeline for the reference stream";
+
+  std::ifstream input_file(input_file_name);
+  Demux demux(input_file);
+
+  auto codec = demux.GetDecoder(0);
+  ASSERT_EQ(codec.data()->sample_fmt, AV_SAMPLE_FMT_FLTP);
+  AudioDecoder<int16_t> audio_codec(codec);
+
+  int index = 0;
+  int16_t raw_sample[2] = {1, 2};
+  while (auto block = audio_codec.ReadBlock()) {
+    for (int64_t i = 0; i < block->Size(); ++i) {
+      pipe.read((char*)raw_sample, 4);
+      ASSERT_EQ(pipe.gcount(), 4) << "end of bytes at " << index;
+      ASSERT_EQ(block->channel(0)[i], raw_sample[0])
+          << "samples mismatch at " << index;
+      ASSERT_EQ(block->channel(1)[i], raw_sample[1])
+          << "samples mismatch at " << index;
+      ++index;
+    }
+  }
+
+  pipe.peek();
+  ASSERT_TRUE(pipe.eof()) << " there are still samples in the reference stream";
+}
+
+TEST(DemuxTest, ReadStereoMp3FileWithFixedChannels) {
+  const std::string input_file_name = "test_data/kirov.mp3";
+  static const std::string cmd =
+      "ffmpeg -i test_data/kirov.mp3 -v quiet -f f32le -y -";
+
+  iPipeStream pipe(cmd);
+  ASSERT_TRUE(pipe.good())
+      << " failed to initialize the pipeline for the reference stream";
+
+  std::ifstream input_file(input_file_name);
+  Demux demux(input_file);
+
+  auto codec = demux.GetDecoder(0);
+  AudioDecoder<float, 2> audio_codec(codec);
+
+  int index = 0;
+  float raw_float[2] = {1, 2};
+  while (std::optional<AudioSample<float, 2>> sample = audio_codec.Read()) {
+    pipe.read((char*)raw_float, 8);
+    ASSERT_EQ(pipe.gcount(), 8) << "end of bytes at " << index;
+    ASSERT_EQ(sample->sample(0), raw_float[0])
+        << "samples mismatch at " << index;
+    ASSERT_EQ(sample->sample(1), raw_float[1])
+        << "samples mismatch at " << index;
+    ++index;
+  }
+
+  pipe.peek();
+  ASSERT_TRUE(pipe.eof()) << " there are still samples in the reference stream";
+}
+
+TEST(DemuxTest, FixedChannelsMismatch) {
+  std::ifstream input_file("test_data/kirov.mp3");
+  Demux demux(input_file);
+
+  auto codec = demux.GetDecoder(0);
+  AudioDecoder<float, 1> audio_codec(codec);
+  EXPECT_FALSE(audio_codec.Read());
+  EXPECT_FALSE(audio_codec.ReadBlock());
+}
+
+TEST(DemuxTest, SteadyStateDecodeDoesNotAllocate) {
+  std::ifstream input_file("test_data/kirov.mp3");
+  Demux demux(input_file);
+
+  auto codec = demux.GetDecoder(0);
+  AudioDecoder<float> audio_codec(codec);
+  for (int i = 0; i < 4; ++i) ASSERT_TRUE(audio_codec.ReadBlock());
+
+  const PoolStats packets = PacketPool::Global().Stats();
+  const PoolStats frames = FramePool::Global().Stats();
+  int blocks = 0;
+  while (audio_codec.ReadBlock()) ++blocks;
+  EXPECT_GT(blocks, 10);
+  EXPECT_EQ(PacketPool::Global().Stats().allocations, packets.allocations);
+  EXPECT_EQ(FramePool::Global().Stats().allocations, frames.allocations);
+}
+
+TEST(DemuxTest, ReadMappedFileMatchesStream) {
+  std::ifstream input_file("test_data/kirov.mp3");
+  DemuxOptions options;
+  options.buffer_size = 1000;
+  options.read_ahead = 10000;
+  Demux stream_demux(input_file, options);
+  Demux mapped_demux(MappedFileSource::Open("test_data/kirov.mp3"),
+                     DemuxOptions::Throughput());
+  ASSERT_EQ(mapped_demux.StreamsCount(), 1);
+
+  auto stream_codec = stream_demux.GetDecoder(0);
+  auto mapped_codec = mapped_demux.GetDecoder(0);
+  AudioDecoder<float> stream_audio(stream_codec);
+  AudioDecoder<float> mapped_audio(mapped_codec);
+
+  int64_t index = 0;
+  while (auto expected = stream_audio.Read()) {
+    auto sample = mapped_audio.Read();
+    ASSERT_TRUE(sample) << "end of samples at " << index;
+    ASSERT_EQ(sample->sample(0), expected->sample(0))
+        << "samples mismatch at " << index;
+    ASSERT_EQ(sample->sample(1), expected->sample(1))
+        << "samples mismatch at " << index;
+    ASSERT_EQ(sample->time(), expected->time()) << "time mismatch at " << index;
+    ++index;
+  }
+  EXPECT_FALSE(mapped_audio.Read());
+}
+
+TEST(DemuxTest, ThreadedDecodeMatchesSerial) {
+  static const std::string convert =
+      "ffmpeg -v quiet -i test_data/orders.mp3 -y test_data/orders.flac";
+  ASSERT_EQ(std::system(convert.c_str()), 0);
+  // The mp3 decoder has no frame threads, FLAC does.
+  for (auto [path, frame_threads] : {std::pair("test_data/orders.flac", true),
+                                     std::pair("test_data/kirov.mp3", false)}) {
+    std::ifstream serial_file(path);
+    std::ifstream threaded_file(path);
+    Demux serial_demux(serial_file);
+    Demux threaded_demux(threaded_file);
+
+    DecoderOptions options;
+    options.thread_count = 4;
+    options.thread_type = ThreadType::kFrame;
+    auto serial_codec = serial_demux.GetDecoder(0);
+    auto threaded_codec = threaded_demux.GetDecoder(0, options);
+    if (frame_threads) {
+      ASSERT_EQ(threaded_codec.data()->active_thread_type, FF_THREAD_FRAME)
+          << path;
+      ASSERT_EQ(threaded_codec.data()->thread_count, 4) << path;
+    }
+    AudioDecoder<float> serial(serial_codec);
+    AudioDecoder<float> threaded(threaded_codec);
+
+    int64_t index = 0;
+    while (auto expected = serial.ReadBlock()) {
+      auto block = threaded.ReadBlock(expected->Size());
+      ASSERT_TRUE(block) << path << " ended at " << index;
+      ASSERT_EQ(block->Size(), expected->Size()) << path << " at " << index;
+      ASSERT_EQ(block->time(), expected->time()) << path << " at " << index;
+      for (int c = 0; c < expected->Channels(); ++c) {
+        ASSERT_EQ(std::memcmp(block->channel(c), expected->channel(c),
+                              expected->Size() * sizeof(float)),
+                  0)
+            << path << " samples mismatch at " << index;
+      }
+      index += expected->Size();
+    }
+    EXPECT_FALSE(threaded.ReadBlock()) << path;
+
+    // The last frames held by the frame threads are not lost.
+    const std::string cmd =
+        std::string("ffmpeg -i ") + path + " -v quiet -ac 1 -f f32le -y -";
+    iPipeStream pipe(cmd);
+    ASSERT_TRUE(pipe.good()) << path;
+    int64_t reference = 0;
+    float raw_float;
+    while (pipe.read((char*)&raw_float, 4)) ++reference;
+    EXPECT_EQ(index, reference) << path;
+  }
+}
+
+TEST(DemuxTest, PipelinedDecodeMatchesSerial) {
+  std::ifstream serial_file("test_data/kirov.mp3");
+  std::ifstream pipelined_file("test_data/kirov.mp3");
+  Demux serial_demux(serial_file);
+  Demux pipelined_demux(pipelined_file);
+
+  DecoderOptions options;
+  options.decode_ahead = 4;
+  auto serial_codec = serial_demux.GetDecoder(0);
+  auto pipelined_codec = pipelined_demux.GetDecoder(0, options);
+  pipelined_demux.StartPipeline(8);
+  AudioDecoder<float> serial(serial_codec);
+  AudioDecoder<float> pipelined(pipelined_codec);
+  EXPECT_EQ(pipelined.Channels(), serial.Channels());
+
+  int64_t index = 0;
+  while (auto expected = serial.ReadBlock()) {
+    auto block = pipelined.ReadBlock(expected->Size());
+    ASSERT_TRUE(block) << "ended at " << index;
+    ASSERT_EQ(block->Size(), expected->Size()) << "at " << index;
+    ASSERT_EQ(block->time(), expected->time()) << "at " << index;
+    for (int c = 0; c < expected->Channels(); ++c) {
+      ASSERT_EQ(std::memcmp(block->channel(c), expected->channel(c),
+                            expected->Size() * sizeof(float)),
+                0)
+          << "samples mismatch at " << index;
+    }
+    index += expected->Size();
+  }
+  EXPECT_FALSE(pipelined.ReadBlock());
+  EXPECT_FALSE(pipelined_codec.Failed());
+  EXPECT_GT(index, 0);
+}
+
+// Reads up to `blocks` blocks, or everything for -1, and expects the same
+// samples from both decoders.
+void ExpectSameSamples(const char* path, AudioDecoder<float>& serial,
+                       AudioDecoder<float>& parallel, int64_t blocks = -1) {
+  int64_t index = 0;
+  for (int64_t i = 0; blocks < 0 || i < blocks; ++i) {
+    auto expected = serial.ReadBlock();
+    if (!expected) break;
+    auto block = parallel.ReadBlock(expected->Size());
+    ASSERT_TRUE(block) << path << " ended at " << index;
+    ASSERT_EQ(block->Size(), expected->Size()) << path << " at " << index;
+    ASSERT_EQ(block->time(), expected->time()) << path << " at " << index;
+    for (int c = 0; c < expected->Channels(); ++c) {
+      ASSERT_EQ(std::memcmp(block->channel(c), expected->channel(c),
+                            expected->Size() * sizeof(float)),
+                0)
+          << path << " samples mismatch at " << index;
+    }
+    index += expected->Size();
+  }
+  if (blocks < 0) {
+    EXPECT_FALSE(parallel.ReadBlock()) << path;
+  }
+  EXPECT_GT(index, 0) << path;
+}
+
+TEST(DemuxTest, ParallelDecodeMatchesSerial) {
+  static const std::string convert =
+      "ffmpeg -v quiet -i test_data/orders.mp3 -y test_data/orders.flac";
+  ASSERT_EQ(std::system(convert.c_str()), 0);
+  // mp3 needs the packets before each batch for its bit reservoir.
+  for (auto [path, warm_up] : {std::pair("test_data/orders.flac", 0),
+                               std::pair("test_data/kirov.mp3", 8)}) {
+    DecoderOptions options;
+    options.parallel_decode = 4;
+    options.parallel_batch = 5;
+    options.parallel_warm_up = warm_up;
+    {
+      std::ifstream serial_file(path);
+      std::ifstream parallel_file(path);
+      Demux serial_demux(serial_file);
+      Demux parallel_demux(parallel_file);
+      auto serial_codec = serial_demux.GetDecoder(0);
+      auto parallel_codec = parallel_demux.GetDecoder(0, options);
+      AudioDecoder<float> serial(serial_codec);
+      AudioDecoder<float> parallel(parallel_codec);
+      ExpectSameSamples(path, serial, parallel);
+      EXPECT_FALSE(parallel_codec.Failed());
+      // Only the workers' contexts are opened.
+      EXPECT_FALSE(avcodec_is_open(parallel_codec.data()));
+    }
+    {
+      // Batches in flight are dropped on a seek.
+      std::ifstream serial_file(path);
+      std::ifstream parallel_file(path);
+      Demux serial_demux(serial_file);
+      Demux parallel_demux(parallel_file);
+      auto serial_codec = serial_demux.GetDecoder(0);
+      auto parallel_codec = parallel_demux.GetDecoder(0, options);
+      AudioDecoder<float> serial(serial_codec);
+      AudioDecoder<float> parallel(parallel_codec);
+      ExpectSameSamples(path, serial, parallel, 3);
+      ASSERT_TRUE(serial_demux.SeekTo(Rational<int64_t>(1, 1)));
+      ASSERT_TRUE(parallel_demux.SeekTo(Rational<int64_t>(1, 1)));
+      ExpectSameSamples(path, serial, parallel, 20);
+    }
+  }
+}
+
+TEST(DemuxTest, DestroyPipelineBeforeEnd) {
+  std::ifstream input_file("test_data/kirov.mp3");
+  Demux demux(input_file);
+  DecoderOptions options;
+  options.decode_ahead = 2;
+  auto codec = demux.GetDecoder(0, options);
+  demux.StartPipeline(2);
+  AudioDecoder<float> audio(codec);
+  EXPECT_TRUE(audio.ReadBlock());
+}
+
+TEST(DemuxTest, SeekToRefusesWhileDecodingAhead) {
+  std::ifstream input_file("test_data/kirov.mp3");
+  Demux demux(input_file);
+  DecoderOptions options;
+  options.decode_ahead = 2;
+  auto codec = demux.GetDecoder(0, options);
+  AudioDecoder<float> audio(codec);
+  auto first = audio.ReadBlock();
+  ASSERT_TRUE(first);
+  const int64_t size = first->Size();
+  EXPECT_FALSE(demux.SeekTo(Rational<int64_t>(1, 1)));
+  // Decoding goes on where it was.
+  auto next = audio.ReadBlock();
+  ASSERT_TRUE(next);
+  EXPECT_EQ(next->time(), first->time() + size);
+}
+
+// Stream 0 is orders.mp3, stream 1 is kirov.mp3.
+const char* MakeTwoStreamFile() {
+  static const std::string convert =
+      "ffmpeg -v quiet -i test_data/orders.mp3 -i test_data/kirov.mp3 "
+      "-map 0 -map 1 -c copy -y test_data/two_streams.mka";
+  EXPECT_EQ(std::system(convert.c_str()), 0);
+  return "test_data/two_streams.mka";
+}
+
+TEST(DemuxTest, SpillQueuedPacketsOfOtherStream) {
+  const char* path = MakeTwoStreamFile();
+
+  std::ifstream reference_file(path);
+  Demux reference_demux(reference_file);
+  ASSERT_EQ(reference_demux.StreamsCount(), 2);
+  auto reference_codec = reference_demux.GetDecoder(1);
+  AudioDecoder<float> reference(reference_codec);
+
+  std::ifstream input_file(path);
+  DemuxOptions options;
+  options.queue_limits = {16, 0, QueuePolicy::kSpill};
+  Demux demux(input_file, options);
+  auto first_codec = demux.GetDecoder(0);
+  auto second_codec = demux.GetDecoder(1);
+  AudioDecoder<float> first(first_codec);
+  AudioDecoder<float> second(second_codec);
+
+  while (first.ReadBlock()) {
+  }
+  const QueueStats stats = demux.GetQueueStats(1);
+  EXPECT_GT(stats.spilled_packets, 0);
+  EXPECT_LE(stats.peak_packets, 16);
+  EXPECT_EQ(stats.dropped, 0);
+
+  int64_t index = 0;
+  while (auto expected = reference.ReadBlock()) {
+    auto block = second.ReadBlock(expected->Size());
+    ASSERT_TRUE(block) << "ended at " << index;
+    ASSERT_EQ(block->Size(), expected->Size()) << "at " << index;
+    for (int c = 0; c < expected->Channels(); ++c) {
+      ASSERT_EQ(std::memcmp(block->channel(c), expected->channel(c),
+                            expected->Size() * sizeof(float)),
+                0)
+          << "samples mismatch at " << index;
+    }
+    index += expected->Size();
+  }
+  EXPECT_FALSE(second.ReadBlock());
+  EXPECT_FALSE(demux.Failed());
+  EXPECT_EQ(demux.GetQueueStats(1).packets, 0);
+}
+
+// A queue that overflows while its stream is not read fails the read
+// instead of ending the stream or waiting for a reader that never comes.
+TEST(DemuxTest, FullQueueFailsTheRead) {
+  const char* path = MakeTwoStreamFile();
+  for (QueuePolicy policy : {QueuePolicy::kFail, QueuePolicy::kBlock}) {
+    std::ifstream input_file(path);
+    DemuxOptions options;
+    options.queue_limits = {16, 0, policy};
+    Demux demux(input_file, options);
+    auto first_codec = demux.GetDecoder(0);
+    auto second_codec = demux.GetDecoder(1);
+    AudioDecoder<float> first(first_codec);
+    EXPECT_FALSE(first_codec.Failed());
+
+    while (first.ReadBlock()) {
+    }
+    EXPECT_TRUE(demux.Failed());
+    EXPECT_TRUE(first_codec.Failed());
+    EXPECT_EQ(demux.GetQueueStats(1).dropped, 1);
+    EXPECT_LE(demux.GetQueueStats(1).peak_packets, 16);
+  }
+}
+
+// Decoders that stop early are destroyed while the other stream's queue is
+// full, without waiting for packets that never come.
+TEST(DemuxTest, DestroyDecodersAheadBeforeEnd) {
+  const char* path = MakeTwoStreamFile();
+  for (bool pipelined : {true, false}) {
+    std::ifstream input_file(path);
+    DemuxOptions demux_options;
+    demux_options.queue_limits = {4, 0, QueuePolicy::kBlock};
+    Demux demux(input_file, demux_options);
+    DecoderOptions options;
+    options.decode_ahead = 2;
+    auto first_codec = demux.GetDecoder(0, options);
+    auto second_codec = demux.GetDecoder(1, options);
+    if (pipelined) demux.StartPipeline(4);
+    AudioDecoder<float> first(first_codec);
+    AudioDecoder<float> second(second_codec);
+    EXPECT_TRUE(first.ReadBlock()) << pipelined;
+    EXPECT_TRUE(second.ReadBlock()) << pipelined;
+  }
+}
+
+TEST(DemuxTest, OnlySelectedStreamsAreRead) {
+  std::ifstream input_file(MakeTwoStreamFile());
+  Demux demux(input_file);
+  ASSERT_EQ(demux.StreamsCount(), 2);
+  EXPECT_FALSE(demux.StreamSelected(0));
+  EXPECT_FALSE(demux.StreamSelected(1));
+  EXPECT_FALSE(demux.read());
+
+  input_file.clear();
+  input_file.seekg(0);
+  Demux selected(input_file);
+  selected.SelectStream(1);
+  EXPECT_TRUE(selected.StreamSelected(1));
+  int packets = 0;
+  while (auto packet = selected.read()) {
+    ASSERT_EQ(packet->StreamIndex(), 1);
+    ++packets;
+  }
+  EXPECT_GT(packets, 0);
+}
+
+TEST(DemuxTest, GetDecoderSelectsItsStream) {
+  std::ifstream input_file(MakeTwoStreamFile());
+  Demux demux(input_file);
+  auto codec = demux.GetDecoder(0);
+  EXPECT_TRUE(demux.StreamSelected(0));
+  EXPECT_FALSE(demux.StreamSelected(1));
+  AudioDecoder<float> audio(codec);
+  while (audio.ReadBlock()) {
+  }
+  EXPECT_EQ(demux.GetQueueStats(1).peak_packets, 0);
+}
+
+TEST(DemuxTest, SeekToLandsOnExactSample) {
+  std::vector<float> reference;
+  Rational<int64_t> reference_start(0, 1);
+  {
+    std::ifstream input_file("test_data/kirov.mp3");
+    Demux demux(input_file);
+    auto codec = demux.GetDecoder(0);
+    AudioDecoder<float> audio(codec);
+    while (auto sample = audio.Read()) {
+      if (reference.empty()) reference_start = sample->time();
+      reference.push_back(sample->sample(0));
+    }
+  }
+  ASSERT_GT(reference.size(), 44100 * 2);
+
+  std::ifstream input_file("test_data/kirov.mp3");
+  Demux demux(input_file);
+  auto codec = demux.GetDecoder(0);
+  AudioDecoder<float> audio(codec);
+  ASSERT_TRUE(audio.ReadBlock());
+
+  for (Rational<int64_t> target :
+       {Rational<int64_t>(3, 2), Rational<int64_t>(1, 2),
+        Rational<int64_t>(2, 1)}) {
+    ASSERT_TRUE(demux.SeekTo(target));
+    auto sample = audio.Read();
+    ASSERT_TRUE(sample);
+    const Rational<int64_t> time = sample->time();
+    EXPECT_FALSE(time < target) << double(time) << " " << double(target);
+    EXPECT_TRUE(time < target + Rational<int64_t>(1, 44100))
+        << double(time) << " " << double(target);
+
+    const Rational<int64_t> offset =
+        (time - reference_start) * Rational<int64_t>(44100, 1);
+    ASSERT_EQ(offset.Den(), 1);
+    ASSERT_LT(offset.Num(), int64_t(reference.size()));
+    for (int64_t i = offset.Num(); i < offset.Num() + 1000; ++i) {
+      ASSERT_NEAR(sample->sample(0), reference[i], 1e-4)
+          << "at " << i << " after seeking to " << double(target);
+      sample = audio.Read();
+      ASSERT_TRUE(sample);
+    }
+  }
+
+  // Seeking before the AudioDecoder exists lands on the same sample.
+  std::ifstream late_file("test_data/kirov.mp3");
+  Demux late_demux(late_file);
+  auto late_codec = late_demux.GetDecoder(0);
+  const Rational<int64_t> target(3, 2);
+  ASSERT_TRUE(late_demux.SeekTo(target));
+  AudioDecoder<float> late_audio(late_codec);
+  auto sample = late_audio.Read();
+  ASSERT_TRUE(sample);
+  const Rational<int64_t> time = sample->time();
+  EXPECT_FALSE(time < target) << double(time);
+  EXPECT_TRUE(time < target + Rational<int64_t>(1, 44100)) << double(time);
+}
+
+TEST(DemuxTest, IndexedSeekMatchesUnindexed) {
+  const std::string index_path = "kirov.mp3.idx";
+  std::remove(index_path.c_str());
+  DemuxOptions options;
+  options.index_path = index_path;
+
+  Rational<int64_t> duration(0, 1);
+  {
+    auto source = MappedFileSource::Open("test_data/kirov.mp3");
+    ASSERT_TRUE(source);
+    Demux demux(std::move(source), options);
+    ASSERT_NE(demux.Index(), nullptr);
+    EXPECT_GT(demux.Index()->Size(0), 0);
+    duration = demux.Duration(0);
+  }
+  ASSERT_TRUE(std::ifstream(index_path).good());
+
+  std::ifstream input_file("test_data/kirov.mp3");
+  Demux indexed(input_file, options);
+  ASSERT_NE(indexed.Index(), nullptr);
+  EXPECT_EQ(indexed.Duration(0), duration);
+  std::ifstream plain_file("test_data/kirov.mp3");
+  Demux plain(plain_file);
+
+  auto indexed_codec = indexed.GetDecoder(0);
+  auto plain_codec = plain.GetDecoder(0);
+  AudioDecoder<float> indexed_audio(indexed_codec);
+  AudioDecoder<float> plain_audio(plain_codec);
+  for (Rational<int64_t> target :
+       {Rational<int64_t>(2, 1), Rational<int64_t>(1, 3)}) {
+    ASSERT_TRUE(indexed.SeekTo(target));
+    ASSERT_TRUE(plain.SeekTo(target));
+    for (int i = 0; i < 1000; ++i) {
+      auto a = indexed_audio.Read();
+      auto b = plain_audio.Read();
+      ASSERT_TRUE(a && b);
+      ASSERT_EQ(a->time(), b->time()) << "after seeking to " << double(target);
+      ASSERT_NEAR(a->sample(0), b->sample(0), 1e-4);
+    }
+  }
+  std::remove(index_path.c_str());
+}
+
+// A sidecar of an input rewritten with the same length is rebuilt.
+TEST(DemuxTest, IndexOfRewrittenInputIsRebuilt) {
+  const std::string path = "rewritten.mp3";
+  const std::string index_path = "rewritten.mp3.idx";
+  std::remove(index_path.c_str());
+  std::vector<char> bytes;
+  {
+    std::ifstream original("test_data/kirov.mp3", std::ios::binary);
+    bytes.assign(std::istreambuf_iterator<char>(original),
+                 std::istreambuf_iterator<char>());
+  }
+  ASSERT_GT(bytes.size(), 0);
+  auto write_input = [&] {
+    std::ofstream(path, std::ios::binary | std::ios::trunc)
+        .write(bytes.data(), bytes.size());
+  };
+  auto read_index = [&] {
+    std::ifstream index(index_path, std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(index),
+                             std::istreambuf_iterator<char>());
+  };
+  DemuxOptions options;
+  options.index_path = index_path;
+
+  write_input();
+  {
+    std::ifstream input_file(path);
+    Demux demux(input_file, options);
+    ASSERT_NE(demux.Index(), nullptr);
+  }
+  const std::vector<char> first_index = read_index();
+  ASSERT_FALSE(first_index.empty());
+
+  bytes.back() ^= 1;
+  write_input();
+  {
+    std::ifstream input_file(path);
+    Demux demux(input_file, options);
+    ASSERT_NE(demux.Index(), nullptr);
+  }
+  EXPECT_NE(read_index(), first_index);
+
+  std::remove(path.c_str());
+  std::remove(index_path.c_str());
+}
+
+TEST(DemuxTest, NoIndexForInputOfUnknownSize) {
+  const std::string index_path = "kirov_pipe.mp3.idx";
+  std::remove(index_path.c_str());
+  DemuxOptions options;
+  options.index_path = index_path;
+  iPipeStream pipe("cat test_data/kirov.mp3");
+  Demux demux(pipe, options);
+  EXPECT_EQ(demux.Index(), nullptr);
+  EXPECT_FALSE(std::ifstream(index_path).good());
+  auto codec = demux.GetDecoder(0);
+  AudioDecoder<float> audio(codec);
+  EXPECT_TRUE(audio.ReadBlock());
+}
+
+TEST(DemuxTest, FastOpenWithCachedCodecParameters) {
+  std::vector<float> reference;
+  AVCodecParameters* parameters = avcodec_parameters_alloc();
+  {
+    std::ifstream input_file("test_data/kirov.mp3");
+    Demux demux(input_file);
+    ASSERT_EQ(
+        avcodec_parameters_copy(parameters, demux.CodecParameters(0)), 0);
+    auto codec = demux.GetDecoder(0);
+    AudioDecoder<float> audio(codec);
+    while (auto sample = audio.Read()) reference.push_back(sample->sample(0));
+  }
+
+  DemuxOptions options;
+  options.format = "mp3";
+  options.probesize = 4096;
+  options.analyze_duration = Rational<int64_t>(1, 100);
+  options.codec_parameters = {parameters};
+  std::ifstream input_file("test_data/kirov.mp3");
+  Demux demux(input_file, options);
+  avcodec_parameters_free(&parameters);
+  ASSERT_EQ(demux.StreamsCount(), 1);
+  EXPECT_EQ(demux.CodecParameters(0)->sample_rate, 44100);
+
+  auto codec = demux.GetDecoder(0);
+  AudioDecoder<float> audio(codec);
+  std::vector<float> samples;
+  while (auto sample = audio.Read()) samples.push_back(sample->sample(0));
+  EXPECT_EQ(samples, reference);
+}
+
+}  // namespace potamos
@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "audio.hpp"
+#include "mux.hpp"
+#include "segmented_encoder.hpp"
+
+// Encodes a minute of stereo audio with one AudioEncoder and with a
+// SegmentedAudioEncoder on a growing number of threads, and reports the wall
+// time and the speedup over the single encoder.
+
+namespace potamos {
+namespace {
+
+constexpr int64_t kSamples = 44100 * 60;
+
+struct Codec {
+  const char* name;
+  AVCodecID codec_id;
+  AVSampleFormat sample_format;
+  const char* format;
+  int64_t overlap_frames;
+  std::map<std::string, std::string> dictionary;
+};
+
+AVCodecParameters* MakeParameters(const Codec& codec) {
+  AVCodecContext* ctx =
+      avcodec_alloc_context3(avcodec_find_encoder(codec.codec_id));
+  AVCodecParameters* params = avcodec_parameters_alloc();
+  avcodec_parameters_from_context(params, ctx);
+  avcodec_free_context(&ctx);
+  params->sample_rate = 44100;
+  params->format = codec.sample_format;
+  av_channel_layout_default(&params->ch_layout, 2);
+  params->bits_per_raw_sample = 16;
+  params->bit_rate = 192000;
+  return params;
+}
+
+// Seconds to encode `samples`, with `threads` segment threads or, for 0, one
+// AudioEncoder.
+double Encode(const Codec& codec, const std::vector<int16_t>& samples,
+              int threads) {
+  AVCodecParameters* params = MakeParameters(codec);
+  EncoderOptions encoder_options;
+  encoder_options.dictionary = codec.dictionary;
+  std::ostringstream output;
+  auto start = std::chrono::steady_clock::now();
+  {
+    Mux mux(output, codec.format, {params});
+    Encoder encoder = mux.GetEncoder(0, encoder_options);
+    if (threads == 0) {
+      AudioEncoder<int16_t> audio(encoder);
+      audio.WriteInterleaved(samples.data(), kSamples);
+      audio.Flush();
+    } else {
+      SegmentOptions options;
+      options.threads = threads;
+      options.overlap_frames = codec.overlap_frames;
+      options.encoder = encoder_options;
+      SegmentedAudioEncoder<int16_t> audio(encoder, options);
+      audio.WriteInterleaved(samples.data(), kSamples);
+      audio.Flush();
+    }
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  avcodec_parameters_free(&params);
+  return elapsed.count();
+}
+
+}  // namespace
+}  // namespace potamos
+
+int main() {
+  using namespace potamos;
+  std::vector<int16_t> samples(kSamples * 2);
+  for (int64_t i = 0; i < kSamples; ++i) {
+    const double t = double(i) / 44100;
+    samples[2 * i] = int16_t(std::sin(t * 2 * M_PI * 440) * 12000);
+    samples[2 * i + 1] =
+        int16_t(std::sin(t * 2 * M_PI * (200 + 10 * t)) * 12000);
+  }
+  const std::vector<Codec> codecs = {
+      {"flac", AV_CODEC_ID_FLAC, AV_SAMPLE_FMT_S16, "flac", 0, {}},
+      {"mp3", AV_CODEC_ID_MP3, AV_SAMPLE_FMT_S16P, "mp3", 2,
+       {{"reservoir", "0"}}},
+  };
+  std::cout << std::fixed << std::setprecision(3);
+
+  for (const Codec& codec : codecs) {
+    std::cout << codec.name << std::endl;
+    std::cout << " threads   seconds   speedup" << std::endl;
+    const double single = Encode(codec, samples, 0);
+    std::cout << std::setw(8) << "single" << std::setw(10) << single
+              << std::setw(10) << 1.0 << std::endl;
+    const int cores = std::max(1u, std::thread::hardware_concurrency());
+    for (int threads = 1;; threads = std::min(threads * 2, cores)) {
+      const double seconds = Encode(codec, samples, threads);
+      std::cout << std::setw(8) << threads << std::setw(10) << seconds
+                << std::setw(10) << single / seconds << std::endl;
+      if (threads == cores) break;
+    }
+  }
+  return 0;
+}
@@ -12,18 +12,25 @@ extern "C" {
 #include <libavutil/file.h>
 }
 
+#include "codec_options.hpp"
+#include "rational.hpp"
 #include "stream_data.hpp"
 
 namespace potamos {
 
 class PacketDestination {
  public:
+  // Returns false if the packet could not be written.
   virtual bool WriteNextPacket(Packet packet, const int stream_index) = 0;
+  // Whether encoders have to put global headers in the stream's extradata
+  // rather than in every keyframe, as some containers require.
+  virtual bool GlobalHeader() const { return false; }
 };
 
 class Encoder {
  public:
-  Encoder(const AVStream* stream, PacketDestination* packet_dst)
+  Encoder(AVStream* stream, PacketDestination* packet_dst,
+          const EncoderOptions& options = {})
       : stream_(stream), packet_dst_(packet_dst) {
     const AVCodec* codec = avcodec_find_encoder(stream->codecpar->codec_id);
     context_ = avcodec_alloc_context3(codec);
@@ -34,7 +41,46 @@ class Encoder {
     int ret0 = avcodec_parameters_to_context(context_, stream->codecpar);
     if (ret0 < 0)
       std::cerr << "avcodec_parameters_to_context =" << ret0 << std::endl;
-    int ret = avcodec_open2(context_, codec, nullptr);
+    context_->time_base = TimeBase(stream, options);
+    if (packet_dst_->GlobalHeader()) {
+      context_->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    int ret = internal::OpenCodec(context_, codec, options);
+    if (ret < 0) {
+      std::cerr << "avcodec_open2 =" << ret << std::endl;
+      return;
+    }
+    // The muxer needs the extradata of global headers and a time base.
+    avcodec_parameters_from_context(stream->codecpar, context_);
+    if (stream->time_base.num <= 0 || stream->time_base.den <= 0) {
+      stream->time_base = context_->time_base;
+    }
+  }
+
+  // Another encoder for the stream of `encoder` with its own codec context,
+  // opened with the same parameters, e.g. to encode part of the stream on
+  // another thread. Its packets go to `packet_dst`; the stream is left as it
+  // is. `options` should be the ones `encoder` was opened with.
+  Encoder(const Encoder& encoder, PacketDestination* packet_dst,
+          const EncoderOptions& options = {})
+      : stream_(encoder.stream_), packet_dst_(packet_dst) {
+    const AVCodecContext* model = encoder.context_;
+    context_ = avcodec_alloc_context3(model->codec);
+    if (context_ == nullptr) {
+      std::cerr << "avcodec_alloc_context3 failed to allocate codec context"
+                << std::endl;
+      return;
+    }
+    AVCodecParameters* parameters = avcodec_parameters_alloc();
+    avcodec_parameters_from_context(parameters, model);
+    // The codec makes its own extradata when it opens.
+    av_freep(&parameters->extradata);
+    parameters->extradata_size = 0;
+    avcodec_parameters_to_context(context_, parameters);
+    avcodec_parameters_free(&parameters);
+    context_->time_base = model->time_base;
+    context_->flags = model->flags;
+    int ret = internal::OpenCodec(context_, model->codec, options);
     if (ret < 0) std::cerr << "avcodec_open2 =" << ret << std::endl;
   }
 
@@ -53,41 +99,69 @@ class Encoder {
     }
   }
 
+  // Both return false if the codec or the destination fails.
   bool Write(const Frame& frame) {
     int ret = avcodec_send_frame(context_, frame.data());
     if (ret < 0) return false;
-    while (auto packet = Read()) {
-      packet_dst_->WriteNextPacket(std::move(*packet), stream_->index);
-    }
-    return true;
+    return WritePackets();
   }
 
   bool Flush() {
     int ret = avcodec_send_frame(context_, nullptr);
     if (ret < 0) return false;
-    while (auto packet = Read()) {
-      packet_dst_->WriteNextPacket(std::move(*packet), stream_->index);
-    }
-    return true;
+    return WritePackets();
+  }
+
+  // Passes a packet for this stream that was encoded elsewhere, e.g. by a
+  // second Encoder, on to the destination. Its time_base must be set.
+  bool WritePacket(Packet packet) {
+    return packet_dst_->WriteNextPacket(std::move(packet), stream_->index);
   }
 
   std::optional<Packet> Read() {
     Packet packet;
     int ret = avcodec_receive_packet(context_, packet.data());
     if (ret < 0) return std::nullopt;
+    // Packet timestamps are in the codec's time base; the muxer rescales
+    // them to the stream's.
+    packet.data()->time_base = context_->time_base;
     return packet;
   }
 
-  Frame MakeFrame() const {
-    // TODO: move this logic to Audio encoder as it is audio specific code.
-    return Frame(stream_->codecpar->format, &stream_->codecpar->ch_layout,
-                 context_->frame_size > 0 ? context_->frame_size : 1024);
-  }
-
   AVCodecContext* data() { return context_; }
   const AVCodecContext* data() const { return context_; }
 
+  AVMediaType Type() const { return stream_->codecpar->codec_type; }
+  Rational<int64_t> TimeBase() const { return context_->time_base; }
+
  protected:
+  bool WritePackets() {
+    bool ok = true;
+    while (auto packet = Read()) {
+      ok &= packet_dst_->WriteNextPacket(std::move(*packet), stream_->index);
+    }
+    return ok;
+  }
+
+  // EncoderOptions::time_base, else 1/sample_rate for audio, else the
+  // stream's.
+  static AVRational TimeBase(const AVStream* stream,
+                             const EncoderOptions& options) {
+    if (options.time_base.Num() > 0) {
+      return av_make_q(options.time_base.Num(), options.time_base.Den());
+    }
+    const AVCodecParameters* codecpar = stream->codecpar;
+    if (codecpar->codec_type == AVMEDIA_TYPE_AUDIO &&
+        codecpar->sample_rate > 0) {
+      return av_make_q(1, codecpar->sample_rate);
+    }
+    if (stream->time_base.num <= 0 || stream->time_base.den <= 0) {
+      std::cerr << "Encoder needs EncoderOptions::time_base for stream "
+                << stream->index << std::endl;
+    }
+    return stream->time_base;
+  }
+
   const AVStream* stream_;
   PacketDestination* packet_dst_;
   AVCodecContext* context_;
@@ -0,0 +1,354 @@
+#pragma once
+
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/mem.h>
+#include <libavutil/pixdesc.h>
+}
+
+#include "decoder.hpp"
+#include "rational.hpp"
+#include "stream_data.hpp"
+
+namespace potamos {
+
+namespace internal {
+
+// Empty if the layout cannot be described.
+inline std::string DescribeChannelLayout(const AVChannelLayout& layout) {
+  std::string description(64, '\0');
+  int ret = av_channel_layout_describe(&layout, description.data(),
+                                       description.size());
+  if (ret > int(description.size())) {
+    description.assign(ret, '\0');
+    ret = av_channel_layout_describe(&layout, description.data(),
+                                     description.size());
+  }
+  if (ret < 0) return "";
+  description.resize(std::strlen(description.c_str()));
+  return description;
+}
+
+}  // namespace internal
+
+// Format of the frames written to one input of a FilterGraph.
+struct FilterInput {
+  AVMediaType type = AVMEDIA_TYPE_AUDIO;
+  // Time base of the frames' pts.
+  Rational<int64_t> time_base = Rational<int64_t>(1, 1);
+  // Audio.
+  int sample_rate = 0;
+  AVSampleFormat sample_format = AV_SAMPLE_FMT_NONE;
+  int channels = 0;
+  // As av_channel_layout_describe writes it, e.g. "5.1(side)". Empty uses
+  // the default layout for `channels`.
+  std::string channel_layout;
+  // Video.
+  int width = 0;
+  int height = 0;
+  AVPixelFormat pixel_format = AV_PIX_FMT_NONE;
+  Rational<int64_t> sample_aspect_ratio = Rational<int64_t>(0, 1);
+
+  // The format of the frames a decoder reads.
+  static FilterInput From(const Decoder& decoder) {
+    const AVCodecContext* context = decoder.data();
+    FilterInput input;
+    input.type = decoder.Type();
+    input.time_base = decoder.TimeBase();
+    input.sample_rate = context->sample_rate;
+    input.sample_format = context->sample_fmt;
+    input.channels = context->ch_layout.nb_channels;
+    input.channel_layout = internal::DescribeChannelLayout(context->ch_layout);
+    input.width = context->width;
+    input.height = context->height;
+    input.pixel_format = context->pix_fmt;
+    input.sample_aspect_ratio = context->sample_aspect_ratio;
+    return input;
+  }
+};
+
+// Runs frames through a libavfilter graph, e.g. "loudnorm,atempo=1.25".
+// The description uses ffmpeg's -filter_complex syntax. Inputs are labelled
+// [in0], [in1], ... and the single output [out]; a plain filter chain with
+// one input needs no labels. The output may be of another media type than
+// the inputs, e.g. the video of "showwaves". Frames are passed by reference,
+// samples and pixels are never copied on the way in.
+class FilterGraph {
+ public:
+  // Returns nullptr if the description does not parse or does not match the
+  // inputs.
+  static std::unique_ptr<FilterGraph> Create(
+      const std::string& description, const std::vector<FilterInput>& inputs) {
+    std::unique_ptr<FilterGraph> graph(new FilterGraph());
+    if (!graph->Configure(description, inputs)) return nullptr;
+    return graph;
+  }
+
+  FilterGraph(const FilterGraph&) = delete;
+  FilterGraph& operator=(const FilterGraph&) = delete;
+
+  ~FilterGraph() { avfilter_graph_free(&graph_); }
+
+  // Feeds a frame to input `input`; the graph takes a new reference to it.
+  bool Write(const Frame& frame, int input = 0) {
+    if (!ValidInput(input)) return false;
+    if (closed_[input]) {
+      std::cerr << "filter graph input " << input << " is closed" << std::endl;
+      return false;
+    }
+    int ret = av_buffersrc_add_frame_flags(
+        sources_[input], const_cast<AVFrame*>(frame.data()),
+        AV_BUFFERSRC_FLAG_KEEP_REF);
+    if (ret < 0) {
+      std::cerr << "av_buffersrc_add_frame_flags = " << ret << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  // Ends input `input`. Filters holding frames back, e.g. for look-ahead,
+  // release them once all inputs are closed.
+  bool Close(int input) {
+    if (!ValidInput(input)) return false;
+    if (closed_[input]) return true;
+    closed_[input] = true;
+    int ret = av_buffersrc_add_frame_flags(sources_[input], nullptr, 0);
+    if (ret < 0) {
+      std::cerr << "closing filter graph input = " << ret << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  // Ends every input, at the end of the stream.
+  bool Flush() {
+    bool ok = true;
+    for (size_t i = 0; i < sources_.size(); ++i) ok &= Close(i);
+    return ok;
+  }
+
+  // Next filtered frame, with pts in TimeBase(), or std::nullopt if the graph
+  // needs more input or has ended.
+  std::optional<Frame> Read() {
+    Frame frame;
+    int ret = av_buffersink_get_frame(sink_, frame.data());
+    if (ret == AVERROR_EOF) {
+      ended_ = true;
+      return std::nullopt;
+    }
+    if (ret < 0) {
+      if (ret != AVERROR(EAGAIN)) {
+        std::cerr << "av_buffersink_get_frame = " << ret << std::endl;
+      }
+      return std::nullopt;
+    }
+    return frame;
+  }
+
+  // Whether every frame has been read after Flush.
+  bool Ended() const { return ended_; }
+
+  int Inputs() const { return sources_.size(); }
+
+  // Format of the frames Read returns.
+  Rational<int64_t> TimeBase() const {
+    return av_buffersink_get_time_base(sink_);
+  }
+  int Format() const { return av_buffersink_get_format(sink_); }
+  int SampleRate() const { return av_buffersink_get_sample_rate(sink_); }
+  int Width() const { return av_buffersink_get_w(sink_); }
+  int Height() const { return av_buffersink_get_h(sink_); }
+
+  // Makes audio frames exactly `samples` long, the last one excepted, for
+  // encoders with a fixed frame size.
+  void SetFrameSize(int samples) {
+    av_buffersink_set_frame_size(sink_, samples);
+  }
+
+ private:
+  FilterGraph() : graph_(avfilter_graph_alloc()) {}
+
+  bool ValidInput(int input) const {
+    if (input >= 0 && input < Inputs()) return true;
+    std::cerr << "filter graph has no input " << input << std::endl;
+    return false;
+  }
+
+  bool Configure(const std::string& description,
+                 const std::vector<FilterInput>& inputs) {
+    if (graph_ == nullptr || inputs.empty()) return false;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      AVFilterContext* source = nullptr;
+      const std::string name = "in" + std::to_string(i);
+      const bool audio = inputs[i].type == AVMEDIA_TYPE_AUDIO;
+      const std::optional<std::string> arguments = SourceArguments(inputs[i]);
+      if (!arguments) {
+        std::cerr << "filter graph input " << name << " has no valid format"
+                  << std::endl;
+        return false;
+      }
+      int ret = avfilter_graph_create_filter(
+          &source, avfilter_get_by_name(audio ? "abuffer" : "buffer"),
+          name.c_str(), arguments->c_str(), nullptr, graph_);
+      if (ret < 0) {
+        std::cerr << "creating filter graph input " << name << " = " << ret
+                  << std::endl;
+        return false;
+      }
+      sources_.push_back(source);
+    }
+    closed_.assign(sources_.size(), false);
+
+    // The open ends of the description: its inputs are fed by the sources,
+    // its output feeds a sink of the output pad's media type.
+    AVFilterInOut* inputs_left = nullptr;
+    AVFilterInOut* outputs_left = nullptr;
+    int ret = avfilter_graph_parse2(graph_, description.c_str(), &inputs_left,
+                                    &outputs_left);
+    const bool linked = ret >= 0 && LinkInputs(inputs_left) &&
+                        LinkOutput(outputs_left);
+    avfilter_inout_free(&inputs_left);
+    avfilter_inout_free(&outputs_left);
+    if (ret < 0) {
+      std::cerr << "cannot parse filter graph \"" << description
+                << "\" = " << ret << std::endl;
+      return false;
+    }
+    if (!linked) return false;
+    ret = avfilter_graph_config(graph_, nullptr);
+    if (ret < 0) {
+      std::cerr << "cannot configure filter graph \"" << description
+                << "\" = " << ret << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  // Connects input [inN] of the description to source N. Unlabelled inputs
+  // take the sources not named by a label, in order.
+  bool LinkInputs(AVFilterInOut* inputs) {
+    std::vector<bool> linked(sources_.size(), false);
+    size_t next = 0;
+    for (AVFilterInOut* input = inputs; input != nullptr; input = input->next) {
+      size_t index = 0;
+      if (input->name == nullptr) {
+        while (next < sources_.size() && linked[next]) ++next;
+        index = next;
+      } else {
+        while (index < sources_.size() &&
+               input->name != "in" + std::to_string(index)) {
+          ++index;
+        }
+      }
+      if (index >= sources_.size() || linked[index]) {
+        std::cerr << "filter graph input ["
+                  << (input->name ? input->name : "") << "] has no source"
+                  << std::endl;
+        return false;
+      }
+      linked[index] = true;
+      int ret = avfilter_link(sources_[index], 0, input->filter_ctx,
+                              input->pad_idx);
+      if (ret < 0) {
+        std::cerr << "linking filter graph input " << index << " = " << ret
+                  << std::endl;
+        return false;
+      }
+    }
+    for (size_t i = 0; i < linked.size(); ++i) {
+      if (!linked[i]) {
+        std::cerr << "filter graph input in" << i << " is not used"
+                  << std::endl;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool LinkOutput(AVFilterInOut* outputs) {
+    if (outputs == nullptr || outputs->next != nullptr ||
+        (outputs->name != nullptr && std::string(outputs->name) != "out")) {
+      std::cerr << "filter graph needs a single output [out]" << std::endl;
+      return false;
+    }
+    const AVMediaType type = avfilter_pad_get_type(
+        outputs->filter_ctx->output_pads, outputs->pad_idx);
+    if (type != AVMEDIA_TYPE_AUDIO && type != AVMEDIA_TYPE_VIDEO) {
+      std::cerr << "filter graph output is neither audio nor video"
+                << std::endl;
+      return false;
+    }
+    const bool audio = type == AVMEDIA_TYPE_AUDIO;
+    int ret = avfilter_graph_create_filter(
+        &sink_, avfilter_get_by_name(audio ? "abuffersink" : "buffersink"),
+        "out", nullptr, nullptr, graph_);
+    if (ret < 0) {
+      std::cerr << "creating filter graph output = " << ret << std::endl;
+      return false;
+    }
+    ret = avfilter_link(outputs->filter_ctx, outputs->pad_idx, sink_, 0);
+    if (ret < 0) {
+      std::cerr << "linking filter graph output = " << ret << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  // Options of the abuffer or buffer filter, or std::nullopt if the format
+  // is incomplete.
+  static std::optional<std::string> SourceArguments(const FilterInput& input) {
+    if (input.time_base.Num() <= 0 || input.time_base.Den() <= 0) {
+      return std::nullopt;
+    }
+    std::string arguments =
+        "time_base=" + std::to_string(input.time_base.Num()) + "/" +
+        std::to_string(input.time_base.Den());
+    if (input.type == AVMEDIA_TYPE_AUDIO) {
+      const char* sample_format = av_get_sample_fmt_name(input.sample_format);
+      std::string layout = input.channel_layout;
+      if (layout.empty() && input.channels > 0) {
+        AVChannelLayout channels;
+        av_channel_layout_default(&channels, input.channels);
+        layout = internal::DescribeChannelLayout(channels);
+        av_channel_layout_uninit(&channels);
+      }
+      if (input.sample_rate <= 0 || sample_format == nullptr ||
+          layout.empty()) {
+        return std::nullopt;
+      }
+      return arguments + ":sample_rate=" + std::to_string(input.sample_rate) +
+             ":sample_fmt=" + sample_format + ":channel_layout=" + layout;
+    }
+    if (input.type != AVMEDIA_TYPE_VIDEO || input.width <= 0 ||
+        input.height <= 0 || input.pixel_format == AV_PIX_FMT_NONE) {
+      return std::nullopt;
+    }
+    const Rational<int64_t> aspect = input.sample_aspect_ratio.Num() > 0
+                                         ? input.sample_aspect_ratio
+                                         : Rational<int64_t>(1, 1);
+    return arguments + ":video_size=" + std::to_string(input.width) + "x" +
+           std::to_string(input.height) +
+           ":pix_fmt=" + std::to_string(input.pixel_format) +
+           ":pixel_aspect=" + std::to_string(aspect.Num()) + "/" +
+           std::to_string(aspect.Den());
+  }
+
+  AVFilterGraph* graph_;
+  std::vector<AVFilterContext*> sources_;
+  std::vector<bool> closed_;
+  AVFilterContext* sink_ = nullptr;
+  bool ended_ = false;
+};
+
+}  // namespace potamos
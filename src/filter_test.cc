@@ -0,0 +1,197 @@
+#include "filter.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace potamos {
+namespace {
+
+FilterInput MonoFloat(int sample_rate) {
+  FilterInput input;
+  input.type = AVMEDIA_TYPE_AUDIO;
+  input.time_base = Rational<int64_t>(1, sample_rate);
+  input.sample_rate = sample_rate;
+  input.sample_format = AV_SAMPLE_FMT_FLTP;
+  input.channels = 1;
+  return input;
+}
+
+Frame MakeConstant(float value, int64_t pts, int size, int sample_rate) {
+  AVChannelLayout mono;
+  av_channel_layout_default(&mono, 1);
+  Frame frame(AV_SAMPLE_FMT_FLTP, &mono, size);
+  frame.data()->sample_rate = sample_rate;
+  frame.data()->pts = pts;
+  float* samples = (float*)frame.data()->extended_data[0];
+  for (int i = 0; i < size; ++i) samples[i] = value;
+  return frame;
+}
+
+TEST(FilterGraphTest, FiltersFrameAtATime) {
+  auto graph = FilterGraph::Create("volume=0.5", {MonoFloat(44100)});
+  ASSERT_NE(graph, nullptr);
+  EXPECT_EQ(graph->Inputs(), 1);
+  EXPECT_FALSE(graph->Write(MakeConstant(0.5f, 0, 1024, 44100), 1));
+  EXPECT_FALSE(graph->Write(MakeConstant(0.5f, 0, 1024, 44100), -1));
+  EXPECT_FALSE(graph->Close(1));
+  EXPECT_EQ(graph->SampleRate(), 44100);
+  EXPECT_EQ(graph->TimeBase(), Rational<int64_t>(1, 44100));
+
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_TRUE(graph->Write(MakeConstant(0.5f, i * 1024, 1024, 44100)));
+    auto frame = graph->Read();
+    ASSERT_TRUE(frame);
+    EXPECT_EQ(frame->data()->pts, i * 1024);
+    ASSERT_EQ(frame->data()->nb_samples, 1024);
+    const float* samples = (const float*)frame->data()->extended_data[0];
+    for (int j = 0; j < 1024; ++j) ASSERT_EQ(samples[j], 0.25f);
+    EXPECT_FALSE(graph->Read());
+  }
+  ASSERT_TRUE(graph->Flush());
+  EXPECT_FALSE(graph->Read());
+  EXPECT_TRUE(graph->Ended());
+}
+
+TEST(FilterGraphTest, FlushReleasesBufferedSamples) {
+  auto graph = FilterGraph::Create("atempo=2", {MonoFloat(44100)});
+  ASSERT_NE(graph, nullptr);
+  int64_t samples = 0;
+  for (int i = 0; i < 44100 * 2 / 1000; ++i) {
+    ASSERT_TRUE(graph->Write(MakeConstant(0.5f, i * 1000, 1000, 44100)));
+    while (auto frame = graph->Read()) samples += frame->data()->nb_samples;
+  }
+  const int64_t before_flush = samples;
+  ASSERT_TRUE(graph->Flush());
+  while (auto frame = graph->Read()) samples += frame->data()->nb_samples;
+  EXPECT_GT(samples, before_flush);
+  EXPECT_NEAR(samples, 44000, 1024);
+  EXPECT_TRUE(graph->Ended());
+}
+
+TEST(FilterGraphTest, MixesTwoInputs) {
+  auto graph = FilterGraph::Create(
+      "[in0][in1]amix=inputs=2:normalize=0[out]",
+      {MonoFloat(44100), MonoFloat(44100)});
+  ASSERT_NE(graph, nullptr);
+  EXPECT_EQ(graph->Inputs(), 2);
+  std::vector<float> mixed;
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_TRUE(graph->Write(MakeConstant(0.25f, i * 512, 512, 44100), 0));
+    ASSERT_TRUE(graph->Write(MakeConstant(0.5f, i * 512, 512, 44100), 1));
+    while (auto frame = graph->Read()) {
+      const float* samples = (const float*)frame->data()->extended_data[0];
+      mixed.insert(mixed.end(), samples, samples + frame->data()->nb_samples);
+    }
+  }
+  ASSERT_TRUE(graph->Flush());
+  while (auto frame = graph->Read()) {
+    const float* samples = (const float*)frame->data()->extended_data[0];
+    mixed.insert(mixed.end(), samples, samples + frame->data()->nb_samples);
+  }
+  ASSERT_EQ(mixed.size(), 4 * 512);
+  for (float sample : mixed) ASSERT_FLOAT_EQ(sample, 0.75f);
+}
+
+TEST(FilterGraphTest, ScalesVideo) {
+  FilterInput input;
+  input.type = AVMEDIA_TYPE_VIDEO;
+  input.time_base = Rational<int64_t>(1, 25);
+  input.width = 320;
+  input.height = 240;
+  input.pixel_format = AV_PIX_FMT_YUV420P;
+  auto graph = FilterGraph::Create("scale=160:120,format=gray", {input});
+  ASSERT_NE(graph, nullptr);
+  EXPECT_EQ(graph->Width(), 160);
+  EXPECT_EQ(graph->Height(), 120);
+  EXPECT_EQ(graph->Format(), AV_PIX_FMT_GRAY8);
+
+  for (int i = 0; i < 5; ++i) {
+    Frame frame;
+    AVFrame* picture = frame.data();
+    picture->width = 320;
+    picture->height = 240;
+    picture->format = AV_PIX_FMT_YUV420P;
+    picture->pts = i;
+    ASSERT_GE(av_frame_get_buffer(picture, 0), 0);
+    for (int plane = 0; plane < 3; ++plane) {
+      const int height = plane == 0 ? 240 : 120;
+      for (int y = 0; y < height; ++y) {
+        std::fill_n(picture->data[plane] + y * picture->linesize[plane],
+                    picture->linesize[plane], plane == 0 ? 100 : 128);
+      }
+    }
+    ASSERT_TRUE(graph->Write(frame));
+    auto out = graph->Read();
+    ASSERT_TRUE(out);
+    EXPECT_EQ(out->data()->pts, i);
+    EXPECT_EQ(out->data()->width, 160);
+    EXPECT_EQ(out->data()->data[0][60 * out->data()->linesize[0] + 80], 100);
+  }
+}
+
+TEST(FilterGraphTest, RendersAudioAsVideo) {
+  auto graph = FilterGraph::Create("showwaves=s=320x240:rate=25",
+                                   {MonoFloat(44100)});
+  ASSERT_NE(graph, nullptr);
+  EXPECT_EQ(graph->Width(), 320);
+  EXPECT_EQ(graph->Height(), 240);
+  EXPECT_EQ(graph->TimeBase(), Rational<int64_t>(1, 25));
+
+  int pictures = 0;
+  for (int i = 0; i < 44100 / 1000; ++i) {
+    const float value = (i % 2) ? 0.5f : -0.5f;
+    ASSERT_TRUE(graph->Write(MakeConstant(value, i * 1000, 1000, 44100)));
+    while (auto frame = graph->Read()) {
+      EXPECT_EQ(frame->data()->width, 320);
+      ++pictures;
+    }
+  }
+  ASSERT_TRUE(graph->Flush());
+  while (graph->Read()) ++pictures;
+  EXPECT_GE(pictures, 24);
+}
+
+TEST(FilterGraphTest, KeepsTheChannelLayout) {
+  AVChannelLayout side;
+  ASSERT_EQ(av_channel_layout_from_string(&side, "5.1(side)"), 0);
+  FilterInput input = MonoFloat(48000);
+  input.channels = 6;
+  input.channel_layout = internal::DescribeChannelLayout(side);
+  EXPECT_EQ(input.channel_layout, "5.1(side)");
+  auto graph = FilterGraph::Create("volume=0.5", {input});
+  ASSERT_NE(graph, nullptr);
+
+  Frame frame(AV_SAMPLE_FMT_FLTP, &side, 1024);
+  frame.data()->sample_rate = 48000;
+  frame.data()->pts = 0;
+  for (int c = 0; c < 6; ++c) {
+    std::fill_n((float*)frame.data()->extended_data[c], 1024, 0.5f);
+  }
+  ASSERT_TRUE(graph->Write(frame));
+  auto out = graph->Read();
+  ASSERT_TRUE(out);
+  EXPECT_EQ(av_channel_layout_compare(&out->data()->ch_layout, &side), 0);
+  av_channel_layout_uninit(&side);
+}
+
+TEST(FilterGraphTest, RejectsBadDescription) {
+  EXPECT_EQ(FilterGraph::Create("no_such_filter", {MonoFloat(44100)}),
+            nullptr);
+  EXPECT_EQ(FilterGraph::Create("volume=0.5", {}), nullptr);
+  // Every input needs a place in the graph.
+  EXPECT_EQ(FilterGraph::Create("volume=0.5",
+                                {MonoFloat(44100), MonoFloat(44100)}),
+            nullptr);
+  EXPECT_EQ(FilterGraph::Create("[in2]volume=0.5", {MonoFloat(44100)}),
+            nullptr);
+  EXPECT_EQ(FilterGraph::Create("volume=0.5", {FilterInput()}), nullptr);
+  FilterInput no_size;
+  no_size.type = AVMEDIA_TYPE_VIDEO;
+  EXPECT_EQ(FilterGraph::Create("null", {no_size}), nullptr);
+}
+
+}  // namespace
+}  // namespace potamos
@@ -0,0 +1,239 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavformat/avio.h>
+#include <libavutil/error.h>
+}
+
+namespace potamos {
+
+// Byte source behind the Demux AVIO context. Read and Seek follow the AVIO
+// read_packet/seek callback contracts.
+class InputSource {
+ public:
+  virtual ~InputSource() = default;
+
+  // Returns the number of bytes read or AVERROR_EOF.
+  virtual int Read(uint8_t* buf, int buf_size) = 0;
+  // Returns the new position, or the total size for AVSEEK_SIZE; negative if
+  // unknown or on error.
+  virtual int64_t Seek(int64_t offset, int whence) = 0;
+  // Lets the source fetch up to this many bytes per underlying read,
+  // independently of how much AVIO asks for. Called before the first read.
+  virtual void SetReadAhead(int64_t /*bytes*/) {}
+};
+
+class IStreamSource : public InputSource {
+ public:
+  IStreamSource(std::istream& stream) : stream_(stream) {}
+
+  void SetReadAhead(int64_t bytes) override {
+    read_ahead_.resize(bytes);
+    begin_ = end_ = 0;
+  }
+
+  int Read(uint8_t* buf, int buf_size) override {
+    if (read_ahead_.empty()) return ReadStream(buf, buf_size);
+    if (begin_ == end_) {
+      int count = ReadStream(read_ahead_.data(), read_ahead_.size());
+      if (count < 0) return count;
+      begin_ = 0;
+      end_ = count;
+    }
+    const int count = std::min<int64_t>(buf_size, end_ - begin_);
+    std::memcpy(buf, read_ahead_.data() + begin_, count);
+    begin_ += count;
+    return count;
+  }
+
+  int64_t Seek(int64_t offset, int whence) override {
+    if (whence != AVSEEK_SIZE) {
+      // The stream is ahead of the reader by the unread read-ahead bytes.
+      if (whence == 1) offset -= end_ - begin_;
+      begin_ = end_ = 0;
+    }
+    return SeekStream(offset, whence);
+  }
+
+ private:
+  int ReadStream(uint8_t* buf, int buf_size) {
+    int count = stream_.readsome((char*)buf, buf_size);
+    if (count == 0) {
+      // stream_.peek();
+      if (stream_.eof()) {
+        return AVERROR_EOF;
+      } else {
+        return AVERROR_EOF;
+        // return AVERROR_EXTERNAL;
+      }
+    } else {
+      return count;
+    }
+  }
+
+  int64_t SeekStream(int64_t offset, int whence) {
+    switch (whence) {
+      case AVSEEK_SIZE: {
+        // Unknown for streams that cannot seek, e.g. pipes.
+        const std::streampos position = stream_.tellg();
+        if (position < 0) return -1;
+        stream_.seekg(0, std::ios_base::end);
+        const std::streampos size = stream_.tellg();
+        stream_.clear();
+        stream_.seekg(position);
+        return size;
+      }
+      case 0: {
+        stream_.seekg(offset, std::ios_base::beg);
+        return stream_.tellg();
+      }
+      case 1: {
+        std::clog << "SEEK whence = 1: " << offset << " " << whence << " ("
+                  << AVSEEK_SIZE << " / " << AVSEEK_FORCE << " ) " << std::endl;
+        stream_.seekg(offset, std::ios_base::cur);
+        return stream_.tellg();
+      }
+      case 2: {
+        stream_.seekg(offset, std::ios_base::end);
+        return stream_.tellg();
+      }
+      default: {
+        std::clog << "SEEK whence = " << whence << ": " << offset << " "
+                  << whence << " (" << AVSEEK_SIZE << " / " << AVSEEK_FORCE
+                  << " ) " << std::endl;
+      }
+      case AVSEEK_FORCE: {
+      }
+    }
+
+    stream_.seekg(offset);
+    return stream_.tellg();
+  }
+
+  std::istream& stream_;
+  std::vector<uint8_t> read_ahead_;
+  int64_t begin_ = 0;
+  int64_t end_ = 0;
+};
+
+// Serves reads straight from a read-only mapping of a local file, so bytes
+// are copied once, from the page cache into the AVIO buffer.
+class MappedFileSource : public InputSource {
+ public:
+  // Default for the range ahead of the read position that is requested with
+  // MADV_WILLNEED.
+  static constexpr int64_t kReadAhead = 4 << 20;
+
+  // Returns nullptr if the file cannot be opened or mapped.
+  static std::unique_ptr<MappedFileSource> Open(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      std::cerr << "open(" << path << ") = " << std::strerror(errno)
+                << std::endl;
+      return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+      std::cerr << "fstat(" << path << ") = " << std::strerror(errno)
+                << std::endl;
+      close(fd);
+      return nullptr;
+    }
+    const uint8_t* data = nullptr;
+    if (st.st_size > 0) {
+      void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapping == MAP_FAILED) {
+        std::cerr << "mmap(" << path << ") = " << std::strerror(errno)
+                  << std::endl;
+        close(fd);
+        return nullptr;
+      }
+      data = static_cast<const uint8_t*>(mapping);
+      madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    return std::unique_ptr<MappedFileSource>(
+        new MappedFileSource(data, st.st_size));
+  }
+
+  MappedFileSource(const MappedFileSource&) = delete;
+  MappedFileSource& operator=(const MappedFileSource&) = delete;
+  ~MappedFileSource() override {
+    if (data_ != nullptr) munmap(const_cast<uint8_t*>(data_), size_);
+  }
+
+  void SetReadAhead(int64_t bytes) override { read_ahead_ = bytes; }
+
+  int Read(uint8_t* buf, int buf_size) override {
+    const int64_t count = std::min<int64_t>(buf_size, size_ - position_);
+    if (count <= 0) return AVERROR_EOF;
+    if (position_ + count > advised_) Advise();
+    std::memcpy(buf, data_ + position_, count);
+    position_ += count;
+    return count;
+  }
+
+  int64_t Seek(int64_t offset, int whence) override {
+    int64_t position;
+    switch (whence & ~AVSEEK_FORCE) {
+      case AVSEEK_SIZE:
+        return size_;
+      case SEEK_SET:
+        position = offset;
+        break;
+      case SEEK_CUR:
+        position = position_ + offset;
+        break;
+      case SEEK_END:
+        position = size_ + offset;
+        break;
+      default:
+        return AVERROR(EINVAL);
+    }
+    if (position < 0 || position > size_) return AVERROR(EINVAL);
+    if (position < advised_ - read_ahead_ || position > advised_) {
+      advised_ = position;
+    }
+    position_ = position;
+    return position_;
+  }
+
+  const uint8_t* data() const { return data_; }
+  int64_t Size() const { return size_; }
+
+ private:
+  MappedFileSource(const uint8_t* data, int64_t size)
+      : data_(data), size_(size) {}
+
+  void Advise() {
+    const int64_t page = sysconf(_SC_PAGESIZE);
+    const int64_t begin = std::max(advised_, position_) / page * page;
+    const int64_t end = std::min(size_, position_ + read_ahead_);
+    if (end <= begin) return;
+    madvise(const_cast<uint8_t*>(data_) + begin, end - begin, MADV_WILLNEED);
+    advised_ = end;
+  }
+
+  const uint8_t* data_;
+  int64_t size_;
+  int64_t position_ = 0;
+  int64_t read_ahead_ = kReadAhead;
+  // End of the range already requested with MADV_WILLNEED.
+  int64_t advised_ = 0;
+};
+
+}  // namespace potamos
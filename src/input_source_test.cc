@@ -0,0 +1,99 @@
+#include "input_source.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "ipstream.hpp"
+
+namespace potamos {
+namespace {
+
+TEST(InputSourceTest, MappedFileReadsAndSeeks) {
+  const std::string path = "input_source_test.bin";
+  std::string content;
+  for (int i = 0; i < 10000; ++i) content += char('a' + i % 26);
+  std::ofstream(path, std::ios::binary) << content;
+
+  auto source = MappedFileSource::Open(path);
+  ASSERT_TRUE(source);
+  EXPECT_EQ(source->Seek(0, AVSEEK_SIZE), 10000);
+  EXPECT_EQ(source->Seek(0, AVSEEK_SIZE | AVSEEK_FORCE), 10000);
+
+  std::string read;
+  std::vector<uint8_t> buffer(4096);
+  while (true) {
+    int count = source->Read(buffer.data(), buffer.size());
+    if (count == AVERROR_EOF) break;
+    ASSERT_GT(count, 0);
+    read.append(buffer.begin(), buffer.begin() + count);
+  }
+  EXPECT_EQ(read, content);
+
+  EXPECT_EQ(source->Seek(26, SEEK_SET), 26);
+  EXPECT_EQ(source->Seek(1, SEEK_CUR), 27);
+  ASSERT_EQ(source->Read(buffer.data(), 2), 2);
+  EXPECT_EQ(buffer[0], 'b');
+  EXPECT_EQ(buffer[1], 'c');
+  EXPECT_EQ(source->Seek(-1, SEEK_END), 9999);
+  EXPECT_EQ(source->Read(buffer.data(), 10), 1);
+  EXPECT_LT(source->Seek(1, SEEK_END), 0);
+  EXPECT_LT(source->Seek(-1, SEEK_SET), 0);
+
+  std::remove(path.c_str());
+}
+
+TEST(InputSourceTest, MissingFile) {
+  EXPECT_FALSE(MappedFileSource::Open("test_data/does_not_exist.mp3"));
+}
+
+TEST(InputSourceTest, IStreamSourceReads) {
+  std::istringstream stream("potamos");
+  IStreamSource source(stream);
+  uint8_t buffer[16];
+  ASSERT_EQ(source.Read(buffer, sizeof(buffer)), 7);
+  EXPECT_EQ(std::string(buffer, buffer + 7), "potamos");
+  EXPECT_EQ(source.Read(buffer, sizeof(buffer)), AVERROR_EOF);
+}
+
+TEST(InputSourceTest, IStreamSourceReadAhead) {
+  std::istringstream stream("abcdefghijklmnopqrstuvwxyz");
+  IStreamSource source(stream);
+  source.SetReadAhead(10);
+  uint8_t buffer[16];
+  ASSERT_EQ(source.Read(buffer, 4), 4);
+  EXPECT_EQ(std::string(buffer, buffer + 4), "abcd");
+  EXPECT_EQ(source.Seek(2, SEEK_CUR), 6);
+  ASSERT_EQ(source.Read(buffer, 16), 10);
+  EXPECT_EQ(std::string(buffer, buffer + 10), "ghijklmnop");
+  EXPECT_EQ(source.Seek(24, SEEK_SET), 24);
+  ASSERT_EQ(source.Read(buffer, 16), 2);
+  EXPECT_EQ(std::string(buffer, buffer + 2), "yz");
+  EXPECT_EQ(source.Read(buffer, 16), AVERROR_EOF);
+}
+
+TEST(InputSourceTest, IStreamSourceSize) {
+  std::istringstream stream("abcdefghijklmnopqrstuvwxyz");
+  IStreamSource source(stream);
+  source.SetReadAhead(10);
+  uint8_t buffer[16];
+  ASSERT_EQ(source.Read(buffer, 8), 8);
+  EXPECT_EQ(source.Seek(0, AVSEEK_SIZE), 26);
+  // Reading goes on where it was, from the read-ahead and then the stream.
+  ASSERT_EQ(source.Read(buffer, 8), 2);
+  EXPECT_EQ(std::string(buffer, buffer + 2), "ij");
+  ASSERT_EQ(source.Read(buffer, 4), 4);
+  EXPECT_EQ(std::string(buffer, buffer + 4), "klmn");
+
+  iPipeStream pipe("echo potamos");
+  IStreamSource piped(pipe);
+  EXPECT_LT(piped.Seek(0, AVSEEK_SIZE), 0);
+}
+
+}  // namespace
+}  // namespace potamos
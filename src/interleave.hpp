@@ -0,0 +1,476 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define POTAMOS_X86 1
+#endif
+
+namespace potamos {
+
+// Conversions between planar (one array per channel) and packed (channels
+// of a sample stored next to each other) sample layouts. Kernels only move
+// bits around, so they are selected by the size of the sample type.
+
+enum class SimdLevel { kScalar, kSse2, kAvx2 };
+
+inline SimdLevel DetectSimdLevel() {
+#ifdef POTAMOS_X86
+  if (__builtin_cpu_supports("avx2")) return SimdLevel::kAvx2;
+  if (__builtin_cpu_supports("sse2")) return SimdLevel::kSse2;
+#endif
+  return SimdLevel::kScalar;
+}
+
+inline SimdLevel BestSimdLevel() {
+  static const SimdLevel level = DetectSimdLevel();
+  return level;
+}
+
+namespace internal {
+
+template <typename U>
+void InterleaveScalar(const U* const* planes, int channels, int64_t begin,
+                      int64_t end, U* packed) {
+  for (int64_t i = begin; i < end; ++i) {
+    for (int c = 0; c < channels; ++c) {
+      packed[i * channels + c] = planes[c][i];
+    }
+  }
+}
+
+template <typename U>
+void DeinterleaveScalar(const U* packed, int channels, int64_t begin,
+                        int64_t end, U* const* planes) {
+  for (int64_t i = begin; i < end; ++i) {
+    for (int c = 0; c < channels; ++c) {
+      planes[c][i] = packed[i * channels + c];
+    }
+  }
+}
+
+// The channel count is known at compile time so the inner loop unrolls.
+template <typename U, int kChannels>
+void InterleaveFixed(const U* const* planes, int64_t begin, int64_t end,
+                     U* packed) {
+  const U* p[kChannels];
+  for (int c = 0; c < kChannels; ++c) p[c] = planes[c];
+  for (int64_t i = begin; i < end; ++i) {
+    for (int c = 0; c < kChannels; ++c) packed[i * kChannels + c] = p[c][i];
+  }
+}
+
+template <typename U, int kChannels>
+void DeinterleaveFixed(const U* packed, int64_t begin, int64_t end,
+                       U* const* planes) {
+  U* p[kChannels];
+  for (int c = 0; c < kChannels; ++c) p[c] = planes[c];
+  for (int64_t i = begin; i < end; ++i) {
+    for (int c = 0; c < kChannels; ++c) p[c][i] = packed[i * kChannels + c];
+  }
+}
+
+#ifdef POTAMOS_X86
+
+inline __m128i Load128(const void* p) {
+  return _mm_loadu_si128((const __m128i*)p);
+}
+inline void Store128(void* p, __m128i v) { _mm_storeu_si128((__m128i*)p, v); }
+
+// Kernels return how many samples they handled, the caller finishes the
+// tail with the scalar loop.
+
+template <typename U>
+int64_t Interleave2Sse2(const U* a, const U* b, int64_t count, U* packed) {
+  constexpr int64_t kLanes = 16 / sizeof(U);
+  int64_t i = 0;
+  for (; i + kLanes <= count; i += kLanes) {
+    const __m128i x = Load128(a + i);
+    const __m128i y = Load128(b + i);
+    __m128i lo, hi;
+    if constexpr (sizeof(U) == 2) {
+      lo = _mm_unpacklo_epi16(x, y);
+      hi = _mm_unpackhi_epi16(x, y);
+    } else if constexpr (sizeof(U) == 4) {
+      lo = _mm_unpacklo_epi32(x, y);
+      hi = _mm_unpackhi_epi32(x, y);
+    } else {
+      lo = _mm_unpacklo_epi64(x, y);
+      hi = _mm_unpackhi_epi64(x, y);
+    }
+    Store128(packed + 2 * i, lo);
+    Store128(packed + 2 * i + kLanes, hi);
+  }
+  return i;
+}
+
+template <typename U>
+int64_t Deinterleave2Sse2(const U* packed, int64_t count, U* a, U* b) {
+  constexpr int64_t kLanes = 16 / sizeof(U);
+  int64_t i = 0;
+  for (; i + kLanes <= count; i += kLanes) {
+    const __m128i x = Load128(packed + 2 * i);
+    const __m128i y = Load128(packed + 2 * i + kLanes);
+    __m128i even, odd;
+    if constexpr (sizeof(U) == 2) {
+      // Sign extending both halves keeps packs from saturating.
+      even = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(x, 16), 16),
+                             _mm_srai_epi32(_mm_slli_epi32(y, 16), 16));
+      odd = _mm_packs_epi32(_mm_srai_epi32(x, 16), _mm_srai_epi32(y, 16));
+    } else if constexpr (sizeof(U) == 4) {
+      const __m128 fx = _mm_castsi128_ps(x), fy = _mm_castsi128_ps(y);
+      even = _mm_castps_si128(_mm_shuffle_ps(fx, fy, _MM_SHUFFLE(2, 0, 2, 0)));
+      odd = _mm_castps_si128(_mm_shuffle_ps(fx, fy, _MM_SHUFFLE(3, 1, 3, 1)));
+    } else {
+      even = _mm_unpacklo_epi64(x, y);
+      odd = _mm_unpackhi_epi64(x, y);
+    }
+    Store128(a + i, even);
+    Store128(b + i, odd);
+  }
+  return i;
+}
+
+// Transposes a square block of 128 bit rows in place. The block is 8x8 for
+// 16 bit samples, 4x4 for 32 bit samples and 2x2 for 64 bit samples.
+template <typename U>
+inline void Transpose128(__m128i* r) {
+  if constexpr (sizeof(U) == 2) {
+    const __m128i a = _mm_unpacklo_epi16(r[0], r[1]);
+    const __m128i b = _mm_unpackhi_epi16(r[0], r[1]);
+    const __m128i c = _mm_unpacklo_epi16(r[2], r[3]);
+    const __m128i d = _mm_unpackhi_epi16(r[2], r[3]);
+    const __m128i e = _mm_unpacklo_epi16(r[4], r[5]);
+    const __m128i f = _mm_unpackhi_epi16(r[4], r[5]);
+    const __m128i g = _mm_unpacklo_epi16(r[6], r[7]);
+    const __m128i h = _mm_unpackhi_epi16(r[6], r[7]);
+    const __m128i ac_lo = _mm_unpacklo_epi32(a, c);
+    const __m128i ac_hi = _mm_unpackhi_epi32(a, c);
+    const __m128i bd_lo = _mm_unpacklo_epi32(b, d);
+    const __m128i bd_hi = _mm_unpackhi_epi32(b, d);
+    const __m128i eg_lo = _mm_unpacklo_epi32(e, g);
+    const __m128i eg_hi = _mm_unpackhi_epi32(e, g);
+    const __m128i fh_lo = _mm_unpacklo_epi32(f, h);
+    const __m128i fh_hi = _mm_unpackhi_epi32(f, h);
+    r[0] = _mm_unpacklo_epi64(ac_lo, eg_lo);
+    r[1] = _mm_unpackhi_epi64(ac_lo, eg_lo);
+    r[2] = _mm_unpacklo_epi64(ac_hi, eg_hi);
+    r[3] = _mm_unpackhi_epi64(ac_hi, eg_hi);
+    r[4] = _mm_unpacklo_epi64(bd_lo, fh_lo);
+    r[5] = _mm_unpackhi_epi64(bd_lo, fh_lo);
+    r[6] = _mm_unpacklo_epi64(bd_hi, fh_hi);
+    r[7] = _mm_unpackhi_epi64(bd_hi, fh_hi);
+  } else if constexpr (sizeof(U) == 4) {
+    const __m128i a = _mm_unpacklo_epi32(r[0], r[1]);
+    const __m128i b = _mm_unpacklo_epi32(r[2], r[3]);
+    const __m128i c = _mm_unpackhi_epi32(r[0], r[1]);
+    const __m128i d = _mm_unpackhi_epi32(r[2], r[3]);
+    r[0] = _mm_unpacklo_epi64(a, b);
+    r[1] = _mm_unpackhi_epi64(a, b);
+    r[2] = _mm_unpacklo_epi64(c, d);
+    r[3] = _mm_unpackhi_epi64(c, d);
+  } else {
+    const __m128i a = _mm_unpacklo_epi64(r[0], r[1]);
+    const __m128i b = _mm_unpackhi_epi64(r[0], r[1]);
+    r[0] = a;
+    r[1] = b;
+  }
+}
+
+// Moves 8 channels in blocks of kLanes samples by kLanes channels.
+template <typename U>
+int64_t Interleave8Sse2(const U* const* planes, int64_t count, U* packed) {
+  constexpr int kLanes = 16 / sizeof(U);
+  int64_t i = 0;
+  for (; i + kLanes <= count; i += kLanes) {
+    for (int group = 0; group < 8; group += kLanes) {
+      __m128i r[kLanes];
+      for (int k = 0; k < kLanes; ++k) r[k] = Load128(planes[group + k] + i);
+      Transpose128<U>(r);
+      for (int k = 0; k < kLanes; ++k) {
+        Store128(packed + (i + k) * 8 + group, r[k]);
+      }
+    }
+  }
+  return i;
+}
+
+template <typename U>
+int64_t Deinterleave8Sse2(const U* packed, int64_t count, U* const* planes) {
+  constexpr int kLanes = 16 / sizeof(U);
+  int64_t i = 0;
+  for (; i + kLanes <= count; i += kLanes) {
+    for (int group = 0; group < 8; group += kLanes) {
+      __m128i r[kLanes];
+      for (int k = 0; k < kLanes; ++k) {
+        r[k] = Load128(packed + (i + k) * 8 + group);
+      }
+      Transpose128<U>(r);
+      for (int k = 0; k < kLanes; ++k) Store128(planes[group + k] + i, r[k]);
+    }
+  }
+  return i;
+}
+
+template <typename U>
+__attribute__((target("avx2"))) int64_t Interleave2Avx2(const U* a,
+                                                        const U* b,
+                                                        int64_t count,
+                                                        U* packed) {
+  constexpr int64_t kLanes = 32 / sizeof(U);
+  int64_t i = 0;
+  for (; i + kLanes <= count; i += kLanes) {
+    const __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+    const __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+    __m256i lo, hi;
+    if constexpr (sizeof(U) == 2) {
+      lo = _mm256_unpacklo_epi16(x, y);
+      hi = _mm256_unpackhi_epi16(x, y);
+    } else if constexpr (sizeof(U) == 4) {
+      lo = _mm256_unpacklo_epi32(x, y);
+      hi = _mm256_unpackhi_epi32(x, y);
+    } else {
+      lo = _mm256_unpacklo_epi64(x, y);
+      hi = _mm256_unpackhi_epi64(x, y);
+    }
+    // unpack works within 128 bit lanes, put the halves back in order.
+    _mm256_storeu_si256((__m256i*)(packed + 2 * i),
+                        _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256((__m256i*)(packed + 2 * i + kLanes),
+                        _mm256_permute2x128_si256(lo, hi, 0x31));
+  }
+  return i;
+}
+
+template <typename U>
+__attribute__((target("avx2"))) int64_t Deinterleave2Avx2(const U* packed,
+                                                          int64_t count, U* a,
+                                                          U* b) {
+  constexpr int64_t kLanes = 32 / sizeof(U);
+  int64_t i = 0;
+  for (; i + kLanes <= count; i += kLanes) {
+    const __m256i x = _mm256_loadu_si256((const __m256i*)(packed + 2 * i));
+    const __m256i y =
+        _mm256_loadu_si256((const __m256i*)(packed + 2 * i + kLanes));
+    __m256i even, odd;
+    if constexpr (sizeof(U) == 2) {
+      even = _mm256_packs_epi32(
+          _mm256_srai_epi32(_mm256_slli_epi32(x, 16), 16),
+          _mm256_srai_epi32(_mm256_slli_epi32(y, 16), 16));
+      odd = _mm256_packs_epi32(_mm256_srai_epi32(x, 16),
+                               _mm256_srai_epi32(y, 16));
+    } else if constexpr (sizeof(U) == 4) {
+      const __m256 fx = _mm256_castsi256_ps(x), fy = _mm256_castsi256_ps(y);
+      even = _mm256_castps_si256(
+          _mm256_shuffle_ps(fx, fy, _MM_SHUFFLE(2, 0, 2, 0)));
+      odd = _mm256_castps_si256(
+          _mm256_shuffle_ps(fx, fy, _MM_SHUFFLE(3, 1, 3, 1)));
+    } else {
+      even = _mm256_unpacklo_epi64(x, y);
+      odd = _mm256_unpackhi_epi64(x, y);
+    }
+    _mm256_storeu_si256((__m256i*)(a + i),
+                        _mm256_permute4x64_epi64(even, 0xD8));
+    _mm256_storeu_si256((__m256i*)(b + i), _mm256_permute4x64_epi64(odd, 0xD8));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) inline void Transpose8x8Avx2(__m256* r) {
+  const __m256 t0 = _mm256_unpacklo_ps(r[0], r[1]);
+  const __m256 t1 = _mm256_unpackhi_ps(r[0], r[1]);
+  const __m256 t2 = _mm256_unpacklo_ps(r[2], r[3]);
+  const __m256 t3 = _mm256_unpackhi_ps(r[2], r[3]);
+  const __m256 t4 = _mm256_unpacklo_ps(r[4], r[5]);
+  const __m256 t5 = _mm256_unpackhi_ps(r[4], r[5]);
+  const __m256 t6 = _mm256_unpacklo_ps(r[6], r[7]);
+  const __m256 t7 = _mm256_unpackhi_ps(r[6], r[7]);
+  const __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+  const __m256 s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+  const __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+  const __m256 s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+  const __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+  const __m256 s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+  const __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+  const __m256 s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+  r[0] = _mm256_permute2f128_ps(s0, s4, 0x20);
+  r[1] = _mm256_permute2f128_ps(s1, s5, 0x20);
+  r[2] = _mm256_permute2f128_ps(s2, s6, 0x20);
+  r[3] = _mm256_permute2f128_ps(s3, s7, 0x20);
+  r[4] = _mm256_permute2f128_ps(s0, s4, 0x31);
+  r[5] = _mm256_permute2f128_ps(s1, s5, 0x31);
+  r[6] = _mm256_permute2f128_ps(s2, s6, 0x31);
+  r[7] = _mm256_permute2f128_ps(s3, s7, 0x31);
+}
+
+// 8 channels of 32 bit samples, 8 samples at a time.
+template <typename U>
+__attribute__((target("avx2"))) int64_t Interleave8Avx2(const U* const* planes,
+                                                        int64_t count,
+                                                        U* packed) {
+  static_assert(sizeof(U) == 4);
+  int64_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 r[8];
+    for (int c = 0; c < 8; ++c) {
+      r[c] = _mm256_loadu_ps((const float*)planes[c] + i);
+    }
+    Transpose8x8Avx2(r);
+    for (int k = 0; k < 8; ++k) {
+      _mm256_storeu_ps((float*)(packed + (i + k) * 8), r[k]);
+    }
+  }
+  return i;
+}
+
+template <typename U>
+__attribute__((target("avx2"))) int64_t Deinterleave8Avx2(const U* packed,
+                                                          int64_t count,
+                                                          U* const* planes) {
+  static_assert(sizeof(U) == 4);
+  int64_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 r[8];
+    for (int k = 0; k < 8; ++k) {
+      r[k] = _mm256_loadu_ps((const float*)(packed + (i + k) * 8));
+    }
+    Transpose8x8Avx2(r);
+    for (int c = 0; c < 8; ++c) _mm256_storeu_ps((float*)planes[c] + i, r[c]);
+  }
+  return i;
+}
+
+#endif  // POTAMOS_X86
+
+template <typename U>
+void Interleave(SimdLevel level, const U* const* planes, int channels,
+                int64_t count, U* packed) {
+  int64_t done = 0;
+  switch (channels) {
+    case 1:
+      std::copy_n(planes[0], count, packed);
+      return;
+    case 2:
+#ifdef POTAMOS_X86
+      if (level == SimdLevel::kAvx2) {
+        done = Interleave2Avx2(planes[0], planes[1], count, packed);
+      } else if (level == SimdLevel::kSse2) {
+        done = Interleave2Sse2(planes[0], planes[1], count, packed);
+      }
+#endif
+      InterleaveFixed<U, 2>(planes, done, count, packed);
+      return;
+    case 6:
+      InterleaveFixed<U, 6>(planes, done, count, packed);
+      return;
+    case 8:
+#ifdef POTAMOS_X86
+      if constexpr (sizeof(U) == 4) {
+        if (level == SimdLevel::kAvx2) {
+          done = Interleave8Avx2(planes, count, packed);
+        }
+      }
+      if (level != SimdLevel::kScalar && done == 0) {
+        done = Interleave8Sse2(planes, count, packed);
+      }
+#endif
+      InterleaveFixed<U, 8>(planes, done, count, packed);
+      return;
+    default:
+      InterleaveScalar(planes, channels, done, count, packed);
+  }
+}
+
+template <typename U>
+void Deinterleave(SimdLevel level, const U* packed, int channels,
+                  int64_t count, U* const* planes) {
+  int64_t done = 0;
+  switch (channels) {
+    case 1:
+      std::copy_n(packed, count, planes[0]);
+      return;
+    case 2:
+#ifdef POTAMOS_X86
+      if (level == SimdLevel::kAvx2) {
+        done = Deinterleave2Avx2(packed, count, planes[0], planes[1]);
+      } else if (level == SimdLevel::kSse2) {
+        done = Deinterleave2Sse2(packed, count, planes[0], planes[1]);
+      }
+#endif
+      DeinterleaveFixed<U, 2>(packed, done, count, planes);
+      return;
+    case 6:
+      DeinterleaveFixed<U, 6>(packed, done, count, planes);
+      return;
+    case 8:
+#ifdef POTAMOS_X86
+      if constexpr (sizeof(U) == 4) {
+        if (level == SimdLevel::kAvx2) {
+          done = Deinterleave8Avx2(packed, count, planes);
+        }
+      }
+      if (level != SimdLevel::kScalar && done == 0) {
+        done = Deinterleave8Sse2(packed, count, planes);
+      }
+#endif
+      DeinterleaveFixed<U, 8>(packed, done, count, planes);
+      return;
+    default:
+      DeinterleaveScalar(packed, channels, done, count, planes);
+  }
+}
+
+template <size_t kSize>
+struct UnsignedOfSize;
+template <>
+struct UnsignedOfSize<1> {
+  using Type = uint8_t;
+};
+template <>
+struct UnsignedOfSize<2> {
+  using Type = uint16_t;
+};
+template <>
+struct UnsignedOfSize<4> {
+  using Type = uint32_t;
+};
+template <>
+struct UnsignedOfSize<8> {
+  using Type = uint64_t;
+};
+
+}  // namespace internal
+
+// Copies count samples from channels planar arrays into one packed array.
+template <typename SampleType>
+void Interleave(const SampleType* const* planes, int channels, int64_t count,
+                SampleType* packed, SimdLevel level = BestSimdLevel()) {
+  using U = typename internal::UnsignedOfSize<sizeof(SampleType)>::Type;
+  if constexpr (sizeof(SampleType) == 1) {
+    internal::InterleaveScalar<U>((const U* const*)planes, channels, 0, count,
+                                  (U*)packed);
+  } else {
+    internal::Interleave<U>(level, (const U* const*)planes, channels, count,
+                            (U*)packed);
+  }
+}
+
+// Splits count samples of a packed array into channels planar arrays.
+template <typename SampleType>
+void Deinterleave(const SampleType* packed, int channels, int64_t count,
+                  SampleType* const* planes,
+                  SimdLevel level = BestSimdLevel()) {
+  using U = typename internal::UnsignedOfSize<sizeof(SampleType)>::Type;
+  if constexpr (sizeof(SampleType) == 1) {
+    internal::DeinterleaveScalar<U>((const U*)packed, channels, 0, count,
+                                    (U* const*)planes);
+  } else {
+    internal::Deinterleave<U>(level, (const U*)packed, channels, count,
+                              (U* const*)planes);
+  }
+}
+
+}  // namespace potamos
@@ -0,0 +1,104 @@
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "interleave.hpp"
+
+// Measures planar <-> packed conversion throughput in GB/s of samples moved.
+// "loop" is the per-sample strided loop the audio decoder and encoder used
+// before the conversion kernels.
+
+namespace potamos {
+namespace {
+
+constexpr int64_t kSamples = 1 << 16;
+constexpr int kRepeats = 200;
+
+template <typename Function>
+double GigabytesPerSecond(int64_t bytes, Function function) {
+  function();  // warm up the caches
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kRepeats; ++i) function();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return bytes * kRepeats / elapsed.count() / 1e9;
+}
+
+template <typename SampleType>
+void Benchmark(const std::string& name, int channels) {
+  std::vector<std::vector<SampleType>> planes(
+      channels, std::vector<SampleType>(kSamples, SampleType(1)));
+  std::vector<const SampleType*> inputs;
+  std::vector<SampleType*> outputs;
+  for (auto& plane : planes) {
+    inputs.push_back(plane.data());
+    outputs.push_back(plane.data());
+  }
+  std::vector<SampleType> packed(kSamples * channels);
+  const int64_t bytes = kSamples * channels * sizeof(SampleType);
+
+  std::cout << std::setw(4) << name << std::setw(4) << channels;
+  double loop = GigabytesPerSecond(bytes, [&] {
+    for (int64_t j = 0; j < kSamples; ++j) {
+      for (int c = 0; c < channels; ++c) {
+        packed[j * channels + c] = inputs[c][j];
+      }
+    }
+  });
+  std::cout << std::setw(10) << loop;
+  for (SimdLevel level :
+       {SimdLevel::kScalar, SimdLevel::kSse2, SimdLevel::kAvx2}) {
+    if (level > BestSimdLevel()) {
+      std::cout << std::setw(10) << "-";
+      continue;
+    }
+    std::cout << std::setw(10) << GigabytesPerSecond(bytes, [&] {
+      Interleave(inputs.data(), channels, kSamples, packed.data(), level);
+    });
+  }
+  loop = GigabytesPerSecond(bytes, [&] {
+    for (int64_t j = 0; j < kSamples; ++j) {
+      for (int c = 0; c < channels; ++c) {
+        outputs[c][j] = packed[j * channels + c];
+      }
+    }
+  });
+  std::cout << " |" << std::setw(10) << loop;
+  for (SimdLevel level :
+       {SimdLevel::kScalar, SimdLevel::kSse2, SimdLevel::kAvx2}) {
+    if (level > BestSimdLevel()) {
+      std::cout << std::setw(10) << "-";
+      continue;
+    }
+    std::cout << std::setw(10) << GigabytesPerSecond(bytes, [&] {
+      Deinterleave(packed.data(), channels, kSamples, outputs.data(), level);
+    });
+  }
+  std::cout << std::endl;
+}
+
+}  // namespace
+}  // namespace potamos
+
+int main() {
+  using potamos::Benchmark;
+  std::cout << std::fixed << std::setprecision(2);
+  std::cout << "fmt   ch";
+  for (const char* direction : {"", " |"}) {
+    std::cout << direction;
+    for (const char* column : {"loop", "scalar", "sse2", "avx2"}) {
+      std::cout << std::setw(10) << column;
+    }
+  }
+  std::cout << "  (interleave | deinterleave, GB/s)" << std::endl;
+  for (int channels : {1, 2, 6, 8}) {
+    Benchmark<int16_t>("s16", channels);
+    Benchmark<int32_t>("s32", channels);
+    Benchmark<float>("flt", channels);
+    Benchmark<double>("dbl", channels);
+  }
+  return 0;
+}
@@ -0,0 +1,80 @@
+#include "interleave.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <vector>
+
+namespace potamos {
+namespace {
+
+template <typename SampleType>
+class InterleaveTest : public testing::Test {};
+
+using SampleTypes = testing::Types<uint8_t, int16_t, int32_t, float, double>;
+TYPED_TEST_SUITE(InterleaveTest, SampleTypes);
+
+std::vector<SimdLevel> SupportedLevels() {
+  std::vector<SimdLevel> levels = {SimdLevel::kScalar};
+  if (BestSimdLevel() == SimdLevel::kSse2) levels.push_back(SimdLevel::kSse2);
+  if (BestSimdLevel() == SimdLevel::kAvx2) {
+    levels.push_back(SimdLevel::kSse2);
+    levels.push_back(SimdLevel::kAvx2);
+  }
+  return levels;
+}
+
+TYPED_TEST(InterleaveTest, RoundTripMatchesScalarLayout) {
+  for (SimdLevel level : SupportedLevels()) {
+    for (int channels : {1, 2, 3, 6, 8}) {
+      for (int64_t count : {0, 1, 7, 16, 33, 1027}) {
+        std::vector<std::vector<TypeParam>> planes(
+            channels, std::vector<TypeParam>(count));
+        std::vector<const TypeParam*> input;
+        for (int c = 0; c < channels; ++c) {
+          for (int64_t i = 0; i < count; ++i) {
+            planes[c][i] = TypeParam(i * 8 + c + 1);
+          }
+          input.push_back(planes[c].data());
+        }
+
+        std::vector<TypeParam> packed(count * channels);
+        Interleave(input.data(), channels, count, packed.data(), level);
+        for (int64_t i = 0; i < count; ++i) {
+          for (int c = 0; c < channels; ++c) {
+            ASSERT_EQ(packed[i * channels + c], planes[c][i])
+                << "level " << int(level) << " channels " << channels
+                << " count " << count << " at " << i << ":" << c;
+          }
+        }
+
+        std::vector<std::vector<TypeParam>> output(
+            channels, std::vector<TypeParam>(count));
+        std::vector<TypeParam*> output_planes;
+        for (auto& plane : output) output_planes.push_back(plane.data());
+        Deinterleave(packed.data(), channels, count, output_planes.data(),
+                     level);
+        EXPECT_EQ(output, planes) << "level " << int(level) << " channels "
+                                  << channels << " count " << count;
+      }
+    }
+  }
+}
+
+TEST(InterleaveTest, KeepsNegativeSamples) {
+  std::vector<int16_t> left = {-1, -32768, 32767, -2, 5, -6, 7, -8, 9};
+  std::vector<int16_t> right = {1, 32767, -32768, 2, -5, 6, -7, 8, -9};
+  std::vector<int16_t> packed(left.size() * 2);
+  const int16_t* planes[] = {left.data(), right.data()};
+  Interleave(planes, 2, left.size(), packed.data());
+
+  std::vector<int16_t> out_left(left.size()), out_right(right.size());
+  int16_t* out_planes[] = {out_left.data(), out_right.data()};
+  Deinterleave(packed.data(), 2, left.size(), out_planes);
+  EXPECT_EQ(out_left, left);
+  EXPECT_EQ(out_right, right);
+}
+
+}  // namespace
+}  // namespace potamos
@@ -0,0 +1,168 @@
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include "audio.hpp"
+#include "demux.hpp"
+#include "input_source.hpp"
+#include "mux.hpp"
+
+// Sweeps the AVIO buffer size of Demux and Mux and reports throughput in MB/s
+// together with the number of I/O callbacks per MB, which is what bounds
+// syscall-heavy storage such as NFS.
+
+namespace potamos {
+namespace {
+
+constexpr int kRepeats = 20;
+
+class CountingSource : public InputSource {
+ public:
+  CountingSource(std::istream& stream, int64_t& calls)
+      : source_(stream), calls_(calls) {}
+
+  int Read(uint8_t* buf, int buf_size) override {
+    ++calls_;
+    return source_.Read(buf, buf_size);
+  }
+  int64_t Seek(int64_t offset, int whence) override {
+    return source_.Seek(offset, whence);
+  }
+  void SetReadAhead(int64_t bytes) override { source_.SetReadAhead(bytes); }
+
+ private:
+  IStreamSource source_;
+  int64_t& calls_;
+};
+
+// Discards everything written to it, counting the calls that reach it.
+class CountingBuffer : public std::streambuf {
+ public:
+  int64_t calls = 0;
+  int64_t bytes = 0;
+
+ protected:
+  std::streamsize xsputn(const char*, std::streamsize count) override {
+    ++calls;
+    bytes += count;
+    return count;
+  }
+  int_type overflow(int_type c) override {
+    ++calls;
+    ++bytes;
+    return c;
+  }
+  pos_type seekoff(off_type offset, std::ios_base::seekdir dir,
+                   std::ios_base::openmode) override {
+    if (dir == std::ios_base::beg) position_ = offset;
+    if (dir == std::ios_base::cur) position_ = bytes + offset;
+    return position_;
+  }
+  pos_type seekpos(pos_type position, std::ios_base::openmode) override {
+    position_ = position;
+    return position_;
+  }
+
+ private:
+  pos_type position_ = 0;
+};
+
+void Report(int64_t bytes, int64_t calls, double seconds) {
+  std::cout << std::setw(10) << bytes / seconds / 1e6 << std::setw(10)
+            << calls * 1e6 / bytes;
+}
+
+void BenchmarkDemux(const std::string& path, const DemuxOptions& options) {
+  int64_t calls = 0, bytes = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kRepeats; ++i) {
+    std::ifstream input(path, std::ios::binary);
+    Demux demux(std::make_unique<CountingSource>(input, calls), options);
+    for (int s = 0; s < demux.StreamsCount(); ++s) demux.SelectStream(s);
+    while (auto packet = demux.read()) bytes += packet->data()->size;
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  Report(bytes, calls, elapsed.count());
+}
+
+void BenchmarkMux(const MuxOptions& options) {
+  const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_PCM_S16LE);
+  AVCodecContext* ctx = avcodec_alloc_context3(codec);
+  AVCodecParameters* params = avcodec_parameters_alloc();
+  avcodec_parameters_from_context(params, ctx);
+  avcodec_free_context(&ctx);
+  params->sample_rate = 44100;
+  params->format = AVSampleFormat::AV_SAMPLE_FMT_S16;
+  av_channel_layout_default(&params->ch_layout, 2);
+  params->bits_per_coded_sample = 16;
+  params->block_align = 4;
+
+  const int64_t size = 44100 * 10;
+  std::vector<int16_t> left(size), right(size);
+  for (int64_t i = 0; i < size; ++i) {
+    left[i] = int16_t(std::sin(i * 0.1) * 20000);
+    right[i] = int16_t(std::sin(i * 0.07) * 20000);
+  }
+
+  CountingBuffer buffer;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kRepeats; ++i) {
+    std::ostream output(&buffer);
+    Mux mux(output, "wav", {params}, options);
+    Encoder encoder = mux.GetEncoder(0);
+    AudioEncoder<int16_t> audio(encoder);
+    const int16_t* channels[] = {left.data(), right.data()};
+    audio.WriteBlock(channels, size);
+    audio.Flush();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  avcodec_parameters_free(&params);
+  Report(buffer.bytes, buffer.calls, elapsed.count());
+}
+
+}  // namespace
+}  // namespace potamos
+
+int main() {
+  using namespace potamos;
+  const std::vector<int> buffer_sizes = {4 << 10, 16 << 10, 64 << 10,
+                                         256 << 10, 1 << 20};
+  std::cout << std::fixed << std::setprecision(2);
+
+  for (const char* path : {"test_data/kirov.mp3", "test_data/orders.mp3"}) {
+    std::cout << "demux " << path << std::endl;
+    std::cout << "  buffer      MB/s   calls/MB  (read-ahead 4 MiB)"
+              << std::endl;
+    for (int buffer_size : buffer_sizes) {
+      std::cout << std::setw(8) << buffer_size;
+      DemuxOptions options;
+      options.buffer_size = buffer_size;
+      BenchmarkDemux(path, options);
+      options.read_ahead = 4 << 20;
+      BenchmarkDemux(path, options);
+      std::cout << std::endl;
+    }
+  }
+
+  std::cout << "mux wav" << std::endl;
+  std::cout << "  buffer      MB/s   calls/MB  (coalescing 4 MiB)" << std::endl;
+  for (int buffer_size : buffer_sizes) {
+    std::cout << std::setw(8) << buffer_size;
+    MuxOptions options;
+    options.buffer_size = buffer_size;
+    BenchmarkMux(options);
+    options.write_coalescing = 4 << 20;
+    BenchmarkMux(options);
+    std::cout << std::endl;
+  }
+  return 0;
+}
@@ -1,8 +1,12 @@
 #pragma once
 
+#include <atomic>
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -12,15 +16,54 @@ extern "C" {
 }
 
 #include "encoder.hpp"
+#include "output_sink.hpp"
+#include "rational.hpp"
+#include "spsc_queue.hpp"
 #include "stream_data.hpp"
 
 namespace potamos {
 
+struct MuxOptions {
+  // Size of the AVIO buffer, i.e. the largest write AVIO hands to the output
+  // in one callback.
+  int buffer_size = 4096;
+  // AVIO writes are gathered until this many bytes are pending and then
+  // written to the stream at once; 0 writes every callback through. Only
+  // applies to std::ostream output; an FdSink gathers writes by itself.
+  int64_t write_coalescing = 0;
+  // Packets go through av_interleaved_write_frame, which buffers them so
+  // that streams written one after another are interleaved by dts in the
+  // output.
+  bool interleave = false;
+  // When positive, packets are handed to a writer thread through a queue of
+  // this many packets. All container and stream I/O then happens on that
+  // thread, and encoders only wait when the queue is full.
+  size_t async_queue = 0;
+
+  // Large buffers for batch jobs on high-latency storage, where per-call
+  // overhead dominates.
+  static MuxOptions Throughput() {
+    MuxOptions options;
+    options.buffer_size = 1 << 20;
+    options.write_coalescing = 4 << 20;
+    return options;
+  }
+};
+
 class Mux : public PacketDestination {
  public:
   Mux(std::ostream& stream, const std::string& format,
-      const std::vector<const AVCodecParameters*>& streams)
-      : stream_(stream) {
+      const std::vector<const AVCodecParameters*>& streams,
+      const MuxOptions& options = {})
+      : Mux(std::make_unique<OStreamSink>(stream, options.write_coalescing),
+            format, streams, options) {}
+
+  // Writes to `sink`, e.g. an FdSink for a file or pipe. Muxers that need to
+  // seek back, e.g. to finish a header, cannot do so on an unseekable sink.
+  Mux(std::unique_ptr<OutputSink> sink, const std::string& format,
+      const std::vector<const AVCodecParameters*>& streams,
+      const MuxOptions& options = {})
+      : sink_(std::move(sink)), options_(options) {
     // Create the muxer context
     fmt_ctx = avformat_alloc_context();
 
@@ -32,13 +75,18 @@ class Mux : public PacketDestination {
       streams_.push_back(avformat_new_stream(fmt_ctx, nullptr));
       // avcodec_parameters_from_context(streams_.back()->codecpar, ctx);
       avcodec_parameters_copy(streams_.back()->codecpar, codec);
-      streams_.back()->time_base =
-          (AVRational){1, streams_.back()->codecpar->sample_rate};
+      // Tags are container specific; let the muxer pick its own.
+      streams_.back()->codecpar->codec_tag = 0;
+      // Other streams get the time base of their encoder.
+      if (codec->codec_type == AVMEDIA_TYPE_AUDIO) {
+        streams_.back()->time_base = (AVRational){1, codec->sample_rate};
+      }
     }
 
-    avio_ctx_buffer = (uint8_t*)av_malloc(avio_ctx_buffer_size);
-    avio_ctx = avio_alloc_context(avio_ctx_buffer, avio_ctx_buffer_size, 1,
-                                  this, nullptr, &Mux::Write, &Mux::Seek);
+    avio_ctx_buffer = (uint8_t*)av_malloc(options_.buffer_size);
+    avio_ctx = avio_alloc_context(
+        avio_ctx_buffer, options_.buffer_size, 1, this, nullptr, &Mux::Write,
+        sink_->Seekable() ? &Mux::Seek : nullptr);
     if (!avio_ctx) {
       std::cerr << "avio_alloc_context failed" << std::endl;
     }
@@ -48,8 +96,11 @@ class Mux : public PacketDestination {
   }
 
   ~Mux() {
+    StopWriter();
     EnsureHeader();
     EnsureTrailer();
+    if (avio_ctx) avio_flush(avio_ctx);
+    sink_->Flush();
 
     if (avio_ctx) av_freep(&avio_ctx->buffer);
     // av_freep(&avio_ctx_buffer);
@@ -57,7 +108,9 @@ class Mux : public PacketDestination {
     avformat_free_context(fmt_ctx);
   }
 
+  // Encoders on several threads may get here first at the same time.
   void EnsureHeader() {
+    std::lock_guard<std::mutex> lock(header_mutex_);
     if (header_) return;
     // If this is not called the next function do it anyway
     int ret1 = avformat_init_output(fmt_ctx, nullptr);
@@ -75,82 +128,111 @@ class Mux : public PacketDestination {
     trailer_ = true;
   }
 
+  // Writes a packet whose stream_index and timestamps are already those of
+  // the output stream. Returns false on failure, like WriteNextPacket.
   bool Write(Packet&& packet) {
-    EnsureHeader();
-
-    int ret = av_write_frame(fmt_ctx, packet.data());
-    return ret < 0;
+    // Nothing to rescale.
+    packet.data()->time_base = av_make_q(0, 1);
+    return Submit(std::move(packet));
   }
 
-  Encoder GetEncoder(int index) {
-    return Encoder(fmt_ctx->streams[index], this);
+  Encoder GetEncoder(int index, const EncoderOptions& options = {}) {
+    return Encoder(fmt_ctx->streams[index], this, options);
   }
 
   bool WriteNextPacket(Packet packet, const int stream_index) override {
-    return Write(std::move(packet));
+    packet.data()->stream_index = stream_index;
+    return Submit(std::move(packet));
+  }
+
+  // Time base of stream `index` for packets written without an encoder.
+  // Call before the first write; the muxer may still replace it when it
+  // writes the header.
+  void SetTimeBase(int index, Rational<int64_t> time_base) {
+    fmt_ctx->streams[index]->time_base =
+        av_make_q(time_base.Num(), time_base.Den());
+  }
+
+  bool GlobalHeader() const override {
+    return fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER;
   }
 
  private:
-  static int Write(void* opaque, const uint8_t* buf, int buf_size) {
-    Mux* stream = static_cast<Mux*>(opaque);
-    return stream->Write(buf, buf_size);
-  }
-  int Write(const uint8_t* buf, int buf_size) {
-    int64_t before = stream_.tellp();
-    if (stream_.write((char*)buf, buf_size)) {
-      return stream_.tellp() - before;
-    } else if (stream_.eof()) {
-      return AVERROR_EOF;
-    } else {
-      return AVERROR_EOF;
+  // Writes the packet, or queues it for the writer thread. A failed
+  // asynchronous write is reported by the next call.
+  bool Submit(Packet&& packet) {
+    if (options_.async_queue == 0) {
+      EnsureHeader();
+      return WriteFrame(packet.data());
     }
+    if (write_failed_) return false;
+    std::lock_guard<std::mutex> lock(submit_mutex_);
+    if (!writer_.joinable()) StartWriter();
+    return queue_->Push(std::move(packet));
   }
-  static int64_t Seek(void* opaque, int64_t offset, int whence) {
-    Mux* stream = static_cast<Mux*>(opaque);
-    return stream->Seek(offset, whence);
+
+  // Writing the header may change the streams' time bases, so packets are
+  // only moved to them once it is written.
+  bool WriteFrame(AVPacket* packet) {
+    const AVRational time_base =
+        fmt_ctx->streams[packet->stream_index]->time_base;
+    if (packet->time_base.num > 0 && packet->time_base.den > 0) {
+      av_packet_rescale_ts(packet, packet->time_base, time_base);
+    }
+    packet->time_base = time_base;
+    int ret = options_.interleave ? av_interleaved_write_frame(fmt_ctx, packet)
+                                  : av_write_frame(fmt_ctx, packet);
+    if (ret < 0) {
+      std::cerr << "writing packet = " << ret << std::endl;
+      return false;
+    }
+    return true;
   }
-  int64_t Seek(int64_t offset, int whence) {
-    switch (whence) {
-      case AVSEEK_SIZE: {
-        return -1;
-      }
-      case 0: {
-        stream_.seekp(offset, std::ios_base::beg);
-        return stream_.tellp();
-      }
-      case 1: {
-        std::clog << "SEEK whence = 1: " << offset << " " << whence << " ("
-                  << AVSEEK_SIZE << " / " << AVSEEK_FORCE << " ) " << std::endl;
-        stream_.seekp(offset, std::ios_base::cur);
-        return stream_.tellp();
-      }
-      case 2: {
-        stream_.seekp(offset, std::ios_base::end);
-        return stream_.tellp();
-      }
-      default: {
-        std::clog << "SEEK whence = " << whence << ": " << offset << " "
-                  << whence << " (" << AVSEEK_SIZE << " / " << AVSEEK_FORCE
-                  << " ) " << std::endl;
-      }
-      case AVSEEK_FORCE: {
+
+  // Encoders on several threads may submit, so pushes are serialized by
+  // submit_mutex_ in front of the single-producer queue. The header is
+  // written on the writer thread too.
+  void StartWriter() {
+    queue_ = std::make_unique<SpscQueue<Packet>>(options_.async_queue);
+    writer_ = std::thread([this] {
+      EnsureHeader();
+      while (auto packet = queue_->Pop()) {
+        if (!WriteFrame(packet->data())) write_failed_ = true;
       }
-    }
+    });
+  }
 
-    stream_.seekp(offset);
-    return stream_.tellp();
+  void StopWriter() {
+    if (!writer_.joinable()) return;
+    queue_->Close();
+    writer_.join();
+  }
+
+  static int Write(void* opaque, const uint8_t* buf, int buf_size) {
+    Mux* stream = static_cast<Mux*>(opaque);
+    return stream->sink_->Write(buf, buf_size);
+  }
+  static int64_t Seek(void* opaque, int64_t offset, int whence) {
+    Mux* stream = static_cast<Mux*>(opaque);
+    return stream->sink_->Seek(offset, whence);
   }
 
-  size_t avio_ctx_buffer_size = 4096;
   AVFormatContext* fmt_ctx = NULL;
   AVIOContext* avio_ctx = NULL;
   uint8_t* avio_ctx_buffer = NULL;
 
+  std::mutex header_mutex_;
   bool header_ = false, trailer_ = false;
 
   std::vector<AVStream*> streams_;
 
-  std::ostream& stream_;
+  std::unique_ptr<OutputSink> sink_;
+  MuxOptions options_;
+
+  std::unique_ptr<SpscQueue<Packet>> queue_;
+  std::thread writer_;
+  std::mutex submit_mutex_;
+  std::atomic<bool> write_failed_{false};
 };
 
 }  // namespace potamos
\ No newline at end of file
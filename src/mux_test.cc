@@ -1,9 +1,15 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <unistd.h>
 
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -13,7 +19,9 @@ extern "C" {
 }
 
 #include "audio.hpp"
+#include "demux.hpp"
 #include "mux.hpp"
+#include "output_sink.hpp"
 
 namespace potamos {
 
@@ -98,4 +106,290 @@ TEST(MuxTest, WriteBoingMp3) {
   audio.Flush();
 }
 
-}  // namespace potamos
\ No newline at end of file
+TEST(MuxTest, WriteBlockMatchesWrite) {
+  const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_PCM_S16LE);
+  AVCodecContext* ctx = avcodec_alloc_context3(codec);
+  AVCodecParameters* params = avcodec_parameters_alloc();
+  avcodec_parameters_from_context(params, ctx);
+  avcodec_free_context(&ctx);
+
+  params->bit_rate = 128000;
+  params->sample_rate = 44100;
+  params->format = AVSampleFormat::AV_SAMPLE_FMT_S16;
+  av_channel_layout_default(&params->ch_layout, 2);
+  params->bits_per_coded_sample = 16;
+  params->block_align = 4;
+
+  const int size = 44100;
+  std::vector<int16_t> left(size), right(size), interleaved(size * 2);
+  for (int i = 0; i < size; ++i) {
+    left[i] = int16_t(sin(float(i) / 44100 * 3.14 * 2 * 1000) * 20000);
+    right[i] = int16_t(sin(float(i) / 44100 * 3.14 * 2 * 800) * 20000);
+    interleaved[i * 2] = left[i];
+    interleaved[i * 2 + 1] = right[i];
+  }
+
+  std::ostringstream by_sample, by_block, by_interleaved, coalesced;
+  {
+    Mux mux(by_sample, "wav", {params});
+    Encoder encoder = mux.GetEncoder(0);
+    AudioEncoder<int16_t> audio(encoder);
+    for (int i = 0; i < size; ++i) {
+      AudioSample<int16_t> sample(2);
+      sample.sample(0) = left[i];
+      sample.sample(1) = right[i];
+      audio.Write(sample);
+    }
+    audio.Flush();
+  }
+  {
+    Mux mux(by_block, "wav", {params});
+    Encoder encoder = mux.GetEncoder(0);
+    AudioEncoder<int16_t> audio(encoder);
+    for (int offset = 0; offset < size; offset += 3000) {
+      const int16_t* channels[] = {left.data() + offset, right.data() + offset};
+      audio.WriteBlock(channels, std::min(3000, size - offset));
+    }
+    audio.Flush();
+  }
+  {
+    Mux mux(by_interleaved, "wav", {params});
+    Encoder encoder = mux.GetEncoder(0);
+    AudioEncoder<int16_t> audio(encoder);
+    audio.WriteInterleaved(interleaved.data(), 100);
+    audio.WriteInterleaved(interleaved.data() + 200, size - 100);
+    audio.Flush();
+  }
+  {
+    MuxOptions options;
+    options.buffer_size = 1000;
+    options.write_coalescing = 5000;
+    Mux mux(coalesced, "wav", {params}, options);
+    Encoder encoder = mux.GetEncoder(0);
+    AudioEncoder<int16_t> audio(encoder);
+    const int16_t* channels[] = {left.data(), right.data()};
+    audio.WriteBlock(channels, size);
+    audio.Flush();
+  }
+  avcodec_parameters_free(&params);
+
+  EXPECT_GT(by_sample.str().size(), size_t(size) * 4);
+  EXPECT_EQ(by_block.str(), by_sample.str());
+  EXPECT_EQ(by_interleaved.str(), by_sample.str());
+  EXPECT_EQ(coalesced.str(), by_sample.str());
+}
+
+AVCodecParameters* MakePcmParameters(int channels) {
+  const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_PCM_S16LE);
+  AVCodecContext* ctx = avcodec_alloc_context3(codec);
+  AVCodecParameters* params = avcodec_parameters_alloc();
+  avcodec_parameters_from_context(params, ctx);
+  avcodec_free_context(&ctx);
+  params->sample_rate = 44100;
+  params->format = AVSampleFormat::AV_SAMPLE_FMT_S16;
+  av_channel_layout_default(&params->ch_layout, channels);
+  params->bits_per_coded_sample = 16;
+  params->block_align = 2 * channels;
+  return params;
+}
+
+TEST(MuxTest, AsyncWriterMatchesSync) {
+  AVCodecParameters* params = MakePcmParameters(1);
+  std::vector<int16_t> samples(44100 * 2);
+  for (size_t i = 0; i < samples.size(); ++i) {
+    samples[i] = int16_t(sin(float(i) / 44100 * 3.14 * 2 * 1000) * 20000);
+  }
+  auto write = [&](std::ostream& output, const MuxOptions& options) {
+    Mux mux(output, "wav", {params}, options);
+    Encoder encoder = mux.GetEncoder(0);
+    AudioEncoder<int16_t> audio(encoder);
+    const int16_t* channels[] = {samples.data()};
+    audio.WriteBlock(channels, samples.size());
+    audio.Flush();
+  };
+  std::ostringstream sync, async;
+  write(sync, {});
+  MuxOptions options;
+  options.async_queue = 4;
+  options.interleave = true;
+  write(async, options);
+  avcodec_parameters_free(&params);
+
+  EXPECT_GT(sync.str().size(), samples.size() * 2);
+  EXPECT_EQ(async.str(), sync.str());
+}
+
+TEST(MuxTest, AsyncWritersOnSeveralThreads) {
+  AVCodecParameters* params = MakePcmParameters(1);
+  std::vector<int16_t> samples(44100, 1000);
+  std::ostringstream output;
+  {
+    MuxOptions options;
+    options.interleave = true;
+    options.async_queue = 8;
+    Mux mux(output, "matroska", {params, params}, options);
+    Encoder first = mux.GetEncoder(0);
+    Encoder second = mux.GetEncoder(1);
+    // Both first writes race for the header.
+    auto encode = [&samples](Encoder& encoder) {
+      AudioEncoder<int16_t> audio(encoder);
+      const int16_t* channels[] = {samples.data()};
+      audio.WriteBlock(channels, samples.size());
+      audio.Flush();
+    };
+    std::thread first_thread(encode, std::ref(first));
+    std::thread second_thread(encode, std::ref(second));
+    first_thread.join();
+    second_thread.join();
+  }
+  avcodec_parameters_free(&params);
+
+  std::istringstream input(output.str());
+  Demux demux(input);
+  ASSERT_EQ(demux.StreamsCount(), 2);
+  demux.SelectStream(0);
+  demux.SelectStream(1);
+  int64_t bytes[2] = {0, 0};
+  while (auto packet = demux.read()) {
+    bytes[packet->StreamIndex()] += packet->data()->size;
+  }
+  EXPECT_EQ(bytes[0], int64_t(samples.size() * 2));
+  EXPECT_EQ(bytes[1], int64_t(samples.size() * 2));
+}
+
+class RejectingDestination : public PacketDestination {
+ public:
+  bool WriteNextPacket(Packet packet, const int stream_index) override {
+    ++packets;
+    return false;
+  }
+  int packets = 0;
+};
+
+TEST(MuxTest, EncoderReportsFailedWrites) {
+  AVCodecParameters* params = MakePcmParameters(1);
+  std::ostringstream output;
+  {
+    Mux mux(output, "wav", {params});
+    Encoder encoder = mux.GetEncoder(0);
+    Frame frame(AV_SAMPLE_FMT_S16, &params->ch_layout, 1024);
+    frame.data()->pts = 0;
+    EXPECT_TRUE(encoder.Write(frame));
+
+    RejectingDestination rejecting;
+    Encoder rejected(encoder, &rejecting);
+    frame.data()->pts = 1024;
+    EXPECT_FALSE(rejected.Write(frame));
+    EXPECT_EQ(rejecting.packets, 1);
+    EXPECT_TRUE(rejected.Flush());
+
+    Encoder rejected_audio(encoder, &rejecting);
+    AudioEncoder<int16_t> audio(rejected_audio);
+    std::vector<int16_t> samples(4096);
+    EXPECT_FALSE(audio.WriteInterleaved(samples.data(), samples.size()));
+    EXPECT_FALSE(audio.Flush());
+  }
+  avcodec_parameters_free(&params);
+  EXPECT_GT(output.str().size(), 1024 * 2);
+}
+
+TEST(MuxTest, InterleavedWriteOrdersStreamsByTime) {
+  AVCodecParameters* params = MakePcmParameters(1);
+  std::vector<int16_t> samples(44100, 1000);
+  const std::string path = "test_data/interleaved.mka";
+  {
+    std::ofstream output_file(path, std::ios::out | std::ios::trunc);
+    MuxOptions options;
+    options.interleave = true;
+    options.async_queue = 16;
+    Mux mux(output_file, "matroska", {params, params}, options);
+    Encoder first = mux.GetEncoder(0);
+    Encoder second = mux.GetEncoder(1);
+    AudioEncoder<int16_t> first_audio(first);
+    AudioEncoder<int16_t> second_audio(second);
+    const int16_t* channels[] = {samples.data()};
+    // One stream after the other, as two sequential encoders produce them.
+    first_audio.WriteBlock(channels, samples.size());
+    first_audio.Flush();
+    second_audio.WriteBlock(channels, samples.size());
+    second_audio.Flush();
+  }
+  avcodec_parameters_free(&params);
+
+  std::ifstream input_file(path);
+  Demux demux(input_file);
+  ASSERT_EQ(demux.StreamsCount(), 2);
+  demux.SelectStream(0);
+  demux.SelectStream(1);
+  Rational<int64_t> latest(0, 1);
+  int64_t packets[2] = {0, 0};
+  while (auto packet = demux.read()) {
+    const int index = packet->StreamIndex();
+    const Rational<int64_t> time =
+        Rational<int64_t>(packet->data()->dts, 1) * demux.TimeBase(index);
+    EXPECT_FALSE(time + Rational<int64_t>(1, 10) < latest)
+        << double(time) << " after " << double(latest);
+    if (latest < time) latest = time;
+    ++packets[index];
+  }
+  EXPECT_GT(packets[0], 0);
+  EXPECT_EQ(packets[0], packets[1]);
+}
+
+TEST(MuxTest, FdSinkMatchesStream) {
+  AVCodecParameters* params = MakePcmParameters(2);
+  std::vector<int16_t> samples(44100 * 2);
+  for (size_t i = 0; i < samples.size(); ++i) {
+    samples[i] = int16_t(sin(float(i) / 44100 * 3.14 * 2 * 440) * 20000);
+  }
+  auto write = [&](Mux& mux) {
+    Encoder encoder = mux.GetEncoder(0);
+    AudioEncoder<int16_t> audio(encoder);
+    audio.WriteInterleaved(samples.data(), samples.size() / 2);
+    audio.Flush();
+  };
+  std::ostringstream stream;
+  {
+    Mux mux(stream, "wav", {params});
+    write(mux);
+  }
+  const std::string path = "test_data/fd_sink.wav";
+  {
+    Mux mux(FdSink::Open(path, samples.size() * 2 + 1024, 4096), "wav",
+            {params});
+    write(mux);
+  }
+  std::ifstream file(path, std::ios::binary);
+  const std::string written((std::istreambuf_iterator<char>(file)), {});
+  EXPECT_GT(stream.str().size(), samples.size() * 2);
+  EXPECT_EQ(written, stream.str());
+
+  // A pipe cannot seek, so the muxer must not go back to the header.
+  std::ostringstream raw;
+  {
+    Mux mux(raw, "s16le", {params});
+    write(mux);
+  }
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  std::string piped;
+  std::thread reader([&] {
+    char buffer[4096];
+    ssize_t count;
+    while ((count = read(fds[0], buffer, sizeof(buffer))) > 0) {
+      piped.append(buffer, count);
+    }
+  });
+  {
+    Mux mux(std::make_unique<FdSink>(fds[1]), "s16le", {params});
+    write(mux);
+  }
+  close(fds[1]);
+  reader.join();
+  close(fds[0]);
+  avcodec_parameters_free(&params);
+  EXPECT_EQ(piped.size(), samples.size() * 2);
+  EXPECT_EQ(piped, raw.str());
+}
+
+}  // namespace potamos
@@ -0,0 +1,95 @@
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "audio.hpp"
+#include "demux.hpp"
+#include "input_source.hpp"
+
+// Measures the time from constructing a Demux to the first decoded sample and
+// the input bytes read by then, for the default open and the fast-open
+// options.
+
+namespace potamos {
+namespace {
+
+constexpr int kRepeats = 50;
+
+class CountingSource : public InputSource {
+ public:
+  CountingSource(std::istream& stream, int64_t& bytes)
+      : source_(stream), bytes_(bytes) {}
+
+  int Read(uint8_t* buf, int buf_size) override {
+    int ret = source_.Read(buf, buf_size);
+    if (ret > 0) bytes_ += ret;
+    return ret;
+  }
+  int64_t Seek(int64_t offset, int whence) override {
+    return source_.Seek(offset, whence);
+  }
+
+ private:
+  IStreamSource source_;
+  int64_t& bytes_;
+};
+
+void Benchmark(const std::string& name, const std::string& path,
+               const DemuxOptions& options) {
+  int64_t bytes = 0;
+  double open_seconds = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kRepeats; ++i) {
+    std::ifstream input(path, std::ios::binary);
+    auto open_start = std::chrono::steady_clock::now();
+    Demux demux(std::make_unique<CountingSource>(input, bytes), options);
+    std::chrono::duration<double> open =
+        std::chrono::steady_clock::now() - open_start;
+    open_seconds += open.count();
+    auto codec = demux.GetDecoder(0);
+    AudioDecoder<float> audio(codec);
+    if (!audio.Read()) std::cerr << "no samples in " << path << std::endl;
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cout << std::setw(12) << name << std::setw(12)
+            << open_seconds / kRepeats * 1e3 << std::setw(12)
+            << elapsed.count() / kRepeats * 1e3 << std::setw(12)
+            << bytes / kRepeats << std::endl;
+}
+
+}  // namespace
+}  // namespace potamos
+
+int main() {
+  using namespace potamos;
+  std::cout << std::fixed << std::setprecision(3);
+
+  for (const char* path : {"test_data/kirov.mp3", "test_data/orders.mp3"}) {
+    AVCodecParameters* parameters = avcodec_parameters_alloc();
+    {
+      std::ifstream input(path, std::ios::binary);
+      Demux demux(input);
+      avcodec_parameters_copy(parameters, demux.CodecParameters(0));
+    }
+
+    std::cout << path << std::endl;
+    std::cout << "        mode     open ms    first ms  bytes read"
+              << std::endl;
+    DemuxOptions options;
+    Benchmark("default", path, options);
+    options.probesize = 32 << 10;
+    options.analyze_duration = Rational<int64_t>(1, 10);
+    Benchmark("bounded", path, options);
+    options.format = "mp3";
+    Benchmark("format", path, options);
+    options.codec_parameters = {parameters};
+    Benchmark("cached", path, options);
+    avcodec_parameters_free(&parameters);
+  }
+  return 0;
+}
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavformat/avio.h>
+#include <libavutil/error.h>
+}
+
+namespace potamos {
+
+// Byte sink behind the Mux AVIO context. Write and Seek follow the AVIO
+// write_packet/seek callback contracts.
+class OutputSink {
+ public:
+  virtual ~OutputSink() = default;
+
+  // Returns buf_size, or a negative AVERROR if the bytes cannot be written.
+  virtual int Write(const uint8_t* buf, int buf_size) = 0;
+  // Returns the new position, or the total size for AVSEEK_SIZE; negative if
+  // unknown or on error.
+  virtual int64_t Seek(int64_t offset, int whence) = 0;
+  // Writes out whatever the sink still buffers.
+  virtual bool Flush() { return true; }
+  // Whether Seek can move the position. Muxers finish the output without
+  // going back, e.g. to patch sizes into a header, when it cannot.
+  virtual bool Seekable() const { return true; }
+};
+
+class OStreamSink : public OutputSink {
+ public:
+  // Writes are gathered until `coalescing` bytes are pending and then
+  // written to the stream at once; 0 writes every call through.
+  OStreamSink(std::ostream& stream, int64_t coalescing = 0)
+      : stream_(stream), coalescing_(coalescing) {
+    pending_.reserve(coalescing_);
+  }
+
+  int Write(const uint8_t* buf, int buf_size) override {
+    if (coalescing_ > 0) {
+      if (int64_t(pending_.size()) + buf_size > coalescing_ && !Flush()) {
+        return AVERROR_EOF;
+      }
+      if (buf_size >= coalescing_) return WriteStream(buf, buf_size);
+      pending_.insert(pending_.end(), buf, buf + buf_size);
+      return buf_size;
+    }
+    return WriteStream(buf, buf_size);
+  }
+
+  bool Flush() override {
+    if (pending_.empty()) return true;
+    const int size = pending_.size();
+    const bool ok = WriteStream(pending_.data(), size) == size;
+    pending_.clear();
+    return ok;
+  }
+
+  int64_t Seek(int64_t offset, int whence) override {
+    if (whence != AVSEEK_SIZE) Flush();
+    switch (whence) {
+      case AVSEEK_SIZE: {
+        return -1;
+      }
+      case 0: {
+        stream_.seekp(offset, std::ios_base::beg);
+        return stream_.tellp();
+      }
+      case 1: {
+        std::clog << "SEEK whence = 1: " << offset << " " << whence << " ("
+                  << AVSEEK_SIZE << " / " << AVSEEK_FORCE << " ) " << std::endl;
+        stream_.seekp(offset, std::ios_base::cur);
+        return stream_.tellp();
+      }
+      case 2: {
+        stream_.seekp(offset, std::ios_base::end);
+        return stream_.tellp();
+      }
+      default: {
+        std::clog << "SEEK whence = " << whence << ": " << offset << " "
+                  << whence << " (" << AVSEEK_SIZE << " / " << AVSEEK_FORCE
+                  << " ) " << std::endl;
+      }
+      case AVSEEK_FORCE: {
+      }
+    }
+
+    stream_.seekp(offset);
+    return stream_.tellp();
+  }
+
+ private:
+  int WriteStream(const uint8_t* buf, int buf_size) {
+    if (!stream_.write((char*)buf, buf_size)) return AVERROR_EOF;
+    return buf_size;
+  }
+
+  std::ostream& stream_;
+  int64_t coalescing_;
+  std::vector<uint8_t> pending_;
+};
+
+// Writes straight to a file descriptor, a regular file or a pipe. Bytes are
+// gathered and written in whole chunks that end on multiples of the chunk
+// size in the output, and the position is tracked here rather than asked of
+// the descriptor. Only regular files can seek.
+class FdSink : public OutputSink {
+ public:
+  static constexpr int64_t kChunkSize = 1 << 20;
+
+  // Creates or truncates `path`. A positive `expected_size` reserves that
+  // much disk space up front, see Reserve. Returns nullptr if the file
+  // cannot be opened.
+  static std::unique_ptr<FdSink> Open(const std::string& path,
+                                      int64_t expected_size = 0,
+                                      int64_t chunk_size = kChunkSize) {
+    int fd =
+        open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      std::cerr << "open(" << path << ") = " << std::strerror(errno)
+                << std::endl;
+      return nullptr;
+    }
+    std::unique_ptr<FdSink> sink(new FdSink(fd, chunk_size));
+    sink->owned_ = true;
+    if (expected_size > 0) sink->Reserve(expected_size);
+    return sink;
+  }
+
+  // Writes to `fd` from its current position. The descriptor stays open.
+  explicit FdSink(int fd, int64_t chunk_size = kChunkSize)
+      : fd_(fd), chunk_size_(chunk_size) {
+    struct stat st;
+    seekable_ = fstat(fd_, &st) == 0 && S_ISREG(st.st_mode);
+    if (seekable_) {
+      start_ = std::max<int64_t>(lseek(fd_, 0, SEEK_CUR), 0);
+      size_ = st.st_size;
+    }
+    buffer_.reserve(chunk_size_);
+  }
+
+  FdSink(const FdSink&) = delete;
+  FdSink& operator=(const FdSink&) = delete;
+  ~FdSink() override {
+    Flush();
+    // Space reserved past the end of the output is given back.
+    if (reserved_ > size_ && ftruncate(fd_, size_) < 0) {
+      std::cerr << "ftruncate = " << std::strerror(errno) << std::endl;
+    }
+    if (owned_) close(fd_);
+  }
+
+  // Allocates `bytes` of disk space for the file without changing its size,
+  // so an output of known size is laid out in one piece and cannot run out
+  // of space halfway. Returns false if the file system does not support it.
+  bool Reserve(int64_t bytes) {
+    if (!seekable_) return false;
+    if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, bytes) < 0) {
+      if (errno != EOPNOTSUPP) {
+        std::cerr << "fallocate = " << std::strerror(errno) << std::endl;
+      }
+      return false;
+    }
+    reserved_ = std::max(reserved_, bytes);
+    return true;
+  }
+
+  int Write(const uint8_t* buf, int buf_size) override {
+    if (failed_) return AVERROR(EIO);
+    const uint8_t* begin = buf;
+    // Whole chunks of a large write skip the buffer.
+    if (buffer_.empty() && start_ % chunk_size_ == 0 &&
+        buf_size >= chunk_size_) {
+      const int64_t count = buf_size / chunk_size_ * chunk_size_;
+      if (!WriteFd(buf, count)) return AVERROR(EIO);
+      begin += count;
+    }
+    buffer_.insert(buffer_.end(), begin, buf + buf_size);
+    const int64_t count = Position() / chunk_size_ * chunk_size_ - start_;
+    if (count > 0) {
+      if (!WriteFd(buffer_.data(), count)) return AVERROR(EIO);
+      buffer_.erase(buffer_.begin(), buffer_.begin() + count);
+    }
+    return buf_size;
+  }
+
+  bool Flush() override {
+    if (buffer_.empty()) return !failed_;
+    const bool ok = WriteFd(buffer_.data(), buffer_.size());
+    buffer_.clear();
+    return ok;
+  }
+
+  int64_t Seek(int64_t offset, int whence) override {
+    int64_t position;
+    switch (whence & ~AVSEEK_FORCE) {
+      case AVSEEK_SIZE:
+        if (!seekable_) return AVERROR(ESPIPE);
+        return std::max(size_, Position());
+      case SEEK_SET:
+        position = offset;
+        break;
+      case SEEK_CUR:
+        position = Position() + offset;
+        break;
+      case SEEK_END:
+        if (!seekable_) return AVERROR(ESPIPE);
+        position = std::max(size_, Position()) + offset;
+        break;
+      default:
+        return AVERROR(EINVAL);
+    }
+    if (position == Position()) return position;
+    if (!seekable_) return AVERROR(ESPIPE);
+    if (position < 0) return AVERROR(EINVAL);
+    if (!Flush()) return AVERROR(EIO);
+    if (lseek(fd_, position, SEEK_SET) < 0) {
+      std::cerr << "lseek = " << std::strerror(errno) << std::endl;
+      return AVERROR(errno);
+    }
+    start_ = position;
+    return position;
+  }
+
+  bool Seekable() const override { return seekable_; }
+
+ private:
+  int64_t Position() const { return start_ + buffer_.size(); }
+
+  // Writes all of `buf` at start_ and advances it.
+  bool WriteFd(const uint8_t* buf, int64_t count) {
+    while (count > 0) {
+      const ssize_t ret = write(fd_, buf, count);
+      if (ret < 0) {
+        if (errno == EINTR) continue;
+        std::cerr << "write = " << std::strerror(errno) << std::endl;
+        failed_ = true;
+        return false;
+      }
+      buf += ret;
+      count -= ret;
+      start_ += ret;
+    }
+    size_ = std::max(size_, start_);
+    return true;
+  }
+
+  int fd_;
+  bool owned_ = false;
+  int64_t chunk_size_;
+  bool seekable_ = false;
+  // Output position of the first buffered byte.
+  int64_t start_ = 0;
+  // Size of the file, as far as it has been written.
+  int64_t size_ = 0;
+  int64_t reserved_ = 0;
+  bool failed_ = false;
+  std::vector<uint8_t> buffer_;
+};
+
+}  // namespace potamos
@@ -0,0 +1,124 @@
+#include "output_sink.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace potamos {
+namespace {
+
+std::string ReadFile(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(file), {});
+}
+
+int64_t FileSize(const std::string& path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 ? st.st_size : -1;
+}
+
+int Write(OutputSink& sink, const std::string& bytes) {
+  return sink.Write((const uint8_t*)bytes.data(), bytes.size());
+}
+
+TEST(OutputSinkTest, FdSinkWritesWholeChunks) {
+  const std::string path = "output_sink_test.bin";
+  std::string content;
+  for (int i = 0; i < 1000; ++i) content += char('a' + i % 26);
+  {
+    auto sink = FdSink::Open(path, 0, 256);
+    ASSERT_TRUE(sink);
+    EXPECT_TRUE(sink->Seekable());
+    EXPECT_EQ(Write(*sink, content.substr(0, 100)), 100);
+    EXPECT_EQ(FileSize(path), 0);
+    EXPECT_EQ(Write(*sink, content.substr(100, 200)), 200);
+    EXPECT_EQ(FileSize(path), 256);
+    EXPECT_EQ(Write(*sink, content.substr(300, 212)), 212);
+    EXPECT_EQ(FileSize(path), 512);
+    // The whole chunk at the start of the write skips the buffer.
+    EXPECT_EQ(Write(*sink, content.substr(512, 488)), 488);
+    EXPECT_EQ(FileSize(path), 768);
+    EXPECT_EQ(sink->Seek(0, AVSEEK_SIZE), 1000);
+    EXPECT_EQ(sink->Seek(0, SEEK_CUR), 1000);
+  }
+  EXPECT_EQ(ReadFile(path), content);
+  std::remove(path.c_str());
+}
+
+TEST(OutputSinkTest, FdSinkSeeksBack) {
+  const std::string path = "output_sink_test.bin";
+  {
+    auto sink = FdSink::Open(path, 0, 4);
+    ASSERT_TRUE(sink);
+    EXPECT_EQ(Write(*sink, "0000potamos"), 11);
+    EXPECT_EQ(sink->Seek(0, SEEK_SET), 0);
+    EXPECT_EQ(Write(*sink, "size"), 4);
+    EXPECT_EQ(sink->Seek(0, AVSEEK_SIZE | AVSEEK_FORCE), 11);
+    EXPECT_EQ(sink->Seek(-1, SEEK_END), 10);
+    EXPECT_EQ(Write(*sink, "S!"), 2);
+    EXPECT_LT(sink->Seek(-1, SEEK_SET), 0);
+  }
+  EXPECT_EQ(ReadFile(path), "sizepotamoS!");
+  std::remove(path.c_str());
+}
+
+TEST(OutputSinkTest, FdSinkReservesWithoutGrowingTheFile) {
+  const std::string path = "output_sink_test.bin";
+  {
+    auto sink = FdSink::Open(path, 1 << 20);
+    ASSERT_TRUE(sink);
+    EXPECT_EQ(FileSize(path), 0);
+    EXPECT_EQ(Write(*sink, "potamos"), 7);
+  }
+  EXPECT_EQ(ReadFile(path), "potamos");
+  std::remove(path.c_str());
+}
+
+TEST(OutputSinkTest, FdSinkWritesToPipe) {
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  {
+    FdSink sink(fds[1], 4);
+    EXPECT_FALSE(sink.Seekable());
+    EXPECT_EQ(Write(sink, "potamos"), 7);
+    EXPECT_EQ(sink.Seek(0, SEEK_CUR), 7);
+    EXPECT_LT(sink.Seek(0, SEEK_SET), 0);
+    EXPECT_LT(sink.Seek(0, AVSEEK_SIZE), 0);
+  }
+  close(fds[1]);
+  char buffer[16];
+  std::string read;
+  ssize_t count;
+  while ((count = ::read(fds[0], buffer, sizeof(buffer))) > 0) {
+    read.append(buffer, count);
+  }
+  close(fds[0]);
+  EXPECT_EQ(read, "potamos");
+}
+
+TEST(OutputSinkTest, MissingDirectory) {
+  EXPECT_FALSE(FdSink::Open("test_data/does_not_exist/out.wav"));
+}
+
+TEST(OutputSinkTest, OStreamSinkCoalesces) {
+  std::ostringstream stream;
+  OStreamSink sink(stream, 8);
+  EXPECT_EQ(Write(sink, "pota"), 4);
+  EXPECT_EQ(stream.str(), "");
+  EXPECT_EQ(Write(sink, "mos"), 3);
+  EXPECT_EQ(Write(sink, "!!"), 2);
+  EXPECT_EQ(stream.str(), "potamos");
+  EXPECT_TRUE(sink.Flush());
+  EXPECT_EQ(stream.str(), "potamos!!");
+}
+
+}  // namespace
+}  // namespace potamos
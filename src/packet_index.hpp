@@ -0,0 +1,312 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+}
+
+#include "rational.hpp"
+
+namespace potamos {
+
+struct PacketIndexEntry {
+  int64_t pts;
+  int64_t dts;
+  // Byte offset of the packet in the input.
+  int64_t pos;
+  int32_t duration;
+  int32_t size;
+  int32_t flags;
+  int32_t reserved;
+};
+
+// Identifies the indexed input so a sidecar of another input, or of this one
+// rewritten with the same length, is not used: its size and an FNV-1a hash of
+// its first and last kBlock bytes.
+struct IndexedSource {
+  static constexpr int64_t kBlock = 64 << 10;
+
+  void Hash(const uint8_t* data, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      hash = (hash ^ data[i]) * 0x100000001b3;
+    }
+  }
+
+  int64_t size = -1;
+  uint64_t hash = 0xcbf29ce484222325;
+};
+
+// Packets of every stream, sorted by pts per stream, as written to a sidecar
+// file. A loaded index is memory-mapped and used in place.
+//
+// Layout: Header, one StreamHeader per stream, the entries of each stream
+// back to back, then per stream the indices of its entries sorted by byte
+// offset.
+class PacketIndex {
+ public:
+  static constexpr char kMagic[8] = {'P', 'T', 'M', 'S', 'I', 'D', 'X', '1'};
+
+  PacketIndex(PacketIndex&& index)
+      : mapping_(index.mapping_),
+        mapping_size_(index.mapping_size_),
+        bytes_(std::move(index.bytes_)),
+        streams_(index.streams_),
+        entries_(index.entries_),
+        by_position_(index.by_position_),
+        stream_count_(index.stream_count_) {
+    index.mapping_ = nullptr;
+  }
+  PacketIndex(const PacketIndex&) = delete;
+  PacketIndex& operator=(PacketIndex&& index) {
+    std::swap(mapping_, index.mapping_);
+    std::swap(mapping_size_, index.mapping_size_);
+    std::swap(bytes_, index.bytes_);
+    std::swap(streams_, index.streams_);
+    std::swap(entries_, index.entries_);
+    std::swap(by_position_, index.by_position_);
+    std::swap(stream_count_, index.stream_count_);
+    return *this;
+  }
+  ~PacketIndex() {
+    if (mapping_ != nullptr) munmap(mapping_, mapping_size_);
+  }
+
+  // Maps an index saved for `source`. Returns std::nullopt if the file is
+  // missing, malformed or for another input.
+  static std::optional<PacketIndex> Load(const std::string& path,
+                                         const IndexedSource& source) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return std::nullopt;
+    struct stat st;
+    void* mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= int64_t(sizeof(Header))) {
+      mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED) return std::nullopt;
+    PacketIndex index(mapping, st.st_size);
+    if (!index.Parse(static_cast<const uint8_t*>(mapping), st.st_size,
+                     source)) {
+      std::cerr << "ignoring stale or malformed index " << path << std::endl;
+      return std::nullopt;
+    }
+    return index;
+  }
+
+  int StreamCount() const { return stream_count_; }
+
+  const PacketIndexEntry* begin(int stream) const {
+    return entries_ + streams_[stream].first_entry;
+  }
+  const PacketIndexEntry* end(int stream) const {
+    return begin(stream) + streams_[stream].count;
+  }
+  int64_t Size(int stream) const { return streams_[stream].count; }
+  Rational<int64_t> TimeBase(int stream) const {
+    return Rational<int64_t>(streams_[stream].time_base_num,
+                             streams_[stream].time_base_den);
+  }
+
+  // Last keyframe with pts at or before `pts`, or the first entry if there
+  // is none. Returns nullptr if the stream has no packets.
+  const PacketIndexEntry* FindKeyframe(int stream, int64_t pts) const {
+    if (Size(stream) == 0) return nullptr;
+    const PacketIndexEntry* it = std::upper_bound(
+        begin(stream), end(stream), pts,
+        [](int64_t pts, const PacketIndexEntry& e) { return pts < e.pts; });
+    while (it != begin(stream)) {
+      --it;
+      if (it->flags & AV_PKT_FLAG_KEY) return it;
+    }
+    return begin(stream);
+  }
+
+  // Packet starting at byte offset `pos`, or nullptr.
+  const PacketIndexEntry* FindPosition(int stream, int64_t pos) const {
+    const int64_t* first = by_position_ + streams_[stream].first_entry;
+    const int64_t* last = first + streams_[stream].count;
+    const int64_t* it =
+        std::lower_bound(first, last, pos, [this](int64_t entry, int64_t pos) {
+          return entries_[entry].pos < pos;
+        });
+    if (it == last || entries_[*it].pos != pos) return nullptr;
+    return entries_ + *it;
+  }
+
+  // Time from the first packet's pts to the end of the last packet.
+  Rational<int64_t> Duration(int stream) const {
+    if (Size(stream) == 0) return Rational<int64_t>(0, 1);
+    const PacketIndexEntry& last = *(end(stream) - 1);
+    return Rational<int64_t>(last.pts + last.duration - begin(stream)->pts,
+                             1) *
+           TimeBase(stream);
+  }
+
+  class Builder {
+   public:
+    explicit Builder(const std::vector<Rational<int64_t>>& time_bases)
+        : time_bases_(time_bases), entries_(time_bases.size()) {}
+
+    void Add(const AVPacket* packet) {
+      if (packet->stream_index >= int(entries_.size())) return;
+      if (packet->pts == AV_NOPTS_VALUE) return;
+      entries_[packet->stream_index].push_back(
+          {packet->pts, packet->dts, packet->pos, int32_t(packet->duration),
+           packet->size, packet->flags, 0});
+    }
+
+    std::vector<uint8_t> Serialize(const IndexedSource& source) {
+      Header header;
+      std::memcpy(header.magic, kMagic, sizeof(kMagic));
+      header.version = kVersion;
+      header.stream_count = entries_.size();
+      header.source_size = source.size;
+      header.source_hash = source.hash;
+      std::vector<StreamHeader> streams(entries_.size());
+      int64_t first_entry = 0;
+      for (size_t i = 0; i < entries_.size(); ++i) {
+        std::stable_sort(entries_[i].begin(), entries_[i].end(),
+                         [](const PacketIndexEntry& a,
+                            const PacketIndexEntry& b) {
+                           return a.pts < b.pts;
+                         });
+        streams[i] = {first_entry, int64_t(entries_[i].size()),
+                      time_bases_[i].Num(), time_bases_[i].Den()};
+        first_entry += entries_[i].size();
+      }
+      std::vector<uint8_t> bytes;
+      Append(bytes, &header, sizeof(header));
+      Append(bytes, streams.data(), streams.size() * sizeof(StreamHeader));
+      for (const auto& entries : entries_) {
+        Append(bytes, entries.data(),
+               entries.size() * sizeof(PacketIndexEntry));
+      }
+      // Entries are in pts order, which differs from byte order once packets
+      // are reordered, e.g. with B-frames.
+      for (size_t i = 0; i < entries_.size(); ++i) {
+        const std::vector<PacketIndexEntry>& entries = entries_[i];
+        std::vector<int64_t> by_position(entries.size());
+        for (size_t j = 0; j < entries.size(); ++j) by_position[j] = j;
+        std::stable_sort(by_position.begin(), by_position.end(),
+                         [&entries](int64_t a, int64_t b) {
+                           return entries[a].pos < entries[b].pos;
+                         });
+        for (int64_t& entry : by_position) entry += streams[i].first_entry;
+        Append(bytes, by_position.data(), by_position.size() * sizeof(int64_t));
+      }
+      return bytes;
+    }
+
+    // Writes the sidecar and returns the index it holds.
+    std::optional<PacketIndex> Save(const std::string& path,
+                                    const IndexedSource& source) {
+      std::vector<uint8_t> bytes = Serialize(source);
+      const std::string temporary = path + ".tmp";
+      {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        file.write((const char*)bytes.data(), bytes.size());
+        if (!file) {
+          std::cerr << "cannot write index " << temporary << std::endl;
+          return std::nullopt;
+        }
+      }
+      if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::cerr << "cannot rename index to " << path << std::endl;
+        return std::nullopt;
+      }
+      PacketIndex index(std::move(bytes));
+      if (!index.Parse(index.bytes_.data(), index.bytes_.size(), source)) {
+        return std::nullopt;
+      }
+      return index;
+    }
+
+   private:
+    static void Append(std::vector<uint8_t>& bytes, const void* data,
+                       size_t size) {
+      const uint8_t* begin = static_cast<const uint8_t*>(data);
+      bytes.insert(bytes.end(), begin, begin + size);
+    }
+
+    std::vector<Rational<int64_t>> time_bases_;
+    std::vector<std::vector<PacketIndexEntry>> entries_;
+  };
+
+ private:
+  static constexpr uint32_t kVersion = 3;
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t stream_count;
+    // Identity of the indexed input, see IndexedSource.
+    int64_t source_size;
+    uint64_t source_hash;
+  };
+  struct StreamHeader {
+    int64_t first_entry;
+    int64_t count;
+    int64_t time_base_num;
+    int64_t time_base_den;
+  };
+
+  PacketIndex(void* mapping, size_t size)
+      : mapping_(mapping), mapping_size_(size) {}
+  PacketIndex(std::vector<uint8_t> bytes) : bytes_(std::move(bytes)) {}
+
+  bool Parse(const uint8_t* data, size_t size, const IndexedSource& source) {
+    if (size < sizeof(Header)) return false;
+    const Header* header = reinterpret_cast<const Header*>(data);
+    if (std::memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+        header->version != kVersion || source.size < 0 ||
+        header->source_size != source.size ||
+        header->source_hash != source.hash) {
+      return false;
+    }
+    const size_t tables = sizeof(Header) +
+                          size_t(header->stream_count) * sizeof(StreamHeader);
+    if (size < tables) return false;
+    streams_ = reinterpret_cast<const StreamHeader*>(data + sizeof(Header));
+    entries_ = reinterpret_cast<const PacketIndexEntry*>(data + tables);
+    int64_t count = 0;
+    for (uint32_t i = 0; i < header->stream_count; ++i) {
+      if (streams_[i].first_entry != count || streams_[i].count < 0 ||
+          streams_[i].time_base_den <= 0) {
+        return false;
+      }
+      count += streams_[i].count;
+    }
+    const size_t positions = tables + count * sizeof(PacketIndexEntry);
+    if (size != positions + count * sizeof(int64_t)) return false;
+    by_position_ = reinterpret_cast<const int64_t*>(data + positions);
+    stream_count_ = header->stream_count;
+    return true;
+  }
+
+  void* mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+  std::vector<uint8_t> bytes_;
+  const StreamHeader* streams_ = nullptr;
+  const PacketIndexEntry* entries_ = nullptr;
+  // Indices into entries_, per stream in the same ranges, sorted by pos.
+  const int64_t* by_position_ = nullptr;
+  int stream_count_ = 0;
+};
+
+}  // namespace potamos
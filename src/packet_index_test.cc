@@ -0,0 +1,99 @@
+#include "packet_index.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace potamos {
+namespace {
+
+AVPacket MakePacket(int stream, int64_t pts, int64_t pos, bool key) {
+  AVPacket packet = {};
+  packet.stream_index = stream;
+  packet.pts = pts;
+  packet.dts = pts;
+  packet.pos = pos;
+  packet.duration = 10;
+  packet.size = 100;
+  packet.flags = key ? AV_PKT_FLAG_KEY : 0;
+  return packet;
+}
+
+TEST(PacketIndexTest, SaveLoadAndFind) {
+  const std::string path = "packet_index_test.idx";
+  PacketIndex::Builder builder(
+      {Rational<int64_t>(1, 1000), Rational<int64_t>(1, 90000)});
+  for (int i = 0; i < 100; ++i) {
+    AVPacket audio = MakePacket(0, i * 10, i * 200, true);
+    AVPacket video = MakePacket(1, i * 10, i * 200 + 100, i % 10 == 0);
+    builder.Add(&audio);
+    builder.Add(&video);
+  }
+  ASSERT_TRUE(builder.Save(path, {20000, 1}));
+
+  EXPECT_FALSE(PacketIndex::Load(path, {20001, 1}));
+  // Same length, other bytes.
+  EXPECT_FALSE(PacketIndex::Load(path, {20000, 2}));
+  auto index = PacketIndex::Load(path, {20000, 1});
+  ASSERT_TRUE(index);
+  ASSERT_EQ(index->StreamCount(), 2);
+  EXPECT_EQ(index->Size(0), 100);
+  EXPECT_EQ(index->TimeBase(1), Rational<int64_t>(1, 90000));
+  EXPECT_EQ(index->Duration(0), Rational<int64_t>(1, 1));
+
+  EXPECT_EQ(index->FindKeyframe(0, 455)->pts, 450);
+  EXPECT_EQ(index->FindKeyframe(0, -5)->pts, 0);
+  EXPECT_EQ(index->FindKeyframe(1, 455)->pts, 400);
+  EXPECT_EQ(index->FindKeyframe(1, 455)->pos, 8100);
+  EXPECT_EQ(index->FindPosition(0, 400)->pts, 20);
+  EXPECT_EQ(index->FindPosition(0, 401), nullptr);
+
+  std::remove(path.c_str());
+}
+
+TEST(PacketIndexTest, FindPositionWithReorderedPackets) {
+  const std::string path = "packet_index_test_reordered.idx";
+  PacketIndex::Builder builder(
+      std::vector<Rational<int64_t>>{Rational<int64_t>(1, 90000)});
+  // Decode order I P B B, as stored with B-frames: pts 0 30 10 20.
+  const int64_t pts[] = {0, 30, 10, 20};
+  for (int gop = 0; gop < 25; ++gop) {
+    for (int i = 0; i < 4; ++i) {
+      AVPacket packet =
+          MakePacket(0, gop * 40 + pts[i], (gop * 4 + i) * 100, i == 0);
+      builder.Add(&packet);
+    }
+  }
+  ASSERT_TRUE(builder.Save(path, {10000, 1}));
+  auto index = PacketIndex::Load(path, {10000, 1});
+  ASSERT_TRUE(index);
+
+  for (int gop = 0; gop < 25; ++gop) {
+    for (int i = 0; i < 4; ++i) {
+      const PacketIndexEntry* entry =
+          index->FindPosition(0, (gop * 4 + i) * 100);
+      ASSERT_NE(entry, nullptr) << gop << " " << i;
+      EXPECT_EQ(entry->pts, gop * 40 + pts[i]);
+    }
+  }
+  EXPECT_EQ(index->FindPosition(0, 150), nullptr);
+  EXPECT_EQ(index->FindPosition(0, 10000), nullptr);
+  EXPECT_EQ(index->FindKeyframe(0, 75)->pts, 40);
+
+  std::remove(path.c_str());
+}
+
+TEST(PacketIndexTest, RejectsMalformedFile) {
+  const std::string path = "packet_index_test_bad.idx";
+  std::ofstream(path, std::ios::binary) << "PTMSIDX1 but not really an index";
+  EXPECT_FALSE(PacketIndex::Load(path, {}));
+  EXPECT_FALSE(PacketIndex::Load("does_not_exist.idx", {}));
+  std::remove(path.c_str());
+}
+
+}  // namespace
+}  // namespace potamos
@@ -0,0 +1,246 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <optional>
+#include <utility>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include "stream_data.hpp"
+
+namespace potamos {
+
+// What a PacketQueue does with a packet that would exceed its limits.
+enum class QueuePolicy {
+  // Limits are ignored and the queue grows.
+  kGrow,
+  // The reader waits until the stream's consumer catches up. Only useful
+  // when that consumer runs on another thread, e.g. a decoder that decodes
+  // ahead; otherwise the read fails as with kFail.
+  kBlock,
+  // The oldest queued packets are dropped to make room.
+  kDrop,
+  // The packet is dropped and the read that produced it fails, see
+  // Demux::Failed.
+  kFail,
+  // The packet is written to a temporary file and read back in order.
+  kSpill,
+};
+
+struct QueueLimits {
+  // 0 means unlimited.
+  int64_t max_packets = 0;
+  int64_t max_bytes = 0;
+  QueuePolicy policy = QueuePolicy::kGrow;
+};
+
+struct QueueStats {
+  // Packets waiting, in memory and spilled.
+  int64_t packets = 0;
+  // Payload bytes held in memory.
+  int64_t bytes = 0;
+  int64_t spilled_packets = 0;
+  int64_t spilled_bytes = 0;
+  // Highest number of packets and bytes held in memory at once.
+  int64_t peak_packets = 0;
+  int64_t peak_bytes = 0;
+  int64_t dropped = 0;
+};
+
+// FIFO of packets for one stream with byte and packet limits.
+class PacketQueue {
+ public:
+  PacketQueue(const QueueLimits& limits = {}) : limits_(limits) {}
+  PacketQueue(const PacketQueue&) = delete;
+  PacketQueue(PacketQueue&& q)
+      : limits_(q.limits_),
+        packets_(std::move(q.packets_)),
+        stats_(q.stats_),
+        spill_(q.spill_),
+        spill_read_(q.spill_read_),
+        spill_write_(q.spill_write_) {
+    q.spill_ = nullptr;
+  }
+  ~PacketQueue() {
+    if (spill_ != nullptr) std::fclose(spill_);
+  }
+
+  void SetLimits(const QueueLimits& limits) { limits_ = limits; }
+  const QueueLimits& Limits() const { return limits_; }
+
+  bool Empty() const { return stats_.packets == 0; }
+
+  // Whether a packet of `size` bytes would exceed the limits. An empty queue
+  // always has room for one packet.
+  bool Full(int64_t size) const {
+    if (packets_.empty()) return false;
+    return (limits_.max_packets > 0 &&
+            int64_t(packets_.size()) + 1 > limits_.max_packets) ||
+           (limits_.max_bytes > 0 && stats_.bytes + size > limits_.max_bytes);
+  }
+
+  // Returns false if the packet was rejected, which only happens under
+  // kBlock and kFail or when spilling fails.
+  bool Push(Packet&& packet) {
+    const int64_t size = packet.data()->size;
+    if (stats_.spilled_packets > 0) return Spill(packet);
+    if (Full(size)) {
+      switch (limits_.policy) {
+        case QueuePolicy::kGrow:
+          break;
+        case QueuePolicy::kDrop:
+          while (Full(size)) {
+            stats_.bytes -= packets_.front().data()->size;
+            packets_.pop_front();
+            --stats_.packets;
+            ++stats_.dropped;
+          }
+          break;
+        case QueuePolicy::kSpill:
+          return Spill(packet);
+        case QueuePolicy::kBlock:
+        case QueuePolicy::kFail:
+          return false;
+      }
+    }
+    packets_.push_back(std::move(packet));
+    stats_.bytes += size;
+    ++stats_.packets;
+    UpdatePeaks();
+    return true;
+  }
+
+  std::optional<Packet> Pop() {
+    if (!packets_.empty()) {
+      Packet packet = std::move(packets_.front());
+      packets_.pop_front();
+      stats_.bytes -= packet.data()->size;
+      --stats_.packets;
+      return packet;
+    }
+    if (stats_.spilled_packets > 0) return Unspill();
+    return std::nullopt;
+  }
+
+  // Drops every queued packet, e.g. after a seek.
+  void Clear() {
+    packets_.clear();
+    if (spill_ != nullptr) {
+      std::fclose(spill_);
+      spill_ = nullptr;
+    }
+    spill_read_ = spill_write_ = 0;
+    stats_.packets = stats_.bytes = 0;
+    stats_.spilled_packets = stats_.spilled_bytes = 0;
+  }
+
+  // Counts a packet that was dropped before reaching the queue.
+  void CountDropped() { ++stats_.dropped; }
+
+  QueueStats Stats() const { return stats_; }
+
+ private:
+  struct SpillHeader {
+    int64_t pts, dts, duration, pos;
+    int32_t size, flags, stream_index, side_data_elems;
+  };
+  struct SpillSideData {
+    int64_t size;
+    int32_t type;
+  };
+
+  bool Spill(const Packet& packet) {
+    if (spill_ == nullptr) {
+      spill_ = std::tmpfile();
+      if (spill_ == nullptr) {
+        std::cerr << "tmpfile failed, cannot spill packets" << std::endl;
+        return false;
+      }
+    }
+    const AVPacket* p = packet.data();
+    const SpillHeader header = {
+        p->pts,  p->dts,   p->duration,     p->pos,
+        p->size, p->flags, p->stream_index, p->side_data_elems};
+    std::fseek(spill_, spill_write_, SEEK_SET);
+    bool ok = std::fwrite(&header, sizeof(header), 1, spill_) == 1 &&
+              std::fwrite(p->data, 1, p->size, spill_) == size_t(p->size);
+    for (int i = 0; ok && i < p->side_data_elems; ++i) {
+      const AVPacketSideData& side_data = p->side_data[i];
+      SpillSideData side_header = {int64_t(side_data.size),
+                                   int32_t(side_data.type)};
+      ok = std::fwrite(&side_header, sizeof(side_header), 1, spill_) == 1 &&
+           std::fwrite(side_data.data, 1, side_data.size, spill_) ==
+               side_data.size;
+    }
+    if (!ok) {
+      std::cerr << "writing to the packet spill file failed" << std::endl;
+      return false;
+    }
+    spill_write_ = std::ftell(spill_);
+    ++stats_.packets;
+    ++stats_.spilled_packets;
+    stats_.spilled_bytes += p->size;
+    UpdatePeaks();
+    return true;
+  }
+
+  std::optional<Packet> Unspill() {
+    std::fseek(spill_, spill_read_, SEEK_SET);
+    SpillHeader header;
+    Packet packet;
+    AVPacket* p = packet.data();
+    bool ok = std::fread(&header, sizeof(header), 1, spill_) == 1 &&
+              av_new_packet(p, header.size) >= 0 &&
+              std::fread(p->data, 1, header.size, spill_) ==
+                  size_t(header.size);
+    for (int i = 0; ok && i < header.side_data_elems; ++i) {
+      SpillSideData side_header;
+      ok = std::fread(&side_header, sizeof(side_header), 1, spill_) == 1;
+      uint8_t* data =
+          ok ? av_packet_new_side_data(
+                   p, AVPacketSideDataType(side_header.type), side_header.size)
+             : nullptr;
+      ok = data != nullptr &&
+           std::fread(data, 1, side_header.size, spill_) ==
+               size_t(side_header.size);
+    }
+    if (!ok) {
+      std::cerr << "reading from the packet spill file failed" << std::endl;
+      return std::nullopt;
+    }
+    p->pts = header.pts;
+    p->dts = header.dts;
+    p->duration = header.duration;
+    p->pos = header.pos;
+    p->flags = header.flags;
+    p->stream_index = header.stream_index;
+
+    spill_read_ = std::ftell(spill_);
+    --stats_.packets;
+    --stats_.spilled_packets;
+    stats_.spilled_bytes -= header.size;
+    if (stats_.spilled_packets == 0) spill_read_ = spill_write_ = 0;
+    return packet;
+  }
+
+  void UpdatePeaks() {
+    stats_.peak_packets = std::max(stats_.peak_packets,
+                                   stats_.packets - stats_.spilled_packets);
+    stats_.peak_bytes = std::max(stats_.peak_bytes, stats_.bytes);
+  }
+
+  QueueLimits limits_;
+  std::deque<Packet> packets_;
+  QueueStats stats_;
+  std::FILE* spill_ = nullptr;
+  long spill_read_ = 0;
+  long spill_write_ = 0;
+};
+
+}  // namespace potamos
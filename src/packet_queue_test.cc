@@ -0,0 +1,80 @@
+#include "packet_queue.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cstring>
+
+namespace potamos {
+namespace {
+
+Packet MakePacket(int64_t pts, int size) {
+  Packet packet;
+  av_new_packet(packet.data(), size);
+  std::memset(packet.data()->data, int(pts), size);
+  packet.data()->pts = pts;
+  packet.data()->dts = pts;
+  return packet;
+}
+
+TEST(PacketQueueTest, GrowIgnoresLimits) {
+  PacketQueue queue({2, 0, QueuePolicy::kGrow});
+  for (int i = 0; i < 5; ++i) EXPECT_TRUE(queue.Push(MakePacket(i, 10)));
+  EXPECT_EQ(queue.Stats().packets, 5);
+  EXPECT_EQ(queue.Stats().bytes, 50);
+  EXPECT_EQ(queue.Stats().peak_packets, 5);
+  for (int i = 0; i < 5; ++i) EXPECT_EQ(queue.Pop()->data()->pts, i);
+  EXPECT_FALSE(queue.Pop());
+  EXPECT_EQ(queue.Stats().bytes, 0);
+}
+
+TEST(PacketQueueTest, DropAndFail) {
+  PacketQueue drop({0, 25, QueuePolicy::kDrop});
+  for (int i = 0; i < 5; ++i) EXPECT_TRUE(drop.Push(MakePacket(i, 10)));
+  EXPECT_EQ(drop.Stats().packets, 2);
+  EXPECT_EQ(drop.Stats().dropped, 3);
+  EXPECT_EQ(drop.Pop()->data()->pts, 3);
+  EXPECT_EQ(drop.Pop()->data()->pts, 4);
+
+  PacketQueue fail({2, 0, QueuePolicy::kFail});
+  EXPECT_TRUE(fail.Push(MakePacket(0, 10)));
+  EXPECT_TRUE(fail.Push(MakePacket(1, 10)));
+  EXPECT_TRUE(fail.Full(10));
+  EXPECT_FALSE(fail.Push(MakePacket(2, 10)));
+  EXPECT_EQ(fail.Stats().packets, 2);
+}
+
+TEST(PacketQueueTest, SpillKeepsOrderAndContent) {
+  PacketQueue queue({3, 0, QueuePolicy::kSpill});
+  for (int i = 0; i < 10; ++i) {
+    Packet packet = MakePacket(i, 100 + i);
+    uint8_t* side_data = av_packet_new_side_data(
+        packet.data(), AV_PKT_DATA_SKIP_SAMPLES, 10);
+    side_data[0] = i;
+    ASSERT_TRUE(queue.Push(std::move(packet)));
+  }
+  EXPECT_EQ(queue.Stats().packets, 10);
+  EXPECT_EQ(queue.Stats().spilled_packets, 7);
+  EXPECT_EQ(queue.Stats().peak_packets, 3);
+
+  for (int i = 0; i < 10; ++i) {
+    auto packet = queue.Pop();
+    ASSERT_TRUE(packet);
+    EXPECT_EQ(packet->data()->pts, i);
+    ASSERT_EQ(packet->data()->size, 100 + i);
+    EXPECT_EQ(packet->data()->data[99], i);
+    size_t size = 0;
+    uint8_t* side_data = av_packet_get_side_data(
+        packet->data(), AV_PKT_DATA_SKIP_SAMPLES, &size);
+    ASSERT_EQ(size, 10);
+    EXPECT_EQ(side_data[0], i);
+    if (i == 4) {
+      ASSERT_TRUE(queue.Push(MakePacket(10, 10)));
+    }
+  }
+  EXPECT_EQ(queue.Pop()->data()->pts, 10);
+  EXPECT_TRUE(queue.Empty());
+}
+
+}  // namespace
+}  // namespace potamos
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <numeric>
 
 extern "C" {
@@ -8,35 +9,68 @@ extern "C" {
 
 namespace potamos {
 
+namespace internal {
+
+// Integer type that holds the product of two Ts, so the operators below can
+// multiply before reducing without overflowing.
+template <typename T>
+struct Wider {
+  using Type = T;
+};
+template <>
+struct Wider<int32_t> {
+  using Type = int64_t;
+};
+#ifdef __SIZEOF_INT128__
+template <>
+struct Wider<int64_t> {
+  using Type = __int128;
+};
+#endif
+
+template <typename W>
+W Gcd(W a, W b) {
+  if (a < 0) a = -a;
+  if (b < 0) b = -b;
+  while (b != 0) {
+    W t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+}  // namespace internal
+
 template <typename T>
 class Rational {
  public:
   Rational(T num, T den)
-      : num_(num / std::gcd(num, den)), den_(den / std::gcd(num, den)) {}
+      : num_(num / std::gcd(num, den)), den_(den / std::gcd(num, den)) {
+    if (den_ < 0) {
+      num_ = -num_;
+      den_ = -den_;
+    }
+  }
   Rational(const AVRational& rational) : Rational(rational.num, rational.den) {}
   Rational operator+(Rational b) const {
     const Rational& a = *this;
-    auto den = std::lcm(a.den_, b.den_);
-    return Rational(a.num_ * (den / a.den_) + b.num_ * (den / b.den_), den);
-  }
-  Rational& operator+=(Rational b) {
-    const Rational& a = *this;
-    auto den = std::lcm(a.den_, b.den_);
-    return *this =
-               Rational(a.num_ * (den / a.den_) + b.num_ * (den / b.den_), den);
+    return Reduce(Wide(a.num_) * b.den_ + Wide(b.num_) * a.den_,
+                  Wide(a.den_) * b.den_);
   }
+  Rational& operator+=(Rational b) { return *this = *this + b; }
   Rational operator-(Rational b) const {
     const Rational& a = *this;
-    auto den = std::lcm(a.den_, b.den_);
-    return Rational(a.num_ * (den / a.den_) - b.num_ * (den / b.den_), den);
+    return Reduce(Wide(a.num_) * b.den_ - Wide(b.num_) * a.den_,
+                  Wide(a.den_) * b.den_);
   }
   Rational operator*(Rational b) const {
     const Rational& a = *this;
-    return Rational(a.num_ * b.num_, a.den_ * b.den_);
+    return Reduce(Wide(a.num_) * b.num_, Wide(a.den_) * b.den_);
   }
   Rational operator/(Rational b) const {
     const Rational& a = *this;
-    return Rational(a.num_ * b.den_, a.den_ * b.num_);
+    return Reduce(Wide(a.num_) * b.den_, Wide(a.den_) * b.num_);
   }
 
   Rational& operator=(Rational b) {
@@ -49,6 +83,10 @@ class Rational {
     const Rational& a = *this;
     return a.den_ == b.den_ && a.num_ == b.num_;
   }
+  bool operator<(Rational b) const {
+    const Rational& a = *this;
+    return Wide(a.num_) * b.den_ < Wide(b.num_) * a.den_;
+  }
 
   template <typename OutputType>
   operator OutputType() const {
@@ -59,8 +97,22 @@ class Rational {
   T Den() const { return den_; }
 
  private:
+  using Wide = typename internal::Wider<T>::Type;
+
+  // Reduces the fraction in the wide type, so results that fit in T are
+  // exact even when the intermediate products do not.
+  static Rational Reduce(Wide num, Wide den) {
+    Wide gcd = internal::Gcd(num, den);
+    if (gcd == 0) gcd = 1;
+    if (den < 0) gcd = -gcd;
+    Rational result(0, 1);
+    result.num_ = T(num / gcd);
+    result.den_ = T(den / gcd);
+    return result;
+  }
+
   T num_;
   T den_;
 };
 
-}  // namespace potamos
\ No newline at end of file
+}  // namespace potamos
@@ -47,4 +47,37 @@ TEST(RationalTest, Div) {
   EXPECT_EQ(a / b, Rational(4, 3));
 }
 
+TEST(RationalTest, NegativeDenominator) {
+  Rational<int> a(1, -2);
+  EXPECT_EQ(a, Rational(-1, 2));
+  EXPECT_EQ(Rational<int>(1, 3) / Rational<int>(-1, 2), Rational(-2, 3));
+}
+
+TEST(RationalTest, NoOverflowInIntermediates) {
+  // Both products overflow int64_t, the reduced result does not.
+  Rational<int64_t> a(int64_t(1) << 40, 3486784401);
+  Rational<int64_t> b(3486784401, int64_t(1) << 41);
+  EXPECT_EQ(a * b, Rational<int64_t>(1, 2));
+  EXPECT_EQ(a / Rational<int64_t>(int64_t(1) << 41, 3486784401),
+            Rational<int64_t>(1, 2));
+
+  Rational<int64_t> c(1, int64_t(3) << 40);
+  Rational<int64_t> d(1, int64_t(5) << 40);
+  EXPECT_EQ(c + d, Rational<int64_t>(8, int64_t(15) << 40));
+  EXPECT_EQ(c - d, Rational<int64_t>(2, int64_t(15) << 40));
+
+  Rational<int> e(1 << 20, 19683);
+  Rational<int> f(19683, 1 << 21);
+  EXPECT_EQ(e * f, Rational(1, 2));
+}
+
+TEST(RationalTest, Less) {
+  EXPECT_TRUE(Rational<int>(1, 3) < Rational<int>(1, 2));
+  EXPECT_FALSE(Rational<int>(1, 2) < Rational<int>(1, 3));
+  EXPECT_FALSE(Rational<int>(1, 2) < Rational<int>(2, 4));
+  EXPECT_TRUE(Rational<int>(-1, 2) < Rational<int>(1, -3));
+  EXPECT_TRUE(Rational<int64_t>(INT64_MAX - 1, INT64_MAX) <
+              Rational<int64_t>(1, 1));
+}
+
 }  // namespace potamos
\ No newline at end of file
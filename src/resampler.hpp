@@ -0,0 +1,196 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <numeric>
+#include <optional>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+#include <libswresample/swresample.h>
+}
+
+#include "encoder.hpp"
+#include "rational.hpp"
+#include "stream_data.hpp"
+
+namespace potamos {
+
+// Converts decoded audio frames to another sample rate, channel layout and
+// sample format with libswresample. Each written frame is converted whole;
+// the samples swresample holds back for its filter come out with later frames
+// or from Flush.
+//
+// Output frames are stamped in TimeBase(), which is fine enough for the time
+// of every output sample to be exact.
+class AudioResampler {
+ public:
+  AudioResampler(int sample_rate, const AVChannelLayout& ch_layout,
+                 AVSampleFormat format)
+      : sample_rate_(sample_rate), format_(format) {
+    av_channel_layout_copy(&ch_layout_, &ch_layout);
+  }
+  // Converts to what the encoder takes.
+  explicit AudioResampler(const Encoder& encoder)
+      : AudioResampler(encoder.data()->sample_rate, encoder.data()->ch_layout,
+                       encoder.data()->sample_fmt) {}
+
+  AudioResampler(const AudioResampler&) = delete;
+  AudioResampler& operator=(const AudioResampler&) = delete;
+
+  ~AudioResampler() {
+    swr_free(&swr_);
+    av_channel_layout_uninit(&ch_layout_);
+    av_channel_layout_uninit(&in_layout_);
+  }
+
+  // Converts a frame whose pts is in `time_base`. Frames are taken to follow
+  // each other without gaps; call Reset after a seek. When the input format
+  // changes, the samples still buffered for the old one are drained first.
+  bool Write(const Frame& frame, Rational<int64_t> time_base) {
+    const AVFrame* in = frame.data();
+    if (in->flags & AV_FRAME_FLAG_DISCARD) return true;
+    int64_t skip = skip_;
+    int64_t size = in->nb_samples;
+    const AVFrameSideData* sd =
+        av_frame_get_side_data(in, AV_FRAME_DATA_SKIP_SAMPLES);
+    if (sd) {
+      const uint32_t* skip_samples = (const uint32_t*)sd->data;
+      skip += skip_samples[0];
+      size -= skip_samples[1];
+    }
+    skip_ = std::max<int64_t>(skip - size, 0);
+    if (skip >= size) return true;
+
+    if (!Configure(in)) return false;
+    if (!start_) {
+      const int64_t pts = in->pts != AV_NOPTS_VALUE ? in->pts : 0;
+      start_ = Rational<int64_t>(pts, 1) * time_base +
+               Rational<int64_t>(skip, in->sample_rate);
+      time_base_ =
+          Rational<int64_t>(1, std::lcm<int64_t>(sample_rate_, start_->Den()));
+    }
+
+    const AVSampleFormat format = (AVSampleFormat)in->format;
+    const int channels = in->ch_layout.nb_channels;
+    const int64_t bytes = av_get_bytes_per_sample(format);
+    if (av_sample_fmt_is_planar(format)) {
+      in_planes_.resize(channels);
+      for (int i = 0; i < channels; ++i) {
+        in_planes_[i] = in->extended_data[i] + skip * bytes;
+      }
+    } else {
+      in_planes_.assign(1, in->data[0] + skip * bytes * channels);
+    }
+    return Convert(in_planes_.data(), size - skip);
+  }
+
+  // Next converted frame, or std::nullopt if none is ready.
+  std::optional<Frame> Read() {
+    if (frames_.empty()) return std::nullopt;
+    Frame frame = std::move(frames_.front());
+    frames_.pop_front();
+    return frame;
+  }
+
+  // Converts the samples swresample still holds back, at the end of the
+  // stream.
+  bool Flush() {
+    if (swr_ == nullptr) return true;
+    int64_t before;
+    do {
+      before = samples_;
+      if (!Convert(nullptr, 0)) return false;
+    } while (samples_ != before);
+    return true;
+  }
+
+  // Drops buffered samples and frames. The next written frame starts a new
+  // timeline, e.g. after a seek.
+  void Reset() {
+    swr_free(&swr_);
+    frames_.clear();
+    start_ = std::nullopt;
+    samples_ = 0;
+    skip_ = 0;
+  }
+
+  Rational<int64_t> TimeBase() const { return time_base_; }
+  int SampleRate() const { return sample_rate_; }
+
+ private:
+  // Sets swresample up for the format of `frame`, draining the previous
+  // conversion if it differs.
+  bool Configure(const AVFrame* frame) {
+    if (swr_ != nullptr && frame->format == in_format_ &&
+        frame->sample_rate == in_rate_ &&
+        av_channel_layout_compare(&frame->ch_layout, &in_layout_) == 0) {
+      return true;
+    }
+    if (!Flush()) return false;
+    swr_free(&swr_);
+    in_format_ = frame->format;
+    in_rate_ = frame->sample_rate;
+    av_channel_layout_uninit(&in_layout_);
+    av_channel_layout_copy(&in_layout_, &frame->ch_layout);
+    int ret = swr_alloc_set_opts2(&swr_, &ch_layout_, format_, sample_rate_,
+                                  &in_layout_, (AVSampleFormat)in_format_,
+                                  in_rate_, 0, nullptr);
+    if (ret >= 0) ret = swr_init(swr_);
+    if (ret < 0) {
+      std::cerr << "swresample setup failed = " << ret << std::endl;
+      swr_free(&swr_);
+      return false;
+    }
+    return true;
+  }
+
+  // Converts `count` input samples, or drains when `in` is null, and queues
+  // whatever comes out as one frame.
+  bool Convert(const uint8_t* const* in, int64_t count) {
+    const int capacity = swr_get_out_samples(swr_, count);
+    if (capacity <= 0) return capacity == 0;
+    Frame frame(format_, &ch_layout_, capacity);
+    AVFrame* out = frame.data();
+    int ret = swr_convert(swr_, out->extended_data, capacity, in, count);
+    if (ret < 0) {
+      std::cerr << "swr_convert = " << ret << std::endl;
+      return false;
+    }
+    if (ret == 0) return true;
+    out->nb_samples = ret;
+    out->sample_rate = sample_rate_;
+    out->pts = ((*start_ + Rational<int64_t>(samples_, sample_rate_)) /
+                time_base_)
+                   .Num();
+    samples_ += ret;
+    frames_.push_back(std::move(frame));
+    return true;
+  }
+
+  int sample_rate_;
+  AVChannelLayout ch_layout_ = {};
+  AVSampleFormat format_;
+
+  SwrContext* swr_ = nullptr;
+  int in_format_ = -1;
+  int in_rate_ = 0;
+  AVChannelLayout in_layout_ = {};
+  std::vector<const uint8_t*> in_planes_;
+
+  // Time of the first output sample.
+  std::optional<Rational<int64_t>> start_;
+  Rational<int64_t> time_base_ = Rational<int64_t>(1, 1);
+  // Output samples since start_.
+  int64_t samples_ = 0;
+  // Start padding still to skip in following frames.
+  int64_t skip_ = 0;
+  std::deque<Frame> frames_;
+};
+
+}  // namespace potamos
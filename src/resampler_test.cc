@@ -0,0 +1,162 @@
+#include "resampler.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <fstream>
+#include <vector>
+
+#include "audio.hpp"
+#include "demux.hpp"
+#include "mux.hpp"
+
+namespace potamos {
+namespace {
+
+// Frame of a 1 kHz sine in packed s16 mono.
+Frame MakeSine(int sample_rate, int64_t first_sample, int size) {
+  AVChannelLayout mono;
+  av_channel_layout_default(&mono, 1);
+  Frame frame(AV_SAMPLE_FMT_S16, &mono, size);
+  frame.data()->sample_rate = sample_rate;
+  frame.data()->pts = first_sample;
+  int16_t* samples = (int16_t*)frame.data()->data[0];
+  for (int i = 0; i < size; ++i) {
+    samples[i] = int16_t(
+        std::sin((first_sample + i) * 2 * M_PI * 1000 / sample_rate) * 16384);
+  }
+  return frame;
+}
+
+TEST(AudioResamplerTest, ConvertsRateLayoutAndFormat) {
+  AVChannelLayout stereo;
+  av_channel_layout_default(&stereo, 2);
+  AudioResampler resampler(48000, stereo, AV_SAMPLE_FMT_FLTP);
+
+  const int frame_size = 1000;
+  const int frames = 44;
+  int64_t samples = 0;
+  Rational<int64_t> next_time(0, 1);
+  auto check = [&](const Frame& frame) {
+    const AVFrame* out = frame.data();
+    EXPECT_EQ(out->format, AV_SAMPLE_FMT_FLTP);
+    EXPECT_EQ(out->ch_layout.nb_channels, 2);
+    EXPECT_EQ(out->sample_rate, 48000);
+    EXPECT_EQ(Rational<int64_t>(out->pts, 1) * resampler.TimeBase(),
+              next_time);
+    next_time = next_time + Rational<int64_t>(out->nb_samples, 48000);
+    const float* left = (const float*)out->extended_data[0];
+    const float* right = (const float*)out->extended_data[1];
+    for (int i = 0; i < out->nb_samples; ++i) {
+      ASSERT_EQ(left[i], right[i]);
+      ASSERT_LE(std::abs(left[i]), 0.51f);
+    }
+    samples += out->nb_samples;
+  };
+
+  for (int i = 0; i < frames; ++i) {
+    ASSERT_TRUE(resampler.Write(MakeSine(44100, i * frame_size, frame_size),
+                                Rational<int64_t>(1, 44100)));
+    while (auto frame = resampler.Read()) check(*frame);
+  }
+  ASSERT_TRUE(resampler.Flush());
+  while (auto frame = resampler.Read()) check(*frame);
+
+  const double expected = frames * frame_size * 48000.0 / 44100;
+  EXPECT_NEAR(samples, expected, 1);
+}
+
+TEST(AudioResamplerTest, KeepsStartTimeExact) {
+  AVChannelLayout mono;
+  av_channel_layout_default(&mono, 1);
+  AudioResampler resampler(48000, mono, AV_SAMPLE_FMT_S16);
+  // Starts one 44.1 kHz sample after 1 s, which is not on the 48 kHz grid.
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_TRUE(resampler.Write(MakeSine(44100, 44101 + i * 1024, 1024),
+                                Rational<int64_t>(1, 44100)));
+  }
+  ASSERT_TRUE(resampler.Flush());
+  auto frame = resampler.Read();
+  ASSERT_TRUE(frame);
+  EXPECT_EQ(Rational<int64_t>(frame->data()->pts, 1) * resampler.TimeBase(),
+            Rational<int64_t>(44101, 44100));
+}
+
+TEST(AudioResamplerTest, InputFormatChangeContinuesTimeline) {
+  AVChannelLayout mono;
+  av_channel_layout_default(&mono, 1);
+  AudioResampler resampler(48000, mono, AV_SAMPLE_FMT_S16);
+  int64_t samples = 0;
+  ASSERT_TRUE(resampler.Write(MakeSine(44100, 0, 44100),
+                              Rational<int64_t>(1, 44100)));
+  ASSERT_TRUE(resampler.Write(MakeSine(22050, 22050, 22050),
+                              Rational<int64_t>(1, 22050)));
+  ASSERT_TRUE(resampler.Flush());
+  Rational<int64_t> next_time(0, 1);
+  while (auto frame = resampler.Read()) {
+    EXPECT_EQ(Rational<int64_t>(frame->data()->pts, 1) * resampler.TimeBase(),
+              next_time);
+    next_time =
+        next_time + Rational<int64_t>(frame->data()->nb_samples, 48000);
+    samples += frame->data()->nb_samples;
+  }
+  EXPECT_NEAR(samples, 2 * 48000, 2);
+}
+
+TEST(AudioResamplerTest, DecodeResampleEncode) {
+  std::ifstream input_file("test_data/kirov.mp3");
+  Demux demux(input_file);
+  auto decoder = demux.GetDecoder(0);
+  int64_t input_samples = 0;
+  {
+    std::ifstream count_file("test_data/kirov.mp3");
+    Demux count_demux(count_file);
+    auto count_decoder = count_demux.GetDecoder(0);
+    AudioDecoder<float> audio(count_decoder);
+    while (auto block = audio.ReadBlock()) input_samples += block->Size();
+  }
+
+  const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_PCM_S16LE);
+  AVCodecContext* ctx = avcodec_alloc_context3(codec);
+  AVCodecParameters* params = avcodec_parameters_alloc();
+  avcodec_parameters_from_context(params, ctx);
+  avcodec_free_context(&ctx);
+  params->sample_rate = 48000;
+  params->format = AV_SAMPLE_FMT_S16;
+  av_channel_layout_default(&params->ch_layout, 2);
+  params->bits_per_coded_sample = 16;
+  params->block_align = 4;
+
+  std::ofstream output_file("test_data/kirov_48k.wav",
+                            std::ios::out | std::ios::trunc);
+  {
+    Mux mux(output_file, "wav", {params});
+    Encoder encoder = mux.GetEncoder(0);
+    AudioEncoder<int16_t> audio(encoder);
+    AudioResampler resampler(encoder);
+    while (auto frame = decoder.Read()) {
+      ASSERT_TRUE(resampler.Write(*frame, decoder.TimeBase()));
+      while (auto out = resampler.Read()) ASSERT_TRUE(audio.WriteFrame(*out));
+    }
+    ASSERT_TRUE(resampler.Flush());
+    while (auto out = resampler.Read()) ASSERT_TRUE(audio.WriteFrame(*out));
+    audio.Flush();
+  }
+  avcodec_parameters_free(&params);
+  output_file.close();
+
+  std::ifstream wav_file("test_data/kirov_48k.wav");
+  Demux wav(wav_file);
+  ASSERT_EQ(wav.StreamsCount(), 1);
+  auto wav_decoder = wav.GetDecoder(0);
+  EXPECT_EQ(wav_decoder.data()->sample_rate, 48000);
+  EXPECT_EQ(wav_decoder.data()->ch_layout.nb_channels, 2);
+  AudioDecoder<int16_t> audio(wav_decoder);
+  int64_t output_samples = 0;
+  while (auto block = audio.ReadBlock()) output_samples += block->Size();
+  EXPECT_NEAR(output_samples, input_samples * 48000.0 / 44100, 1);
+}
+
+}  // namespace
+}  // namespace potamos
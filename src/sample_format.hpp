@@ -0,0 +1,377 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <type_traits>
+
+extern "C" {
+#include <libavutil/samplefmt.h>
+}
+
+#include "interleave.hpp"
+
+namespace potamos {
+
+// Sample conversions follow libswresample: integers are scaled by powers of
+// two, rounded to nearest and clipped; narrowing between integers truncates.
+
+template <typename SampleType>
+struct SampleTraits;
+
+template <>
+struct SampleTraits<uint8_t> {
+  static constexpr AVSampleFormat kFormat = AV_SAMPLE_FMT_U8;
+  static constexpr int kBits = 8;
+};
+template <>
+struct SampleTraits<int16_t> {
+  static constexpr AVSampleFormat kFormat = AV_SAMPLE_FMT_S16;
+  static constexpr int kBits = 16;
+};
+template <>
+struct SampleTraits<int32_t> {
+  static constexpr AVSampleFormat kFormat = AV_SAMPLE_FMT_S32;
+  static constexpr int kBits = 32;
+};
+template <>
+struct SampleTraits<int64_t> {
+  static constexpr AVSampleFormat kFormat = AV_SAMPLE_FMT_S64;
+  static constexpr int kBits = 64;
+};
+template <>
+struct SampleTraits<float> {
+  static constexpr AVSampleFormat kFormat = AV_SAMPLE_FMT_FLT;
+  static constexpr int kBits = 32;
+};
+template <>
+struct SampleTraits<double> {
+  static constexpr AVSampleFormat kFormat = AV_SAMPLE_FMT_DBL;
+  static constexpr int kBits = 64;
+};
+
+// Whether samples stored as format can be read as SampleType directly.
+template <typename SampleType>
+bool IsSampleFormatOf(AVSampleFormat format) {
+  return av_get_packed_sample_fmt(format) == SampleTraits<SampleType>::kFormat;
+}
+
+enum class DitherMode { kNone, kTpdf };
+
+// Triangular noise of one least significant bit peak, added before rounding
+// on narrowing conversions to decorrelate the quantization error.
+class TpdfDither {
+ public:
+  explicit TpdfDither(uint32_t seed = 0x2545F491) : state_(seed | 1) {}
+
+  // Returns noise in [-1, 1) in units of the target's least significant bit.
+  float Next() {
+    return (int32_t(NextRandom()) * 0x1p-32f) +
+           (int32_t(NextRandom()) * 0x1p-32f);
+  }
+
+ private:
+  uint32_t NextRandom() {
+    state_ ^= state_ << 13;
+    state_ ^= state_ >> 17;
+    state_ ^= state_ << 5;
+    return state_;
+  }
+
+  uint32_t state_;
+};
+
+namespace internal {
+
+// 2^(bits - 1), the magnitude of full scale for integer samples.
+template <typename T>
+constexpr double kFullScale =
+    double(uint64_t(1) << (SampleTraits<T>::kBits - 1));
+
+template <typename T>
+int64_t ToSigned(T x) {
+  if constexpr (std::is_same_v<T, uint8_t>) return int64_t(x) - 0x80;
+  return int64_t(x);
+}
+
+template <typename T>
+T FromSigned(int64_t x) {
+  if constexpr (std::is_same_v<T, uint8_t>) return T(x + 0x80);
+  return T(x);
+}
+
+// Rounds a value already scaled to the integer range and clips it.
+template <typename To, typename F>
+To RoundToSample(F y) {
+  constexpr F kFull = F(kFullScale<To>);
+  if constexpr (SampleTraits<To>::kBits == 64) {
+    if (y >= kFull) return std::numeric_limits<To>::max();
+    if (y <= -kFull) return std::numeric_limits<To>::min();
+    return To(std::llrint(y));
+  } else {
+    const int64_t max = int64_t(kFull) - 1;
+    const int64_t v = std::llrint(std::clamp(y, -2 * kFull, 2 * kFull));
+    return FromSigned<To>(std::clamp<int64_t>(v, -max - 1, max));
+  }
+}
+
+template <typename From, typename To>
+constexpr bool kIsNarrowing =
+    std::is_integral_v<To> &&
+    (std::is_floating_point_v<From> ||
+     SampleTraits<From>::kBits > SampleTraits<To>::kBits);
+
+template <typename From, typename To>
+To ConvertSample(From x, TpdfDither* dither) {
+  if constexpr (std::is_same_v<From, To>) {
+    return x;
+  } else if constexpr (std::is_floating_point_v<From> &&
+                       std::is_floating_point_v<To>) {
+    return To(x);
+  } else if constexpr (std::is_floating_point_v<To>) {
+    return To(ToSigned(x)) * To(1.0 / kFullScale<From>);
+  } else if constexpr (std::is_floating_point_v<From>) {
+    From y = x * From(kFullScale<To>);
+    if (dither) y += dither->Next();
+    return RoundToSample<To>(y);
+  } else if constexpr (SampleTraits<To>::kBits > SampleTraits<From>::kBits) {
+    constexpr int kShift = SampleTraits<To>::kBits - SampleTraits<From>::kBits;
+    return FromSigned<To>(int64_t(uint64_t(ToSigned(x)) << kShift));
+  } else {
+    constexpr int kShift = SampleTraits<From>::kBits - SampleTraits<To>::kBits;
+    if (dither) {
+      return RoundToSample<To>(double(ToSigned(x)) / double(1ull << kShift) +
+                               dither->Next());
+    }
+    return FromSigned<To>(ToSigned(x) >> kShift);
+  }
+}
+
+#ifdef POTAMOS_X86
+
+// Vector kernels for the common integer <-> float conversions. They return
+// how many samples they converted, the scalar loop finishes the tail.
+
+inline int64_t ConvertS16ToFloatSse2(const int16_t* src, float* dst,
+                                     int64_t count) {
+  const __m128 scale = _mm_set1_ps(1.0f / (1 << 15));
+  int64_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+    const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+    const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+    _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+  }
+  return i;
+}
+
+inline int64_t ConvertS32ToFloatSse2(const int32_t* src, float* dst,
+                                     int64_t count) {
+  const __m128 scale = _mm_set1_ps(1.0f / (1u << 31));
+  int64_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    const __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(x), scale));
+  }
+  return i;
+}
+
+inline int64_t ConvertFloatToS16Sse2(const float* src, int16_t* dst,
+                                     int64_t count) {
+  const __m128 scale = _mm_set1_ps(1 << 15);
+  // Keeps cvtps in range, packs saturates the rest.
+  const __m128 low = _mm_set1_ps(-65536.0f), high = _mm_set1_ps(65536.0f);
+  int64_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128 a = _mm_mul_ps(_mm_loadu_ps(src + i), scale);
+    __m128 b = _mm_mul_ps(_mm_loadu_ps(src + i + 4), scale);
+    a = _mm_min_ps(_mm_max_ps(a, low), high);
+    b = _mm_min_ps(_mm_max_ps(b, low), high);
+    _mm_storeu_si128((__m128i*)(dst + i),
+                     _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+  }
+  return i;
+}
+
+inline int64_t ConvertFloatToS32Sse2(const float* src, int32_t* dst,
+                                     int64_t count) {
+  const __m128 scale = _mm_set1_ps(1u << 31);
+  int64_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    const __m128 x = _mm_mul_ps(_mm_loadu_ps(src + i), scale);
+    // cvtps gives 0x80000000 on positive overflow, flip it to 0x7fffffff.
+    const __m128i overflow = _mm_castps_si128(_mm_cmpge_ps(x, scale));
+    _mm_storeu_si128((__m128i*)(dst + i),
+                     _mm_xor_si128(_mm_cvtps_epi32(x), overflow));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) inline int64_t ConvertS16ToFloatAvx2(
+    const int16_t* src, float* dst, int64_t count) {
+  const __m256 scale = _mm256_set1_ps(1.0f / (1 << 15));
+  int64_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m256i x =
+        _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(src + i)));
+    _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) inline int64_t ConvertS32ToFloatAvx2(
+    const int32_t* src, float* dst, int64_t count) {
+  const __m256 scale = _mm256_set1_ps(1.0f / (1u << 31));
+  int64_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m256i x = _mm256_loadu_si256((const __m256i*)(src + i));
+    _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) inline int64_t ConvertFloatToS16Avx2(
+    const float* src, int16_t* dst, int64_t count) {
+  const __m256 scale = _mm256_set1_ps(1 << 15);
+  const __m256 low = _mm256_set1_ps(-65536.0f);
+  const __m256 high = _mm256_set1_ps(65536.0f);
+  int64_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256 a = _mm256_mul_ps(_mm256_loadu_ps(src + i), scale);
+    __m256 b = _mm256_mul_ps(_mm256_loadu_ps(src + i + 8), scale);
+    a = _mm256_min_ps(_mm256_max_ps(a, low), high);
+    b = _mm256_min_ps(_mm256_max_ps(b, low), high);
+    const __m256i packed =
+        _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+    _mm256_storeu_si256((__m256i*)(dst + i),
+                        _mm256_permute4x64_epi64(packed, 0xD8));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) inline int64_t ConvertFloatToS32Avx2(
+    const float* src, int32_t* dst, int64_t count) {
+  const __m256 scale = _mm256_set1_ps(1u << 31);
+  int64_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m256 x = _mm256_mul_ps(_mm256_loadu_ps(src + i), scale);
+    const __m256i overflow =
+        _mm256_castps_si256(_mm256_cmp_ps(x, scale, _CMP_GE_OQ));
+    _mm256_storeu_si256((__m256i*)(dst + i),
+                        _mm256_xor_si256(_mm256_cvtps_epi32(x), overflow));
+  }
+  return i;
+}
+
+template <typename From, typename To>
+int64_t ConvertSamplesSimd(SimdLevel level, const From* src, To* dst,
+                           int64_t count) {
+  const bool avx2 = level == SimdLevel::kAvx2;
+  if (level == SimdLevel::kScalar) return 0;
+  if constexpr (std::is_same_v<From, int16_t> && std::is_same_v<To, float>) {
+    return avx2 ? ConvertS16ToFloatAvx2(src, dst, count)
+                : ConvertS16ToFloatSse2(src, dst, count);
+  } else if constexpr (std::is_same_v<From, int32_t> &&
+                       std::is_same_v<To, float>) {
+    return avx2 ? ConvertS32ToFloatAvx2(src, dst, count)
+                : ConvertS32ToFloatSse2(src, dst, count);
+  } else if constexpr (std::is_same_v<From, float> &&
+                       std::is_same_v<To, int16_t>) {
+    return avx2 ? ConvertFloatToS16Avx2(src, dst, count)
+                : ConvertFloatToS16Sse2(src, dst, count);
+  } else if constexpr (std::is_same_v<From, float> &&
+                       std::is_same_v<To, int32_t>) {
+    return avx2 ? ConvertFloatToS32Avx2(src, dst, count)
+                : ConvertFloatToS32Sse2(src, dst, count);
+  }
+  return 0;
+}
+
+#endif  // POTAMOS_X86
+
+}  // namespace internal
+
+// Converts count samples. Dither is only applied when the conversion loses
+// precision, ie. from floating point or from a wider integer to an integer.
+template <typename From, typename To>
+void ConvertSamples(const From* src, To* dst, int64_t count,
+                    TpdfDither* dither = nullptr,
+                    SimdLevel level = BestSimdLevel()) {
+  if constexpr (std::is_same_v<From, To>) {
+    std::copy_n(src, count, dst);
+    return;
+  }
+  if constexpr (!internal::kIsNarrowing<From, To>) dither = nullptr;
+  int64_t done = 0;
+#ifdef POTAMOS_X86
+  if (!dither) done = internal::ConvertSamplesSimd(level, src, dst, count);
+#endif
+  for (int64_t i = done; i < count; ++i) {
+    dst[i] = internal::ConvertSample<From, To>(src[i], dither);
+  }
+}
+
+// Converts count samples stored as format (planar or packed alike, one plane
+// at a time) to SampleType. Returns false for unsupported formats.
+template <typename SampleType>
+bool ConvertToSamples(const uint8_t* src, AVSampleFormat format, int64_t count,
+                      SampleType* dst, TpdfDither* dither = nullptr) {
+  switch (av_get_packed_sample_fmt(format)) {
+    case AV_SAMPLE_FMT_U8:
+      ConvertSamples((const uint8_t*)src, dst, count, dither);
+      return true;
+    case AV_SAMPLE_FMT_S16:
+      ConvertSamples((const int16_t*)src, dst, count, dither);
+      return true;
+    case AV_SAMPLE_FMT_S32:
+      ConvertSamples((const int32_t*)src, dst, count, dither);
+      return true;
+    case AV_SAMPLE_FMT_S64:
+      ConvertSamples((const int64_t*)src, dst, count, dither);
+      return true;
+    case AV_SAMPLE_FMT_FLT:
+      ConvertSamples((const float*)src, dst, count, dither);
+      return true;
+    case AV_SAMPLE_FMT_DBL:
+      ConvertSamples((const double*)src, dst, count, dither);
+      return true;
+    default:
+      std::cerr << "Unsupported sample format " << format << std::endl;
+      return false;
+  }
+}
+
+// Converts count samples of SampleType to format, one plane at a time.
+template <typename SampleType>
+bool ConvertFromSamples(const SampleType* src, int64_t count,
+                        AVSampleFormat format, uint8_t* dst,
+                        TpdfDither* dither = nullptr) {
+  switch (av_get_packed_sample_fmt(format)) {
+    case AV_SAMPLE_FMT_U8:
+      ConvertSamples(src, (uint8_t*)dst, count, dither);
+      return true;
+    case AV_SAMPLE_FMT_S16:
+      ConvertSamples(src, (int16_t*)dst, count, dither);
+      return true;
+    case AV_SAMPLE_FMT_S32:
+      ConvertSamples(src, (int32_t*)dst, count, dither);
+      return true;
+    case AV_SAMPLE_FMT_S64:
+      ConvertSamples(src, (int64_t*)dst, count, dither);
+      return true;
+    case AV_SAMPLE_FMT_FLT:
+      ConvertSamples(src, (float*)dst, count, dither);
+      return true;
+    case AV_SAMPLE_FMT_DBL:
+      ConvertSamples(src, (double*)dst, count, dither);
+      return true;
+    default:
+      std::cerr << "Unsupported sample format " << format << std::endl;
+      return false;
+  }
+}
+
+}  // namespace potamos
@@ -0,0 +1,113 @@
+#include "sample_format.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+namespace potamos {
+namespace {
+
+using testing::ElementsAre;
+
+TEST(SampleFormatTest, IntegerToFloat) {
+  std::vector<int16_t> s16 = {0, 16384, -32768, 32767};
+  std::vector<float> out(s16.size());
+  ConvertSamples(s16.data(), out.data(), s16.size());
+  EXPECT_THAT(out, ElementsAre(0.0f, 0.5f, -1.0f, 32767 / 32768.0f));
+
+  std::vector<uint8_t> u8 = {128, 0, 192};
+  std::vector<double> out_dbl(u8.size());
+  ConvertSamples(u8.data(), out_dbl.data(), u8.size());
+  EXPECT_THAT(out_dbl, ElementsAre(0.0, -1.0, 0.5));
+}
+
+TEST(SampleFormatTest, FloatToIntegerRoundsAndClips) {
+  std::vector<float> flt = {0.0f, 0.5f, -1.0f, 1.0f, 2.0f, -3.0f, 1e10f};
+  std::vector<int16_t> s16(flt.size());
+  ConvertSamples(flt.data(), s16.data(), flt.size());
+  EXPECT_THAT(s16,
+              ElementsAre(0, 16384, -32768, 32767, 32767, -32768, 32767));
+
+  std::vector<int32_t> s32(flt.size());
+  ConvertSamples(flt.data(), s32.data(), flt.size());
+  EXPECT_THAT(s32, ElementsAre(0, 1 << 30, INT32_MIN, INT32_MAX, INT32_MAX,
+                               INT32_MIN, INT32_MAX));
+
+  std::vector<uint8_t> u8(flt.size());
+  ConvertSamples(flt.data(), u8.data(), flt.size());
+  EXPECT_THAT(u8, ElementsAre(128, 192, 0, 255, 255, 0, 255));
+}
+
+TEST(SampleFormatTest, IntegerToInteger) {
+  std::vector<int16_t> s16 = {1, -1, -32768};
+  std::vector<int32_t> s32(s16.size());
+  ConvertSamples(s16.data(), s32.data(), s16.size());
+  EXPECT_THAT(s32, ElementsAre(1 << 16, -(1 << 16), INT32_MIN));
+
+  std::vector<int16_t> back(s32.size());
+  ConvertSamples(s32.data(), back.data(), s32.size());
+  EXPECT_EQ(back, s16);
+}
+
+TEST(SampleFormatTest, SimdMatchesScalar) {
+  std::mt19937 random(42);
+  std::uniform_real_distribution<float> amplitude(-1.2f, 1.2f);
+  std::vector<float> flt(1001);
+  for (float& sample : flt) sample = amplitude(random);
+  std::vector<int16_t> s16(flt.size()), s16_scalar(flt.size());
+  std::vector<int32_t> s32(flt.size()), s32_scalar(flt.size());
+  std::vector<float> from_s16(flt.size()), from_s16_scalar(flt.size());
+  std::vector<float> from_s32(flt.size()), from_s32_scalar(flt.size());
+
+  ConvertSamples(flt.data(), s16_scalar.data(), flt.size(), nullptr,
+                 SimdLevel::kScalar);
+  ConvertSamples(flt.data(), s32_scalar.data(), flt.size(), nullptr,
+                 SimdLevel::kScalar);
+  ConvertSamples(s16_scalar.data(), from_s16_scalar.data(), flt.size(),
+                 nullptr, SimdLevel::kScalar);
+  ConvertSamples(s32_scalar.data(), from_s32_scalar.data(), flt.size(),
+                 nullptr, SimdLevel::kScalar);
+  for (SimdLevel level : {SimdLevel::kSse2, SimdLevel::kAvx2}) {
+    if (level > BestSimdLevel()) continue;
+    ConvertSamples(flt.data(), s16.data(), flt.size(), nullptr, level);
+    ConvertSamples(flt.data(), s32.data(), flt.size(), nullptr, level);
+    ConvertSamples(s16_scalar.data(), from_s16.data(), flt.size(), nullptr,
+                   level);
+    ConvertSamples(s32_scalar.data(), from_s32.data(), flt.size(), nullptr,
+                   level);
+    EXPECT_EQ(s16, s16_scalar) << "level " << int(level);
+    EXPECT_EQ(s32, s32_scalar) << "level " << int(level);
+    EXPECT_EQ(from_s16, from_s16_scalar) << "level " << int(level);
+    EXPECT_EQ(from_s32, from_s32_scalar) << "level " << int(level);
+  }
+}
+
+TEST(SampleFormatTest, TpdfDitherStaysWithinOneStep) {
+  TpdfDither dither;
+  double sum = 0;
+  const int count = 100000;
+  for (int i = 0; i < count; ++i) {
+    float noise = dither.Next();
+    ASSERT_GE(noise, -1.0f);
+    ASSERT_LT(noise, 1.0f);
+    sum += noise;
+  }
+  EXPECT_NEAR(sum / count, 0.0, 0.01);
+
+  // A constant between two steps is spread over both of them.
+  std::vector<float> flt(count, 0.25f / 32768);
+  std::vector<int16_t> s16(count);
+  ConvertSamples(flt.data(), s16.data(), count, &dither);
+  double mean = 0;
+  for (int16_t sample : s16) {
+    ASSERT_THAT(sample, testing::AnyOf(-1, 0, 1));
+    mean += sample;
+  }
+  EXPECT_NEAR(mean / count, 0.25, 0.02);
+}
+
+}  // namespace
+}  // namespace potamos
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+
+#include "rational.hpp"
+
+namespace potamos {
+
+// Time of an audio sample kept as the pts of its frame in the stream time
+// base plus the index of the sample in the frame. Moving to the next sample
+// is an integer increment, the exact time is only computed when asked for.
+class SampleTime {
+ public:
+  SampleTime() : SampleTime(0, Rational<int64_t>(1, 1), 0, 1) {}
+  SampleTime(int64_t pts, Rational<int64_t> time_base, int64_t offset,
+             int sample_rate)
+      : pts_(pts),
+        time_base_(time_base),
+        offset_(offset),
+        sample_rate_(sample_rate) {}
+  SampleTime(Rational<int64_t> time)
+      : SampleTime(time.Num(), Rational<int64_t>(1, time.Den()), 0, 1) {}
+
+  SampleTime& operator++() {
+    ++offset_;
+    return *this;
+  }
+  SampleTime& operator+=(int64_t samples) {
+    offset_ += samples;
+    return *this;
+  }
+  SampleTime operator+(int64_t samples) const {
+    SampleTime time = *this;
+    return time += samples;
+  }
+
+  bool operator==(const SampleTime& b) const {
+    return ToRational() == b.ToRational();
+  }
+
+  Rational<int64_t> ToRational() const {
+    return Rational<int64_t>(pts_, 1) * time_base_ +
+           Rational<int64_t>(offset_, sample_rate_);
+  }
+  double Seconds() const {
+    return pts_ * double(time_base_) + double(offset_) / sample_rate_;
+  }
+
+  operator Rational<int64_t>() const { return ToRational(); }
+  explicit operator double() const { return Seconds(); }
+
+  int64_t Pts() const { return pts_; }
+  const Rational<int64_t>& TimeBase() const { return time_base_; }
+  int64_t Offset() const { return offset_; }
+  int SampleRate() const { return sample_rate_; }
+
+ private:
+  int64_t pts_;
+  Rational<int64_t> time_base_;
+  int64_t offset_;
+  int sample_rate_;
+};
+
+}  // namespace potamos
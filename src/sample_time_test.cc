@@ -0,0 +1,35 @@
+#include "sample_time.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+namespace potamos {
+namespace {
+
+TEST(SampleTimeTest, FramePtsPlusOffset) {
+  SampleTime time(1000, Rational<int64_t>(1, 14112000), 0, 44100);
+  ++time;
+  time += 99;
+  EXPECT_EQ(time.Offset(), 100);
+  EXPECT_EQ(time.ToRational(), Rational<int64_t>(1000, 14112000) +
+                                   Rational<int64_t>(100, 44100));
+  EXPECT_DOUBLE_EQ(double(time), 1000 / 14112000.0 + 100 / 44100.0);
+}
+
+TEST(SampleTimeTest, FromRational) {
+  SampleTime time(Rational<int64_t>(3, 4));
+  EXPECT_EQ(Rational<int64_t>(time), Rational<int64_t>(3, 4));
+  EXPECT_EQ(time, SampleTime(3, Rational<int64_t>(1, 4), 0, 1));
+  EXPECT_EQ(time + 1, SampleTime(Rational<int64_t>(7, 4)));
+}
+
+TEST(SampleTimeTest, LongStreamsStayExact) {
+  // One week of 48kHz audio in a 1/705600000 time base.
+  const int64_t pts = int64_t(705600000) * 3600 * 24 * 7;
+  SampleTime time(pts, Rational<int64_t>(1, 705600000), 47999, 48000);
+  EXPECT_EQ(time.ToRational(),
+            Rational<int64_t>(int64_t(3600) * 24 * 7 * 48000 + 47999, 48000));
+}
+
+}  // namespace
+}  // namespace potamos
@@ -0,0 +1,311 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <optional>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/crc.h>
+#include <libavutil/mathematics.h>
+}
+
+#include "audio.hpp"
+#include "encoder.hpp"
+#include "interleave.hpp"
+#include "stream_data.hpp"
+#include "thread_pool.hpp"
+
+namespace potamos {
+
+struct SegmentOptions {
+  // Encoder frames per segment. Every segment opens an encoder of its own,
+  // which longer segments amortize.
+  int64_t segment_frames = 256;
+  // Frames a segment encoder also gets from either neighbour, whose packets
+  // are dropped. Codecs that delay their output or carry state from frame to
+  // frame need a few, e.g. mp3, which also needs its bit reservoir disabled
+  // with the "reservoir" = "0" codec option.
+  int64_t overlap_frames = 0;
+  // Worker threads; 0 uses std::thread::hardware_concurrency().
+  int threads = 0;
+  // Segments encoded ahead of the one being written out; 0 uses twice the
+  // thread count.
+  int max_pending = 0;
+  // Options every segment encoder is opened with.
+  EncoderOptions encoder;
+  DitherMode dither = DitherMode::kNone;
+};
+
+namespace internal {
+
+// Keeps the packets of a segment encoder.
+class PacketCollector : public PacketDestination {
+ public:
+  bool WriteNextPacket(Packet packet, const int stream_index) override {
+    packets_.push_back(std::move(packet));
+    return true;
+  }
+
+  std::vector<Packet> Take() { return std::move(packets_); }
+
+ private:
+  std::vector<Packet> packets_;
+};
+
+// FLAC frame headers count frames, or samples for variable block sizes, from
+// the start of the stream. Rewrites the count of a frame encoded on its own,
+// along with the header and frame checksums.
+inline bool RenumberFlacFrame(Packet& packet, int64_t frame, int64_t sample) {
+  const AVPacket* in = packet.data();
+  const uint8_t* data = in->data;
+  if (in->size < 8 || data[0] != 0xFF || (data[1] & 0xFE) != 0xF8) {
+    return false;
+  }
+  const bool variable = data[1] & 1;
+  // The count is coded like UTF-8, extended to 36 bits.
+  int ones = 0;
+  while (ones < 8 && (data[4] & (0x80 >> ones))) ++ones;
+  if (ones == 1 || ones == 8) return false;
+  const int length = ones == 0 ? 1 : ones;
+  const int block_size_code = data[2] >> 4;
+  const int sample_rate_code = data[2] & 0xF;
+  int header_size = 4 + length;
+  if (block_size_code == 6) header_size += 1;
+  if (block_size_code == 7) header_size += 2;
+  if (sample_rate_code == 12) header_size += 1;
+  if (sample_rate_code == 13 || sample_rate_code == 14) header_size += 2;
+  if (header_size + 3 > in->size) return false;
+
+  const int64_t count = variable ? sample : frame;
+  std::vector<uint8_t> out(data, data + 4);
+  if (count < 0x80) {
+    out.push_back(uint8_t(count));
+  } else {
+    int bytes = 2;
+    while (bytes < 7 && count >= (int64_t(1) << (5 * bytes + 1))) ++bytes;
+    out.push_back(uint8_t((0xFF00 >> bytes) | (count >> (6 * (bytes - 1)))));
+    for (int i = bytes - 2; i >= 0; --i) {
+      out.push_back(uint8_t(0x80 | ((count >> (6 * i)) & 0x3F)));
+    }
+  }
+  out.insert(out.end(), data + 4 + length, data + header_size);
+  out.push_back(
+      av_crc(av_crc_get_table(AV_CRC_8_ATM), 0, out.data(), out.size()));
+  out.insert(out.end(), data + header_size + 1, data + in->size - 2);
+  const uint16_t crc =
+      av_crc(av_crc_get_table(AV_CRC_16_ANSI), 0, out.data(), out.size());
+  out.push_back(crc & 0xFF);
+  out.push_back(crc >> 8);
+
+  Packet renumbered;
+  AVPacket* p = renumbered.data();
+  if (av_new_packet(p, out.size()) < 0) return false;
+  std::memcpy(p->data, out.data(), out.size());
+  av_packet_copy_props(p, in);
+  packet = std::move(renumbered);
+  return true;
+}
+
+}  // namespace internal
+
+// Encodes one audio stream on several cores. The samples are cut into
+// segments of whole encoder frames, each segment is encoded on a thread pool
+// by an encoder of its own, and the packets are written to the stream in
+// order with their timestamps moved to the segment's place in it.
+//
+// Suits codecs whose frames stand on their own, e.g. PCM and FLAC, and, with
+// SegmentOptions::overlap_frames, codecs with a short memory such as mp3.
+// FLAC frame numbers are rewritten to count from the start of the stream.
+// Headers a segment encoder updates at its end are dropped, so a FLAC
+// STREAMINFO keeps zero, i.e. unknown, for the length and checksum.
+template <typename SampleType>
+class SegmentedAudioEncoder {
+ public:
+  // `encoder` is the stream's encoder, e.g. from Mux::GetEncoder. It only
+  // provides the parameters and writes out the packets.
+  SegmentedAudioEncoder(Encoder& encoder, const SegmentOptions& options = {})
+      : encoder_(encoder),
+        options_(options),
+        pool_(options.threads),
+        channels_(encoder.data()->ch_layout.nb_channels),
+        sample_rate_(encoder.data()->sample_rate),
+        frame_size_(encoder.data()->frame_size > 0 ? encoder.data()->frame_size
+                                                   : 1024),
+        segment_size_(std::max<int64_t>(options.segment_frames, 1) *
+                      frame_size_),
+        overlap_(std::max<int64_t>(options.overlap_frames, 0) * frame_size_),
+        max_pending_(options.max_pending > 0 ? options.max_pending
+                                             : 2 * pool_.Threads()) {}
+
+  SegmentedAudioEncoder(const SegmentedAudioEncoder&) = delete;
+  SegmentedAudioEncoder& operator=(const SegmentedAudioEncoder&) = delete;
+
+  // Writes size samples given as one array per channel.
+  bool WriteBlock(const SampleType* const* channels, int64_t size) {
+    const size_t offset = pending_.size();
+    pending_.resize(offset + size * channels_);
+    Interleave(channels, channels_, size, pending_.data() + offset);
+    return Submit(false);
+  }
+
+  bool WriteBlock(const AudioBlock<SampleType>& block) {
+    return WriteBlock(block.channels(), block.Size());
+  }
+
+  // Writes size samples stored channel by channel, ie. with the layout of
+  // packed sample formats.
+  bool WriteInterleaved(const SampleType* samples, int64_t size) {
+    pending_.insert(pending_.end(), samples, samples + size * channels_);
+    return Submit(false);
+  }
+
+  // Encodes the rest of the samples and writes out every packet.
+  bool Flush() { return Submit(true) && Drain(0); }
+
+  int Channels() const { return channels_; }
+
+ private:
+  struct Segment {
+    // Samples of the stream the segment stands for.
+    int64_t start;
+    int64_t end;
+    // First sample its encoder got, start less the overlap.
+    int64_t from;
+    bool last;
+    std::future<std::optional<std::vector<Packet>>> packets;
+  };
+
+  // Hands every complete segment, followed by its overlap, to the pool; at
+  // the end of the stream also the rest. A segment is only handed out once
+  // more samples follow, so the stream always ends with a last segment.
+  bool Submit(bool last) {
+    if (failed_) return false;
+    const int64_t available = pending_start_ + pending_.size() / channels_;
+    while (available > next_start_ + segment_size_ + overlap_ ||
+           (last && available > next_start_)) {
+      Segment segment;
+      segment.start = next_start_;
+      segment.end = std::min(next_start_ + segment_size_, available);
+      segment.from = std::max<int64_t>(segment.start - overlap_, 0);
+      segment.last = segment.end == available && last;
+      const int64_t to = std::min(segment.end + overlap_, available);
+      std::vector<SampleType> samples(
+          pending_.begin() + (segment.from - pending_start_) * channels_,
+          pending_.begin() + (to - pending_start_) * channels_);
+      segment.packets = pool_.Submit(
+          [model = &encoder_, options = options_.encoder,
+           dither = options_.dither, channels = channels_,
+           samples = std::move(samples)] {
+            return Encode(*model, options, dither, channels, samples);
+          });
+      segments_.push_back(std::move(segment));
+
+      // What the next segment needs of the samples before it is kept.
+      next_start_ = segments_.back().end;
+      const int64_t keep = std::max<int64_t>(next_start_ - overlap_, 0);
+      pending_.erase(pending_.begin(),
+                     pending_.begin() + (keep - pending_start_) * channels_);
+      pending_start_ = keep;
+      if (!Drain(max_pending_)) return false;
+    }
+    return true;
+  }
+
+  static std::optional<std::vector<Packet>> Encode(
+      const Encoder& model, const EncoderOptions& options, DitherMode dither,
+      int channels, const std::vector<SampleType>& samples) {
+    internal::PacketCollector collector;
+    Encoder encoder(model, &collector, options);
+    if (encoder.data() == nullptr || !avcodec_is_open(encoder.data())) {
+      return std::nullopt;
+    }
+    AudioEncoder<SampleType> audio(encoder, dither);
+    if (!audio.WriteInterleaved(samples.data(), samples.size() / channels) ||
+        !audio.Flush()) {
+      return std::nullopt;
+    }
+    return collector.Take();
+  }
+
+  // Writes out the oldest segments until at most `pending` are in flight.
+  bool Drain(size_t pending) {
+    while (segments_.size() > pending) {
+      Segment segment = std::move(segments_.front());
+      segments_.pop_front();
+      auto packets = segment.packets.get();
+      if (!packets) {
+        std::cerr << "encoding the segment at sample " << segment.start
+                  << " failed" << std::endl;
+        failed_ = true;
+        return false;
+      }
+      if (!WriteSegment(segment, *packets)) {
+        failed_ = true;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Moves the packets to the segment's place in the stream and writes those
+  // that belong to it. The first segment keeps the encoder's priming packets
+  // and the last one its final packets.
+  bool WriteSegment(const Segment& segment, std::vector<Packet>& packets) {
+    const AVCodecContext* context = encoder_.data();
+    const AVRational samples = av_make_q(1, sample_rate_);
+    const int64_t offset =
+        av_rescale_q(segment.from, samples, context->time_base);
+    const int64_t start =
+        av_rescale_q(segment.start, samples, context->time_base);
+    const int64_t end = av_rescale_q(segment.end, samples, context->time_base);
+    for (Packet& packet : packets) {
+      AVPacket* p = packet.data();
+      if (p->pts != AV_NOPTS_VALUE) p->pts += offset;
+      if (p->dts != AV_NOPTS_VALUE) p->dts += offset;
+      if ((segment.start > 0 && p->pts < start) ||
+          (!segment.last && p->pts >= end)) {
+        continue;
+      }
+      // A segment encoder's updated headers describe only its segment.
+      av_packet_side_data_remove(p->side_data, &p->side_data_elems,
+                                 AV_PKT_DATA_NEW_EXTRADATA);
+      if (context->codec_id == AV_CODEC_ID_FLAC) {
+        const int64_t sample =
+            av_rescale_q(p->pts, context->time_base, samples);
+        if (!internal::RenumberFlacFrame(packet, sample / frame_size_,
+                                         sample)) {
+          std::cerr << "cannot renumber FLAC frame at sample " << sample
+                    << std::endl;
+          return false;
+        }
+      }
+      if (!encoder_.WritePacket(std::move(packet))) return false;
+    }
+    return true;
+  }
+
+  Encoder& encoder_;
+  SegmentOptions options_;
+  ThreadPool pool_;
+  int channels_;
+  int sample_rate_;
+  int64_t frame_size_;
+  int64_t segment_size_;
+  int64_t overlap_;
+  size_t max_pending_;
+
+  // Interleaved samples not yet handed out, from sample pending_start_.
+  std::vector<SampleType> pending_;
+  int64_t pending_start_ = 0;
+  int64_t next_start_ = 0;
+  std::deque<Segment> segments_;
+  bool failed_ = false;
+};
+
+}  // namespace potamos
@@ -0,0 +1,150 @@
+#include "segmented_encoder.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "audio.hpp"
+#include "demux.hpp"
+#include "mux.hpp"
+
+namespace potamos {
+namespace {
+
+AVCodecParameters* MakeParameters(AVCodecID codec_id, AVSampleFormat format) {
+  const AVCodec* codec = avcodec_find_encoder(codec_id);
+  AVCodecContext* ctx = avcodec_alloc_context3(codec);
+  AVCodecParameters* params = avcodec_parameters_alloc();
+  avcodec_parameters_from_context(params, ctx);
+  avcodec_free_context(&ctx);
+  params->sample_rate = 44100;
+  params->format = format;
+  av_channel_layout_default(&params->ch_layout, 2);
+  params->bits_per_coded_sample = 16;
+  params->bits_per_raw_sample = 16;
+  params->block_align = 4;
+  return params;
+}
+
+// Stereo s16, a chord on the left and a slow sweep on the right.
+std::vector<int16_t> MakeSamples(int64_t size) {
+  std::vector<int16_t> samples(size * 2);
+  for (int64_t i = 0; i < size; ++i) {
+    const double t = double(i) / 44100;
+    samples[2 * i] = int16_t((std::sin(t * 2 * M_PI * 440) +
+                              std::sin(t * 2 * M_PI * 554)) *
+                             8000);
+    samples[2 * i + 1] =
+        int16_t(std::sin(t * 2 * M_PI * (200 + 100 * t)) * 12000);
+  }
+  return samples;
+}
+
+std::string EncodeSegmented(const std::string& format,
+                            const AVCodecParameters* params,
+                            const std::vector<int16_t>& samples,
+                            const SegmentOptions& options) {
+  std::ostringstream output;
+  {
+    Mux mux(output, format, {params});
+    Encoder encoder = mux.GetEncoder(0, options.encoder);
+    SegmentedAudioEncoder<int16_t> audio(encoder, options);
+    // Writes that do not line up with segments or frames.
+    const int64_t size = samples.size() / 2;
+    for (int64_t offset = 0; offset < size; offset += 10000) {
+      const int64_t count = std::min<int64_t>(10000, size - offset);
+      EXPECT_TRUE(audio.WriteInterleaved(samples.data() + offset * 2, count));
+    }
+    EXPECT_TRUE(audio.Flush());
+  }
+  return output.str();
+}
+
+std::string EncodeSequential(const std::string& format,
+                             const AVCodecParameters* params,
+                             const std::vector<int16_t>& samples,
+                             const EncoderOptions& options = {}) {
+  std::ostringstream output;
+  {
+    Mux mux(output, format, {params});
+    Encoder encoder = mux.GetEncoder(0, options);
+    AudioEncoder<int16_t> audio(encoder);
+    audio.WriteInterleaved(samples.data(), samples.size() / 2);
+    audio.Flush();
+  }
+  return output.str();
+}
+
+std::vector<int16_t> Decode(const std::string& bytes) {
+  std::istringstream input(bytes);
+  Demux demux(input);
+  std::vector<int16_t> samples;
+  if (demux.StreamsCount() != 1) return samples;
+  auto decoder = demux.GetDecoder(0);
+  AudioDecoder<int16_t> audio(decoder);
+  while (auto sample = audio.Read()) {
+    samples.push_back(sample->sample(0));
+    samples.push_back(sample->sample(1));
+  }
+  return samples;
+}
+
+TEST(SegmentedAudioEncoderTest, PcmMatchesSequential) {
+  AVCodecParameters* params =
+      MakeParameters(AV_CODEC_ID_PCM_S16LE, AV_SAMPLE_FMT_S16);
+  const std::vector<int16_t> samples = MakeSamples(44100 * 3 + 123);
+  SegmentOptions options;
+  options.segment_frames = 3;
+  options.threads = 4;
+  const std::string segmented =
+      EncodeSegmented("wav", params, samples, options);
+  const std::string sequential = EncodeSequential("wav", params, samples);
+  avcodec_parameters_free(&params);
+
+  EXPECT_GT(segmented.size(), samples.size() * 2);
+  EXPECT_EQ(segmented, sequential);
+}
+
+TEST(SegmentedAudioEncoderTest, FlacIsLossless) {
+  AVCodecParameters* params =
+      MakeParameters(AV_CODEC_ID_FLAC, AV_SAMPLE_FMT_S16);
+  const std::vector<int16_t> samples = MakeSamples(44100 * 5 + 4321);
+  SegmentOptions options;
+  options.segment_frames = 4;
+  options.threads = 4;
+  const std::string segmented =
+      EncodeSegmented("flac", params, samples, options);
+  avcodec_parameters_free(&params);
+
+  const std::vector<int16_t> decoded = Decode(segmented);
+  ASSERT_EQ(decoded.size(), samples.size());
+  EXPECT_TRUE(decoded == samples);
+}
+
+TEST(SegmentedAudioEncoderTest, Mp3WithOverlapKeepsLength) {
+  AVCodecParameters* params =
+      MakeParameters(AV_CODEC_ID_MP3, AV_SAMPLE_FMT_S16P);
+  params->bit_rate = 192000;
+  const std::vector<int16_t> samples = MakeSamples(44100 * 4);
+  SegmentOptions options;
+  options.segment_frames = 16;
+  options.overlap_frames = 2;
+  options.threads = 4;
+  options.encoder.dictionary["reservoir"] = "0";
+  const std::string segmented =
+      EncodeSegmented("mp3", params, samples, options);
+  const std::string sequential =
+      EncodeSequential("mp3", params, samples, options.encoder);
+  avcodec_parameters_free(&params);
+
+  const std::vector<int16_t> decoded = Decode(segmented);
+  EXPECT_GE(decoded.size(), samples.size());
+  EXPECT_EQ(decoded.size(), Decode(sequential).size());
+}
+
+}  // namespace
+}  // namespace potamos
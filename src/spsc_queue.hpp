@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace potamos {
+
+namespace internal {
+
+// Spins briefly, then yields, then sleeps, so a waiting side costs little
+// CPU when the other side stalls on I/O.
+class Backoff {
+ public:
+  void Wait() {
+    if (count_ < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+#endif
+    } else if (count_ < 128) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    ++count_;
+  }
+
+ private:
+  int count_ = 0;
+};
+
+}  // namespace internal
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread. The capacity is rounded up to a power of two.
+template <typename T>
+class SpscQueue {
+ public:
+  explicit SpscQueue(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+    slots_.resize(size);
+    mask_ = size - 1;
+  }
+  SpscQueue(const SpscQueue&) = delete;
+  SpscQueue& operator=(const SpscQueue&) = delete;
+
+  // Producer side. Returns false if the queue is full.
+  bool TryPush(T&& value) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == slots_.size()) {
+      return false;
+    }
+    slots_[tail & mask_] = std::move(value);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Producer side. Waits while the queue is full; returns false if the queue
+  // is closed.
+  bool Push(T value) {
+    internal::Backoff backoff;
+    while (!closed_.load(std::memory_order_acquire)) {
+      if (TryPush(std::move(value))) return true;
+      backoff.Wait();
+    }
+    return false;
+  }
+
+  // Consumer side. Returns std::nullopt if the queue is empty.
+  std::optional<T> TryPop() {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) return std::nullopt;
+    std::optional<T> value = std::move(slots_[head & mask_]);
+    slots_[head & mask_].reset();
+    head_.store(head + 1, std::memory_order_release);
+    return value;
+  }
+
+  // Consumer side. Waits while the queue is empty; returns std::nullopt once
+  // the queue is closed and drained.
+  std::optional<T> Pop() {
+    internal::Backoff backoff;
+    while (true) {
+      if (auto value = TryPop()) return value;
+      if (closed_.load(std::memory_order_acquire)) return TryPop();
+      backoff.Wait();
+    }
+  }
+
+  // Either side. Wakes up waiting Push and Pop calls; values already queued
+  // can still be popped.
+  void Close() { closed_.store(true, std::memory_order_release); }
+  bool Closed() const { return closed_.load(std::memory_order_acquire); }
+
+  size_t Capacity() const { return slots_.size(); }
+  size_t Size() const {
+    const size_t head = head_.load(std::memory_order_acquire);
+    return tail_.load(std::memory_order_acquire) - head;
+  }
+
+ private:
+  std::vector<std::optional<T>> slots_;
+  size_t mask_;
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+  std::atomic<bool> closed_{false};
+};
+
+}  // namespace potamos
@@ -0,0 +1,54 @@
+#include "spsc_queue.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <thread>
+
+namespace potamos {
+namespace {
+
+TEST(SpscQueueTest, BoundedFifo) {
+  SpscQueue<std::unique_ptr<int>> queue(3);
+  EXPECT_EQ(queue.Capacity(), 4);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_TRUE(queue.TryPush(std::make_unique<int>(i)));
+  }
+  EXPECT_FALSE(queue.TryPush(std::make_unique<int>(4)));
+  EXPECT_EQ(queue.Size(), 4);
+  for (int i = 0; i < 4; ++i) {
+    auto value = queue.TryPop();
+    ASSERT_TRUE(value);
+    EXPECT_EQ(**value, i);
+  }
+  EXPECT_FALSE(queue.TryPop());
+}
+
+TEST(SpscQueueTest, CloseDrainsThenEnds) {
+  SpscQueue<int> queue(2);
+  EXPECT_TRUE(queue.Push(1));
+  queue.Close();
+  EXPECT_FALSE(queue.Push(2));
+  EXPECT_EQ(queue.Pop(), 1);
+  EXPECT_EQ(queue.Pop(), std::nullopt);
+}
+
+TEST(SpscQueueTest, ProducerAndConsumerThreads) {
+  SpscQueue<int64_t> queue(16);
+  const int64_t count = 200000;
+  std::thread producer([&] {
+    for (int64_t i = 0; i < count; ++i) ASSERT_TRUE(queue.Push(i));
+    queue.Close();
+  });
+  int64_t expected = 0;
+  while (auto value = queue.Pop()) {
+    ASSERT_EQ(*value, expected);
+    ++expected;
+  }
+  producer.join();
+  EXPECT_EQ(expected, count);
+}
+
+}  // namespace
+}  // namespace potamos
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include "demux.hpp"
+#include "mux.hpp"
+
+namespace potamos {
+
+// Moves the packets of some Demux streams into a Mux without decoding them,
+// to change the container or drop streams at I/O speed. Timestamps are
+// rescaled to the output streams' time bases; keyframe flags and side data
+// travel with the packets.
+class StreamCopy {
+ public:
+  // Codec parameters to create the Mux with so that its stream i takes the
+  // packets of input stream `streams[i]`.
+  static std::vector<const AVCodecParameters*> Parameters(
+      const Demux& demux, const std::vector<int>& streams) {
+    std::vector<const AVCodecParameters*> parameters;
+    for (int index : streams) {
+      parameters.push_back(demux.CodecParameters(index));
+    }
+    return parameters;
+  }
+
+  // Copies input stream `streams[i]` to output stream i. Only those streams
+  // are read from the input.
+  StreamCopy(Demux& demux, Mux& mux, const std::vector<int>& streams)
+      : demux_(demux), mux_(mux), outputs_(demux.StreamsCount(), -1) {
+    for (size_t i = 0; i < streams.size(); ++i) {
+      outputs_[streams[i]] = i;
+      demux_.SelectStream(streams[i]);
+      mux_.SetTimeBase(i, demux_.TimeBase(streams[i]));
+    }
+  }
+
+  // Copies the next packet. Returns false at the end of the input or when
+  // the packet cannot be written.
+  bool CopyNext() {
+    while (auto packet = demux_.read()) {
+      const int input = packet->StreamIndex();
+      if (outputs_[input] < 0) continue;
+      AVPacket* data = packet->data();
+      data->time_base = av_make_q(demux_.TimeBase(input).Num(),
+                                  demux_.TimeBase(input).Den());
+      // Byte offsets refer to the input.
+      data->pos = -1;
+      if (!mux_.WriteNextPacket(std::move(*packet), outputs_[input])) {
+        std::cerr << "stream copy failed to write a packet of stream "
+                  << input << std::endl;
+        return false;
+      }
+      ++packets_;
+      return true;
+    }
+    return false;
+  }
+
+  // Copies every remaining packet. Returns the number copied.
+  int64_t Run() {
+    while (CopyNext()) {
+    }
+    return packets_;
+  }
+
+  int64_t Packets() const { return packets_; }
+
+ private:
+  Demux& demux_;
+  Mux& mux_;
+  // Output stream of every input stream, -1 if it is not copied.
+  std::vector<int> outputs_;
+  int64_t packets_ = 0;
+};
+
+}  // namespace potamos
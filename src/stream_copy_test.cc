@@ -0,0 +1,87 @@
+#include "stream_copy.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "demux.hpp"
+#include "mux.hpp"
+
+namespace potamos {
+namespace {
+
+// Payloads of every packet of a stream.
+std::vector<std::string> ReadPayloads(const std::string& path, int stream) {
+  std::ifstream input_file(path);
+  Demux demux(input_file);
+  demux.SelectStream(stream);
+  std::vector<std::string> payloads;
+  while (auto packet = demux.read()) {
+    if (packet->StreamIndex() != stream) continue;
+    payloads.emplace_back((const char*)packet->data()->data,
+                          packet->data()->size);
+  }
+  return payloads;
+}
+
+TEST(StreamCopyTest, RewrapsMp3AsMatroska) {
+  const std::string output_path = "test_data/kirov_copy.mka";
+  int64_t packets = 0;
+  {
+    std::ifstream input_file("test_data/kirov.mp3");
+    Demux demux(input_file);
+    std::ofstream output_file(output_path, std::ios::out | std::ios::trunc);
+    Mux mux(output_file, "matroska", StreamCopy::Parameters(demux, {0}));
+    StreamCopy copy(demux, mux, {0});
+    packets = copy.Run();
+    EXPECT_EQ(copy.Packets(), packets);
+  }
+  EXPECT_GT(packets, 0);
+
+  std::ifstream output_file(output_path);
+  Demux output(output_file);
+  ASSERT_EQ(output.StreamsCount(), 1);
+  EXPECT_EQ(output.CodecParameters(0)->codec_id, AV_CODEC_ID_MP3);
+  output.SelectStream(0);
+  int64_t output_packets = 0;
+  while (auto packet = output.read()) {
+    EXPECT_TRUE(packet->data()->flags & AV_PKT_FLAG_KEY);
+    ++output_packets;
+  }
+  EXPECT_EQ(output_packets, packets);
+
+  EXPECT_EQ(ReadPayloads(output_path, 0),
+            ReadPayloads("test_data/kirov.mp3", 0));
+}
+
+TEST(StreamCopyTest, DropsAStream) {
+  const std::string two_streams = "test_data/two_streams.mka";
+  const std::string convert =
+      "ffmpeg -v quiet -i test_data/orders.mp3 -i test_data/kirov.mp3 "
+      "-map 0 -map 1 -c copy -y " + two_streams;
+  ASSERT_EQ(std::system(convert.c_str()), 0);
+
+  const std::string output_path = "test_data/second_stream.mka";
+  {
+    std::ifstream input_file(two_streams);
+    Demux demux(input_file);
+    ASSERT_EQ(demux.StreamsCount(), 2);
+    std::ofstream output_file(output_path, std::ios::out | std::ios::trunc);
+    Mux mux(output_file, "matroska", StreamCopy::Parameters(demux, {1}));
+    StreamCopy copy(demux, mux, {1});
+    EXPECT_GT(copy.Run(), 0);
+    EXPECT_FALSE(demux.StreamSelected(0));
+  }
+
+  std::ifstream output_file(output_path);
+  Demux output(output_file);
+  ASSERT_EQ(output.StreamsCount(), 1);
+  EXPECT_EQ(ReadPayloads(output_path, 0), ReadPayloads(two_streams, 1));
+}
+
+}  // namespace
+}  // namespace potamos
@@ -1,9 +1,13 @@
 #pragma once
 
+#include <cstdint>
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <mutex>
 #include <optional>
+#include <utility>
+#include <vector>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -14,27 +18,128 @@ extern "C" {
 
 namespace potamos {
 
-class Packet {
+struct PoolStats {
+  // AVPacket/AVFrame structs allocated because the pool was empty.
+  int64_t allocations = 0;
+  // Acquisitions served from the pool.
+  int64_t reuses = 0;
+  // Structs freed because the pool was full or cleared.
+  int64_t frees = 0;
+  // Structs currently waiting in the pool.
+  int64_t pooled = 0;
+};
+
+// Recycles unreferenced AVPacket/AVFrame structs so that steady-state
+// demuxing and decoding does not call av_*_alloc for every packet and frame.
+// Only the structs are recycled; the payload buffers are reference counted
+// by FFmpeg and released on Release().
+template <typename T, T* (*Alloc)(), void (*Unref)(T*), void (*Free)(T**)>
+class AVObjectPool {
  public:
-  Packet() { packet_ = av_packet_alloc(); }
-  Packet(const Packet& p) { packet_ = av_packet_clone(p.packet_); }
-  Packet(Packet&& p) {
-    packet_ = p.packet_;
-    p.packet_ = nullptr;
+  static constexpr size_t kDefaultMaxSize = 64;
+
+  AVObjectPool(size_t max_size = kDefaultMaxSize) : max_size_(max_size) {}
+  AVObjectPool(const AVObjectPool&) = delete;
+  AVObjectPool& operator=(const AVObjectPool&) = delete;
+  ~AVObjectPool() { Clear(); }
+
+  static AVObjectPool& Global() {
+    static AVObjectPool pool;
+    return pool;
   }
-  ~Packet() {
-    if (packet_ != nullptr) {
-      av_packet_unref(packet_);
+
+  T* Acquire() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!free_.empty()) {
+        T* object = free_.back();
+        free_.pop_back();
+        ++stats_.reuses;
+        return object;
+      }
+      ++stats_.allocations;
     }
+    T* object = Alloc();
+    if (object == nullptr) std::cerr << "pool allocation failed" << std::endl;
+    return object;
   }
 
+  void Release(T* object) {
+    if (object == nullptr) return;
+    Unref(object);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (free_.size() < max_size_) {
+        free_.push_back(object);
+        return;
+      }
+      ++stats_.frees;
+    }
+    Free(&object);
+  }
+
+  void Clear() {
+    std::vector<T*> objects;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      objects.swap(free_);
+      stats_.frees += objects.size();
+    }
+    for (T* object : objects) Free(&object);
+  }
+
+  void SetMaxSize(size_t max_size) {
+    std::vector<T*> excess;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      max_size_ = max_size;
+      while (free_.size() > max_size_) {
+        excess.push_back(free_.back());
+        free_.pop_back();
+      }
+      stats_.frees += excess.size();
+    }
+    for (T* object : excess) Free(&object);
+  }
+
+  PoolStats Stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    PoolStats stats = stats_;
+    stats.pooled = free_.size();
+    return stats;
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  size_t max_size_;
+  std::vector<T*> free_;
+  PoolStats stats_;
+};
+
+using PacketPool = AVObjectPool<AVPacket, av_packet_alloc, av_packet_unref,
+                                av_packet_free>;
+using FramePool =
+    AVObjectPool<AVFrame, av_frame_alloc, av_frame_unref, av_frame_free>;
+
+class Packet {
+ public:
+  Packet() : packet_(PacketPool::Global().Acquire()) {}
+  Packet(const Packet& p) : Packet() { av_packet_ref(packet_, p.packet_); }
+  Packet(Packet&& p) : packet_(p.packet_) { p.packet_ = nullptr; }
+  ~Packet() { PacketPool::Global().Release(packet_); }
+
   Packet& operator=(Packet&& p) {
-    packet_ = p.packet_;
-    p.packet_ = nullptr;
+    std::swap(packet_, p.packet_);
     return *this;
   }
   Packet& operator=(const Packet& p) {
-    packet_ = av_packet_clone(p.packet_);
+    if (this == &p) return *this;
+    if (packet_ == nullptr) {
+      packet_ = PacketPool::Global().Acquire();
+    } else {
+      av_packet_unref(packet_);
+    }
+    av_packet_ref(packet_, p.packet_);
     return *this;
   }
 
@@ -49,33 +154,31 @@ class Packet {
 
 class Frame {
  public:
-  Frame() { frame_ = av_frame_alloc(); }
-  Frame(int format, const AVChannelLayout* ch_layout, int nb_samples) {
-    frame_ = av_frame_alloc();
+  Frame() : frame_(FramePool::Global().Acquire()) {}
+  Frame(int format, const AVChannelLayout* ch_layout, int nb_samples)
+      : Frame() {
     frame_->format = format;
     frame_->nb_samples = nb_samples;
     av_channel_layout_copy(&frame_->ch_layout, ch_layout);
     int ret = av_frame_get_buffer(frame_, 0);
     if (ret < 0) std::cerr << "av_frame_get_buffer = " << ret << std::endl;
   }
-  Frame(const Frame& f) { frame_ = av_frame_clone(f.frame_); }
-  Frame(Frame&& f) {
-    frame_ = f.frame_;
-    f.frame_ = nullptr;
-  }
-  ~Frame() {
-    if (frame_ != nullptr) {
-      av_frame_unref(frame_);
-    }
-  }
+  Frame(const Frame& f) : Frame() { av_frame_ref(frame_, f.frame_); }
+  Frame(Frame&& f) : frame_(f.frame_) { f.frame_ = nullptr; }
+  ~Frame() { FramePool::Global().Release(frame_); }
 
   Frame& operator=(Frame&& f) {
-    frame_ = f.frame_;
-    f.frame_ = nullptr;
+    std::swap(frame_, f.frame_);
     return *this;
   }
   Frame& operator=(const Frame& f) {
-    frame_ = av_frame_clone(f.frame_);
+    if (this == &f) return *this;
+    if (frame_ == nullptr) {
+      frame_ = FramePool::Global().Acquire();
+    } else {
+      av_frame_unref(frame_);
+    }
+    av_frame_ref(frame_, f.frame_);
     return *this;
   }
 
@@ -86,4 +189,4 @@ class Frame {
   AVFrame* frame_;
 };
 
-}  // namespace potamos
\ No newline at end of file
+}  // namespace potamos
@@ -0,0 +1,59 @@
+#include "stream_data.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <utility>
+#include <vector>
+
+namespace potamos {
+namespace {
+
+TEST(StreamDataTest, PoolReusesReleasedObjects) {
+  PacketPool pool(2);
+  AVPacket* first = pool.Acquire();
+  AVPacket* second = pool.Acquire();
+  AVPacket* third = pool.Acquire();
+  EXPECT_EQ(pool.Stats().allocations, 3);
+
+  pool.Release(first);
+  pool.Release(second);
+  pool.Release(third);
+  EXPECT_EQ(pool.Stats().pooled, 2);
+  EXPECT_EQ(pool.Stats().frees, 1);
+
+  AVPacket* reused = pool.Acquire();
+  EXPECT_TRUE(reused == first || reused == second);
+  EXPECT_EQ(pool.Stats().allocations, 3);
+  EXPECT_EQ(pool.Stats().reuses, 1);
+  pool.Release(reused);
+
+  pool.Clear();
+  EXPECT_EQ(pool.Stats().pooled, 0);
+  EXPECT_EQ(pool.Stats().frees, 3);
+}
+
+TEST(StreamDataTest, PacketsAndFramesReturnToGlobalPool) {
+  { std::vector<Packet> warm_up(4); }
+  { std::vector<Frame> warm_up(4); }
+  const PoolStats packets = PacketPool::Global().Stats();
+  const PoolStats frames = FramePool::Global().Stats();
+
+  for (int i = 0; i < 100; ++i) {
+    Packet packet;
+    Packet copy = packet;
+    Packet moved = std::move(packet);
+    copy = moved;
+    Frame frame;
+    Frame frame_copy = frame;
+    frame_copy = std::move(frame);
+  }
+
+  EXPECT_EQ(PacketPool::Global().Stats().allocations, packets.allocations);
+  EXPECT_EQ(FramePool::Global().Stats().allocations, frames.allocations);
+  EXPECT_EQ(PacketPool::Global().Stats().pooled, packets.pooled);
+  EXPECT_EQ(FramePool::Global().Stats().pooled, frames.pooled);
+}
+
+}  // namespace
+}  // namespace potamos
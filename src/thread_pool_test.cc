@@ -0,0 +1,47 @@
+#include "thread_pool.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <future>
+#include <memory>
+#include <vector>
+
+namespace potamos {
+namespace {
+
+TEST(ThreadPoolTest, ResultsComeBackThroughFutures) {
+  ThreadPool pool(4);
+  EXPECT_EQ(pool.Threads(), 4);
+  std::vector<std::future<int>> results;
+  for (int i = 0; i < 100; ++i) {
+    results.push_back(pool.Submit([i] { return i * i; }));
+  }
+  for (int i = 0; i < 100; ++i) EXPECT_EQ(results[i].get(), i * i);
+}
+
+TEST(ThreadPoolTest, TakesMoveOnlyTasks) {
+  ThreadPool pool(2);
+  auto value = std::make_unique<int>(7);
+  auto result =
+      pool.Submit([value = std::move(value)] { return *value + 1; });
+  EXPECT_EQ(result.get(), 8);
+}
+
+TEST(ThreadPoolTest, DestructorRunsQueuedTasks) {
+  std::atomic<int> done{0};
+  {
+    ThreadPool pool(1);
+    for (int i = 0; i < 50; ++i) pool.Submit([&done] { ++done; });
+  }
+  EXPECT_EQ(done, 50);
+}
+
+TEST(ThreadPoolTest, DefaultUsesEveryCore) {
+  ThreadPool pool;
+  EXPECT_GE(pool.Threads(), 1);
+}
+
+}  // namespace
+}  // namespace potamos
@@ -0,0 +1,280 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+
+#include "decoder.hpp"
+#include "encoder.hpp"
+#include "rational.hpp"
+#include "stream_data.hpp"
+
+namespace potamos {
+
+// Size and pixel format pictures are converted to. Zero sizes and
+// AV_PIX_FMT_NONE keep the decoder's.
+struct VideoFormat {
+  int width = 0;
+  int height = 0;
+  AVPixelFormat pixel_format = AV_PIX_FMT_NONE;
+  // libswscale algorithm, e.g. SWS_BILINEAR or SWS_POINT.
+  int scale_flags = SWS_BILINEAR;
+};
+
+namespace internal {
+
+// Picture buffers of one size, handed out as reference-counted AVBuffers.
+// A buffer returns to the pool once every frame using it is released; the
+// pool is rebuilt when the picture size changes.
+class PictureBufferPool {
+ public:
+  PictureBufferPool() = default;
+  PictureBufferPool(const PictureBufferPool&) = delete;
+  PictureBufferPool& operator=(const PictureBufferPool&) = delete;
+  // Frames still referencing the pool keep it alive until released.
+  ~PictureBufferPool() { av_buffer_pool_uninit(&pool_); }
+
+  // Backs `picture`, whose width, height and format are set, with a pooled
+  // buffer.
+  bool Allocate(AVFrame* picture) {
+    const int size = av_image_get_buffer_size(
+        (AVPixelFormat)picture->format, picture->width, picture->height,
+        kAlignment);
+    if (size < 0) {
+      std::cerr << "av_image_get_buffer_size = " << size << std::endl;
+      return false;
+    }
+    if (pool_ == nullptr || size_ != size) {
+      av_buffer_pool_uninit(&pool_);
+      pool_ = av_buffer_pool_init(size, av_buffer_allocz);
+      size_ = size;
+    }
+    picture->buf[0] = av_buffer_pool_get(pool_);
+    if (picture->buf[0] == nullptr) {
+      std::cerr << "av_buffer_pool_get failed" << std::endl;
+      return false;
+    }
+    av_image_fill_arrays(picture->data, picture->linesize,
+                         picture->buf[0]->data, (AVPixelFormat)picture->format,
+                         picture->width, picture->height, kAlignment);
+    picture->extended_data = picture->data;
+    return true;
+  }
+
+ private:
+  static constexpr int kAlignment = 32;
+
+  AVBufferPool* pool_ = nullptr;
+  int size_ = 0;
+};
+
+}  // namespace internal
+
+// A decoded picture. It holds a reference to the frame's buffers instead of
+// a copy, so it is cheap to pass around and stays valid after the decoder
+// moves on.
+class VideoFrame {
+ public:
+  VideoFrame(Frame frame, Rational<int64_t> time)
+      : frame_(std::move(frame)), time_(time) {}
+
+  const uint8_t* plane(int index) const { return frame_.data()->data[index]; }
+  int stride(int index) const { return frame_.data()->linesize[index]; }
+  // Presentation time of the picture.
+  const Rational<int64_t>& time() const { return time_; }
+
+  int Planes() const { return av_pix_fmt_count_planes(PixelFormat()); }
+  int Width() const { return frame_.data()->width; }
+  int Height() const { return frame_.data()->height; }
+  AVPixelFormat PixelFormat() const {
+    return (AVPixelFormat)frame_.data()->format;
+  }
+  bool KeyFrame() const { return frame_.data()->flags & AV_FRAME_FLAG_KEY; }
+
+  const Frame& frame() const { return frame_; }
+
+ private:
+  Frame frame_;
+  Rational<int64_t> time_;
+};
+
+// Reads pictures of a decoded video stream, optionally converted to another
+// size and pixel format with libswscale. Pictures already in the requested
+// format are passed through without copying.
+class VideoDecoder {
+ public:
+  VideoDecoder(Decoder& decoder, const VideoFormat& format = {})
+      : decoder_(decoder),
+        format_(format),
+        // A seek before construction still has its target to land on.
+        seek_epoch_(0),
+        width_(decoder_.CodecParameters()->width),
+        height_(decoder_.CodecParameters()->height),
+        pixel_format_((AVPixelFormat)decoder_.CodecParameters()->format) {}
+
+  VideoDecoder(const VideoDecoder&) = delete;
+  VideoDecoder& operator=(const VideoDecoder&) = delete;
+
+  ~VideoDecoder() { sws_freeContext(sws_); }
+
+  std::optional<VideoFrame> Read() {
+    if (decoder_.SeekEpoch() != seek_epoch_) {
+      seek_epoch_ = decoder_.SeekEpoch();
+      seek_target_ = decoder_.SeekTarget();
+    }
+    while (auto frame = decoder_.Read()) {
+      AVFrame* picture = frame->data();
+      if (picture->flags & AV_FRAME_FLAG_DISCARD) continue;
+      int64_t pts = picture->best_effort_timestamp;
+      if (pts == AV_NOPTS_VALUE) pts = picture->pts;
+      if (pts == AV_NOPTS_VALUE) pts = 0;
+      const Rational<int64_t> time =
+          Rational<int64_t>(pts, 1) * decoder_.TimeBase();
+      if (seek_target_ && BeforeSeekTarget(time, picture->duration)) {
+        continue;
+      }
+      seek_target_ = std::nullopt;
+      width_ = picture->width;
+      height_ = picture->height;
+      pixel_format_ = (AVPixelFormat)picture->format;
+      if (!NeedsConversion(picture)) {
+        return VideoFrame(std::move(*frame), time);
+      }
+      auto converted = Convert(picture);
+      if (!converted) return std::nullopt;
+      return VideoFrame(std::move(*converted), time);
+    }
+    return std::nullopt;
+  }
+
+  // Size and pixel format of the pictures Read returns, as of the last one
+  // read or, before that, as the stream declares.
+  int Width() const { return format_.width > 0 ? format_.width : width_; }
+  int Height() const { return format_.height > 0 ? format_.height : height_; }
+  AVPixelFormat PixelFormat() const {
+    return format_.pixel_format != AV_PIX_FMT_NONE ? format_.pixel_format
+                                                   : pixel_format_;
+  }
+
+ protected:
+  // A picture that ends before the seek target is dropped. Without a
+  // duration only pictures starting at or after it are kept.
+  bool BeforeSeekTarget(const Rational<int64_t>& time, int64_t duration) {
+    const Rational<int64_t> end =
+        time + Rational<int64_t>(duration, 1) * decoder_.TimeBase();
+    return duration > 0 ? !(*seek_target_ < end) : time < *seek_target_;
+  }
+
+  bool NeedsConversion(const AVFrame* picture) const {
+    return (format_.width > 0 && format_.width != picture->width) ||
+           (format_.height > 0 && format_.height != picture->height) ||
+           (format_.pixel_format != AV_PIX_FMT_NONE &&
+            format_.pixel_format != picture->format);
+  }
+
+  std::optional<Frame> Convert(const AVFrame* picture) {
+    const int width = format_.width > 0 ? format_.width : picture->width;
+    const int height = format_.height > 0 ? format_.height : picture->height;
+    const AVPixelFormat pixel_format =
+        format_.pixel_format != AV_PIX_FMT_NONE
+            ? format_.pixel_format
+            : (AVPixelFormat)picture->format;
+    sws_ = sws_getCachedContext(sws_, picture->width, picture->height,
+                                (AVPixelFormat)picture->format, width, height,
+                                pixel_format, format_.scale_flags, nullptr,
+                                nullptr, nullptr);
+    if (sws_ == nullptr) {
+      std::cerr << "sws_getCachedContext failed" << std::endl;
+      return std::nullopt;
+    }
+
+    Frame frame;
+    AVFrame* out = frame.data();
+    out->width = width;
+    out->height = height;
+    out->format = pixel_format;
+    if (!pool_.Allocate(out)) return std::nullopt;
+    sws_scale(sws_, picture->data, picture->linesize, 0, picture->height,
+              out->data, out->linesize);
+    av_frame_copy_props(out, picture);
+    return frame;
+  }
+
+  Decoder& decoder_;
+  VideoFormat format_;
+  SwsContext* sws_ = nullptr;
+  internal::PictureBufferPool pool_;
+  int64_t seek_epoch_;
+  std::optional<Rational<int64_t>> seek_target_;
+  int width_;
+  int height_;
+  AVPixelFormat pixel_format_;
+};
+
+// Encodes pictures in the encoder's size and pixel format. MakeFrame hands
+// out pooled frames to draw into, so steady-state encoding does not allocate.
+// Thread count and type come from the EncoderOptions of the Encoder.
+class VideoEncoder {
+ public:
+  VideoEncoder(Encoder& encoder) : encoder_(encoder) {}
+
+  // A frame in the encoder's size and pixel format with unspecified
+  // contents. Its buffer returns to the pool once the frame is released and
+  // the encoder is done with it.
+  std::optional<Frame> MakeFrame() {
+    Frame frame;
+    AVFrame* picture = frame.data();
+    picture->width = Width();
+    picture->height = Height();
+    picture->format = PixelFormat();
+    if (!pool_.Allocate(picture)) return std::nullopt;
+    return frame;
+  }
+
+  // Encodes a picture whose pts is in the encoder's time base. A picture
+  // without pts follows the previous one by one tick, so with a time base
+  // of 1/frame rate pictures can simply be written in order.
+  bool Write(Frame frame) {
+    AVFrame* picture = frame.data();
+    if (picture->width != Width() || picture->height != Height() ||
+        picture->format != PixelFormat()) {
+      std::cerr << "VideoEncoder expects " << Width() << "x" << Height()
+                << " pictures in the encoder's pixel format" << std::endl;
+      return false;
+    }
+    if (picture->pts == AV_NOPTS_VALUE) picture->pts = next_pts_;
+    next_pts_ = picture->pts + 1;
+    return encoder_.Write(frame);
+  }
+
+  // Encodes pictures in order, e.g. a whole rendered batch. Stops at the
+  // first picture that cannot be written.
+  bool WriteAll(std::vector<Frame> frames) {
+    for (Frame& frame : frames) {
+      if (!Write(std::move(frame))) return false;
+    }
+    return true;
+  }
+
+  bool Flush() { return encoder_.Flush(); }
+
+  int Width() const { return encoder_.data()->width; }
+  int Height() const { return encoder_.data()->height; }
+  AVPixelFormat PixelFormat() const { return encoder_.data()->pix_fmt; }
+
+ protected:
+  Encoder& encoder_;
+  internal::PictureBufferPool pool_;
+  int64_t next_pts_ = 0;
+};
+
+}  // namespace potamos
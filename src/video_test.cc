@@ -0,0 +1,169 @@
+#include "video.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "demux.hpp"
+#include "mux.hpp"
+
+namespace potamos {
+namespace {
+
+// Two seconds of a 320x240 test pattern at 25 fps, a keyframe every 10
+// frames.
+const char* MakeTestVideo() {
+  static const std::string convert =
+      "ffmpeg -v quiet -f lavfi -i testsrc=duration=2:size=320x240:rate=25 "
+      "-c:v mpeg4 -g 10 -pix_fmt yuv420p -y test_data/testsrc.mkv";
+  EXPECT_EQ(std::system(convert.c_str()), 0);
+  return "test_data/testsrc.mkv";
+}
+
+TEST(VideoDecoderTest, ReadsFramesWithoutCopying) {
+  std::ifstream input_file(MakeTestVideo());
+  Demux demux(input_file);
+  ASSERT_EQ(demux.StreamsCount(), 1);
+  EXPECT_EQ(demux.Type(0), "Video");
+  auto codec = demux.GetDecoder(0);
+  VideoDecoder video(codec);
+  EXPECT_EQ(video.Width(), 320);
+  EXPECT_EQ(video.Height(), 240);
+  EXPECT_EQ(video.PixelFormat(), AV_PIX_FMT_YUV420P);
+
+  int frames = 0;
+  while (auto frame = video.Read()) {
+    EXPECT_EQ(frame->Width(), 320);
+    EXPECT_EQ(frame->Height(), 240);
+    EXPECT_EQ(frame->Planes(), 3);
+    EXPECT_GE(frame->stride(0), 320);
+    EXPECT_EQ(frame->time(), Rational<int64_t>(frames, 25));
+    EXPECT_EQ(frame->KeyFrame(), frames % 10 == 0);
+    VideoFrame view = *frame;
+    EXPECT_EQ(view.plane(0), frame->plane(0));
+    ++frames;
+  }
+  EXPECT_EQ(frames, 50);
+}
+
+TEST(VideoDecoderTest, ConvertsIntoPooledBuffers) {
+  std::ifstream input_file(MakeTestVideo());
+  Demux demux(input_file);
+  auto codec = demux.GetDecoder(0);
+  VideoDecoder video(codec, {160, 120, AV_PIX_FMT_RGB24});
+  EXPECT_EQ(video.Width(), 160);
+  EXPECT_EQ(video.PixelFormat(), AV_PIX_FMT_RGB24);
+
+  const uint8_t* released = nullptr;
+  int frames = 0;
+  while (auto frame = video.Read()) {
+    ASSERT_EQ(frame->PixelFormat(), AV_PIX_FMT_RGB24);
+    ASSERT_EQ(frame->Width(), 160);
+    ASSERT_EQ(frame->Height(), 120);
+    ASSERT_EQ(frame->Planes(), 1);
+    ASSERT_GE(frame->stride(0), 160 * 3);
+    EXPECT_EQ(frame->time(), Rational<int64_t>(frames, 25));
+    // The buffer of the previous, released frame is reused.
+    if (released != nullptr) {
+      EXPECT_EQ(frame->plane(0), released);
+    }
+    released = frame->plane(0);
+    ++frames;
+  }
+  EXPECT_EQ(frames, 50);
+}
+
+TEST(VideoDecoderTest, SeekToLandsOnTargetFrame) {
+  std::ifstream input_file(MakeTestVideo());
+  Demux demux(input_file);
+  auto codec = demux.GetDecoder(0);
+  VideoDecoder video(codec);
+  ASSERT_TRUE(video.Read());
+
+  for (Rational<int64_t> target :
+       {Rational<int64_t>(1, 1), Rational<int64_t>(13, 25),
+        Rational<int64_t>(3, 10)}) {
+    ASSERT_TRUE(demux.SeekTo(target));
+    auto frame = video.Read();
+    ASSERT_TRUE(frame);
+    // The frame shown at the target time.
+    EXPECT_FALSE(target < frame->time()) << double(target);
+    EXPECT_TRUE(target < frame->time() + Rational<int64_t>(1, 25))
+        << double(target);
+  }
+}
+
+// Encodes 50 flat grey pictures whose brightness grows with the frame
+// number and checks them after decoding.
+void EncodeAndCheck(const EncoderOptions& options) {
+  const std::string path = "test_data/rendered.mkv";
+  AVCodecParameters* params = avcodec_parameters_alloc();
+  params->codec_type = AVMEDIA_TYPE_VIDEO;
+  params->codec_id = AV_CODEC_ID_MPEG4;
+  params->width = 320;
+  params->height = 240;
+  params->format = AV_PIX_FMT_YUV420P;
+  params->bit_rate = 2000000;
+  {
+    std::ofstream output_file(path, std::ios::out | std::ios::trunc);
+    Mux mux(output_file, "matroska", {params});
+    Encoder encoder = mux.GetEncoder(0, options);
+    VideoEncoder video(encoder);
+    std::vector<Frame> batch;
+    for (int i = 0; i < 50; ++i) {
+      auto frame = video.MakeFrame();
+      ASSERT_TRUE(frame);
+      AVFrame* picture = frame->data();
+      for (int plane = 0; plane < 3; ++plane) {
+        const int height = plane == 0 ? 240 : 120;
+        const uint8_t value = plane == 0 ? 16 + i * 4 : 128;
+        for (int y = 0; y < height; ++y) {
+          std::memset(picture->data[plane] + y * picture->linesize[plane],
+                      value, picture->linesize[plane]);
+        }
+      }
+      batch.push_back(std::move(*frame));
+      if (batch.size() == 10) {
+        ASSERT_TRUE(video.WriteAll(std::move(batch)));
+        batch.clear();
+      }
+    }
+    ASSERT_TRUE(video.Flush());
+  }
+  avcodec_parameters_free(&params);
+
+  std::ifstream input_file(path);
+  Demux demux(input_file);
+  ASSERT_EQ(demux.StreamsCount(), 1);
+  auto codec = demux.GetDecoder(0);
+  VideoDecoder video(codec);
+  int frames = 0;
+  while (auto frame = video.Read()) {
+    EXPECT_EQ(frame->time(), Rational<int64_t>(frames, 25));
+    EXPECT_NEAR(frame->plane(0)[120 * frame->stride(0) + 160],
+                16 + frames * 4, 4);
+    ++frames;
+  }
+  EXPECT_EQ(frames, 50);
+}
+
+TEST(VideoEncoderTest, EncodesPooledFrames) {
+  EncoderOptions options;
+  options.time_base = Rational<int64_t>(1, 25);
+  EncodeAndCheck(options);
+}
+
+TEST(VideoEncoderTest, EncodesWithThreads) {
+  EncoderOptions options;
+  options.time_base = Rational<int64_t>(1, 25);
+  options.thread_count = 4;
+  EncodeAndCheck(options);
+}
+
+}  // namespace
+}  // namespace potamos